@@ -0,0 +1,41 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(5, 1000);
+	mcf::Mat<float> answer(3, 1000);
+
+	for (size_t j = 0; j < 1000; j++) {
+		for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+		for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 8, 3 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens({ 1, 2 }, coregen);
+
+	// setup matrices stocks pool for one batch only
+	ncf::StockPool<float> pool(net, 32);
+
+	// fit
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+	ncf::Batching batching = { 32 };
+
+	float e = net.fit(frame, batching, ncf::optimizer::Adam<float>(0.01f), 20, 0.0001f);
+
+	// output
+	std::cout << "Output (last batch):" << std::endl;
+	std::cout << pool << std::endl;
+
+	std::cout << "Total error " << e << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup computer
+	auto plat = ecl::System::getPlatform(0);
+	ecl::Computer video(0, plat, ecl::DEVICE::GPU);
+
+	// setup data (stays on the host, batches are uploaded one by one)
+	mcf::Mat<float> data(5, 1000);
+	mcf::Mat<float> answer(3, 1000);
+
+	for (size_t j = 0; j < 1000; j++) {
+		for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+		for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup functions
+	auto lrelu = "ret = v > 0 ? v : v * 0.1f;";
+	auto div_lrelu = "ret = v > 0 ? 1 : 0.1f;";
+	auto div_mse = "ret = 2 * v;";
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A, ecl::Computer& video) {
+		A.full(0.01f, video);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 8, 3 });
+	net.setActivations(lrelu);
+	net.setDerivatives({ 1 }, div_lrelu);
+	net.setCoreGens({ 1, 2 }, coregen);
+
+	// setup matrices stocks pool for one batch only
+	ncf::StockPool<float> pool(net, 32);
+	video << pool;
+
+	// fit
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, div_mse };
+	ncf::Batching batching = { 32 };
+
+	float e = net.fit(frame, batching, ncf::optimizer::Adam<float>(0.01f), 20, 0.0001f, video);
+	video >> pool;
+
+	// output
+	std::cout << "Output (last batch):" << std::endl;
+	std::cout << pool << std::endl;
+
+	std::cout << "Total error " << e << std::endl;
+
+	ecl::System::release();
+	return 0;
+}
@@ -0,0 +1,31 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 8, 3 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens({ 1, 2 }, coregen);
+
+	// setup matrices stocks pool: one slab for up to 64 examples
+	ncf::StockPool<float> pool(net, 1, 64);
+
+	// every request has its own batch size, the slab is never reallocated
+	for (size_t examples : { 1, 17, 64, 5, 33 }) {
+		mcf::Mat<float> in(5, examples);
+		in.full(1.0f);
+
+		pool.resize(examples);
+		net.query(in, pool);
+
+		std::cout << "Batch " << examples << ": " << pool.getLastStock().getConstOut()(0, examples - 1) << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <chrono>
+#include <NeuroCF/NeuroCF.hpp>
+
+size_t executionTime(const std::function<void()>& f) {
+	auto start = std::chrono::high_resolution_clock::now();
+	f();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(5, 16);
+	mcf::Mat<float> answer(3, 16);
+
+	for (size_t j = 0; j < 16; j++) {
+		for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+		for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 8, 3 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens({ 1, 2 }, coregen);
+
+	// compile: cores, grads and optimizer states are created here, not in the first step
+	ncf::optimizer::Adam<float> adam(0.01f);
+	ncf::ExecutionPlan<float> plan = net.compile(5, 16, adam);
+
+	// fit
+	ncf::FitFrame<float> frame = { data, answer, plan.getPool(), ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+
+	size_t first = executionTime([&]() { plan.fit(frame, adam, 1, 0.0f); });
+	size_t steady = executionTime([&]() { plan.fit(frame, adam, 1, 0.0f); });
+
+	float e = plan.fit(frame, adam, 500, 0.001f);
+
+	// output
+	std::cout << "First step " << first << " mcs, steady step " << steady << " mcs" << std::endl;
+	std::cout << plan.getPool() << std::endl;
+
+	std::cout << "Total error " << e << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+#include <iostream>
+#include <fstream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// write raw csv: 5 inputs and 3 answers per line
+	{
+		std::ofstream file("dataset.csv");
+		file << "x0,x1,x2,x3,x4,y0,y1,y2" << std::endl;
+
+		for (size_t j = 0; j < 100000; j++) {
+			float x[5];
+			for (size_t i = 0; i < 5; i++) x[i] = static_cast<float>((i + j) % 4);
+
+			for (size_t i = 0; i < 5; i++) file << x[i] << ",";
+			for (size_t i = 0; i < 3; i++) file << 0.5f * x[i + 1] + 1.0f << (i < 2 ? "," : "\n");
+		}
+	}
+
+	// parse on all cores into the neurons x examples layout
+	ncf::CSV<float> csv("dataset.csv", 5, ',', true);
+
+	std::cout << "Parsed " << csv.getData().getW() << " examples, " << csv.getBytes() << " bytes in " << csv.getSeconds() << " s" << std::endl;
+	std::cout << "Throughput " << csv.getThroughput() << " MiB/s" << std::endl;
+
+	// convert to the mappable binary format
+	ncf::Dataset<float>::save("dataset.ncfd", csv.getData(), csv.getAnswer(), 32);
+
+	ncf::Dataset<float> dataset("dataset.ncfd");
+	std::cout << "Dataset " << dataset.getExamples() << " examples in " << dataset.getBatchesCount() << " batches" << std::endl;
+
+	return 0;
+}
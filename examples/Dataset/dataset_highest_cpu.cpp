@@ -0,0 +1,54 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// write dataset once
+	{
+		mcf::Mat<float> data(5, 1000);
+		mcf::Mat<float> answer(3, 1000);
+
+		for (size_t j = 0; j < 1000; j++) {
+			for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+			for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+		}
+
+		ncf::Dataset<float>::save("dataset.ncfd", data, answer, 32);
+	}
+
+	// map dataset, batches are read straight from the page cache
+	ncf::Dataset<float> dataset("dataset.ncfd");
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 8, 3 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens({ 1, 2 }, coregen);
+
+	// setup matrices stocks pool for one batch
+	ncf::StockPool<float> pool(net, dataset.getBatchSize());
+
+	// fit
+	ncf::optimizer::Adam<float> adam(0.01f);
+	float e = 1.0f;
+
+	for (size_t epoch = 0; epoch < 20; epoch++) {
+		for (size_t b = 0; b < dataset.getBatchesCount(); b++) {
+			mcf::Mat<float> data = dataset.getData(b);
+			mcf::Mat<float> answer = dataset.getAnswer(b);
+
+			ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+			e = net.fit(frame, adam, 1, 0.0001f);
+		}
+	}
+
+	// output
+	std::cout << "Examples " << dataset.getExamples() << " in " << dataset.getBatchesCount() << " batches" << std::endl;
+	std::cout << "Total error " << e << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <NeuroCF/NeuroCF.hpp>
+
+size_t executionTime(const std::function<void()>& f, size_t times = 1) {
+	size_t total = 0;
+	for (size_t i = 0; i < times; i++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		auto end = std::chrono::high_resolution_clock::now();
+		total += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	}
+	return total / times;
+}
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(256, 1024);
+	mcf::Mat<float> answer(16, 1024);
+
+	for (size_t j = 0; j < 1024; j++) {
+		for (size_t i = 0; i < 256; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 16; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator: a few strong directions over weak noise, the decaying spectrum trained cores tend to have
+	std::mt19937 generator(7);
+	auto coregen = [&](mcf::Mat<float>& A) {
+		const size_t directions = 32;
+		float deviation = 1.0f / std::sqrt(static_cast<float>(A.getW()));
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+
+		std::vector<float> u(A.getH() * directions), v(directions * A.getW());
+		for (auto& x : u) x = normal(generator);
+		for (auto& x : v) x = normal(generator);
+
+		for (size_t i = 0; i < A.getH(); i++)
+			for (size_t j = 0; j < A.getW(); j++) {
+				float s = 0.0f;
+				for (size_t k = 0; k < directions; k++) s += u[i * directions + k] * v[k * A.getW() + j] / static_cast<float>(k + 1);
+				A(i, j) = deviation * (0.3f * s + 0.05f * normal(generator));
+			}
+	};
+
+	// setup net
+	ncf::Net<float> net({ 256, 1024, 1024, 16 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	// fit
+	ncf::StockPool<float> pool(net, 128);
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+	ncf::Batching batching = { 128 };
+
+	net.fit(frame, batching, ncf::optimizer::Adam<float>(0.001f), 5, 0.0001f);
+
+	mcf::Mat<float> batch(256, 128);
+	for (size_t j = 0; j < 128; j++)
+		for (size_t i = 0; i < 256; i++) batch(i, j) = data(i, j);
+
+	ncf::InferencePool<float> inference(net, 128);
+	std::cout << "Predict dense " << executionTime([&] { net.predict(batch, inference); }, 10) << " mcs" << std::endl;
+
+	// factorize every core so that ||W - U * V|| stays within 10% of ||W||
+	ncf::LowRankNet<float>* lowrank = nullptr;
+	std::cout << "Factorize " << executionTime([&] { lowrank = new ncf::LowRankNet<float>(net, 0.1f); }) << " mcs" << std::endl;
+
+	std::cout << "Ranks";
+	for (size_t i = 1; i < lowrank->getLayersCount(); i++) std::cout << " " << lowrank->getRank(i);
+	std::cout << " (0 stays dense)" << std::endl;
+
+	std::cout << "Predict low-rank " << executionTime([&] { lowrank->predict(batch, inference); }, 10) << " mcs" << std::endl;
+	std::cout << "FLOPs " << lowrank->getDenseFlops() << " -> " << lowrank->getFlops() << " per example" << std::endl;
+	std::cout << "Cores " << lowrank->getDenseSize() << " -> " << lowrank->getSize() << " bytes" << std::endl;
+	std::cout << "Output deviation " << lowrank->deviation(net, data, inference) << std::endl;
+	std::cout << "Error delta " << lowrank->delta(net, data, answer, inference, ncf::cost::mse<float>) << std::endl;
+
+	delete lowrank;
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup computer
+	auto plat = ecl::System::getPlatform(0);
+	ecl::Computer video(0, plat, ecl::DEVICE::GPU);
+
+	// setup data
+	mcf::Mat<float> data(5, 16);
+	mcf::Mat<float> answer(3, 16);
+
+	for (size_t j = 0; j < 16; j++) {
+		for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+		for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	video << data << answer;
+
+	// setup functions
+	auto div_mse = "ret = 2 * v;";
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A, ecl::Computer& video) {
+		for (size_t i = 0; i < A.getH(); i++)
+			for (size_t j = 0; j < A.getW(); j++) A(i, j) = 0.1f * static_cast<float>((i * 7 + j * 3) % 5) - 0.2f;
+		video << A;
+	};
+
+	// setup optimizers
+	ncf::optimizer::GD<float> gd(0.025f);
+	ncf::optimizer::Momentum<float> momentum(0.025f, 0.9f);
+	ncf::optimizer::Nesterov<float> nesterov(0.025f, 0.9f);
+	ncf::optimizer::Adam<float> adam(0.05f);
+
+	std::vector<std::pair<std::string, const ncf::Optimizer<float>*>> optimizers = {
+		{"GD", &gd}, {"Momentum", &momentum}, {"Nesterov", &nesterov}, {"Adam", &adam}
+	};
+
+	for (auto& p : optimizers) {
+		// setup net
+		ncf::Net<float> net({ 5, 8, 3 });
+		net.setActivations(ncf::policy::lrelu{});
+		net.setCoreGens({ 1, 2 }, coregen);
+
+		// setup matrices stocks pool
+		ncf::StockPool<float> pool(net, 16);
+		video << pool;
+
+		// fit
+		ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, div_mse };
+		float e = net.fit(frame, *p.second, 100, 0.0001f, video);
+
+		// output
+		std::cout << p.first << " error after 100 iterations " << e << std::endl;
+	}
+
+	// full-batch quasi-Newton
+	{
+		// setup net
+		ncf::Net<float> net({ 5, 8, 3 });
+		net.setActivations(ncf::policy::lrelu{});
+		net.setCoreGens({ 1, 2 }, coregen);
+
+		// setup matrices stocks pool
+		ncf::StockPool<float> pool(net, 16);
+		video << pool;
+
+		// fit
+		ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, div_mse };
+		float e = net.fit(frame, ncf::optimizer::LBFGS<float>(), 20, 0.0001f, video);
+
+		// output
+		std::cout << "LBFGS error after 20 iterations " << e << std::endl;
+	}
+
+	ecl::System::release();
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <cmath>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(64, 4096);
+	mcf::Mat<float> answer(8, 4096);
+
+	for (size_t j = 0; j < 4096; j++) {
+		for (size_t i = 0; i < 64; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 8; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.004f);
+	};
+
+	// setup deep net
+	std::vector<size_t> topology = { 64 };
+	for (size_t i = 0; i < 16; i++) topology.push_back(256);
+	topology.push_back(8);
+
+	ncf::Net<float> net(topology);
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	// recompute vs memory: keep every k-th layer's activations
+	size_t best = static_cast<size_t>(std::sqrt(static_cast<float>(net.getLayersCount())));
+	for (size_t k : { size_t(1), size_t(2), best, size_t(8) }) {
+		ncf::MemoryPlan<float> plan(net, 4096, k);
+		std::cout << "Interval " << k
+			<< ": peak " << plan.getPeakSize() * sizeof(float) / (1 << 20) << " MB"
+			<< " of " << plan.getNaiveSize() * sizeof(float) / (1 << 20) << " MB"
+			<< ", " << plan.getRecomputedCount() << " layers recomputed" << std::endl;
+	}
+
+	// setup matrices stocks pool over the checkpointed slab
+	ncf::MemoryPlan<float> plan(net, 4096, best);
+	ncf::StockPool<float> pool(net, plan);
+
+	// fit: query keeps the checkpoints, backward brings the segments back one by one
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+
+	float e = net.fit(frame, ncf::optimizer::Adam<float>(0.001f), 10, 0.0001f);
+
+	std::cout << "Total error " << e << std::endl;
+
+	return 0;
+}
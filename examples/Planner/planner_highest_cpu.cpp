@@ -0,0 +1,42 @@
+#include <iostream>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(64, 2048);
+	mcf::Mat<float> answer(8, 2048);
+
+	for (size_t j = 0; j < 2048; j++) {
+		for (size_t i = 0; i < 64; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 8; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup deep net
+	ncf::Net<float> net({ 64, 256, 256, 256, 256, 256, 256, 8 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	// plan the stocks by lifetime
+	ncf::MemoryPlan<float> plan(net, 2048);
+
+	std::cout << "Naive footprint " << plan.getNaiveSize() * sizeof(float) / (1 << 20) << " MB" << std::endl;
+	std::cout << "Planned peak " << plan.getPeakSize() * sizeof(float) / (1 << 20) << " MB" << std::endl;
+
+	// setup matrices stocks pool over the planned slab
+	ncf::StockPool<float> pool(net, plan);
+
+	// fit: errors, grads and updates are interleaved layer by layer
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+
+	float e = net.fit(frame, ncf::optimizer::Adam<float>(0.001f), 10, 0.0001f);
+
+	std::cout << "Total error " << e << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <NeuroCF/NeuroCF.hpp>
+
+size_t executionTime(const std::function<void()>& f, size_t times = 1) {
+	size_t total = 0;
+	for (size_t i = 0; i < times; i++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		auto end = std::chrono::high_resolution_clock::now();
+		total += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	}
+	return total / times;
+}
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(256, 1024);
+	mcf::Mat<float> answer(16, 1024);
+
+	for (size_t j = 0; j < 1024; j++) {
+		for (size_t i = 0; i < 256; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 16; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	std::mt19937 generator(7);
+	auto coregen = [&](mcf::Mat<float>& A) {
+		std::normal_distribution<float> normal(0.0f, 1.0f / std::sqrt(static_cast<float>(A.getW())));
+		for (size_t i = 0; i < A.getH(); i++)
+			for (size_t j = 0; j < A.getW(); j++) A(i, j) = normal(generator);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 256, 1024, 1024, 16 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	// fit
+	ncf::StockPool<float> pool(net, 128);
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+	ncf::Batching batching = { 128 };
+
+	net.fit(frame, batching, ncf::optimizer::Adam<float>(0.001f), 5, 0.0001f);
+
+	ncf::InferencePool<float> inference(net, 128);
+
+	mcf::Mat<float> batch(256, 128);
+	for (size_t j = 0; j < 128; j++)
+		for (size_t i = 0; i < 256; i++) batch(i, j) = data(i, j);
+
+	std::cout << "Predict dense " << executionTime([&] { net.predict(batch, inference); }, 10) << " mcs" << std::endl;
+	std::cout << "Dense error " << net.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+
+	// zero the smallest 80% of every core, each layer picks CSR or dense from a probe on 128 wide batches
+	net.prune(ncf::Sparsity{ 0.8 }, 128);
+
+	for (size_t i = 1; i < net.getLayersCount(); i++) {
+		size_t prev = net.getLayer(i - 1).getNeurons();
+		const ncf::SparseCore<float>& core = net.getLayer(i).getSparse(prev);
+		std::cout << "Layer " << i << " keeps " << core.getCount() << " of " << core.rows * core.cols
+			<< (net.getLayer(i).checkSparse(prev) ? ", sparse" : ", dense") << std::endl;
+	}
+
+	std::cout << "Predict pruned " << executionTime([&] { net.predict(batch, inference); }, 10) << " mcs" << std::endl;
+	std::cout << "Pruned error " << net.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+
+	// fine-tune: gradients only reach the kept weights
+	net.fit(frame, batching, ncf::optimizer::Adam<float>(0.0005f), 10, 0.0001f);
+	std::cout << "Fine-tuned error " << net.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <chrono>
+#include <NeuroCF/NeuroCF.hpp>
+
+size_t executionTime(const std::function<void()>& f, size_t times = 1) {
+	size_t total = 0;
+	for (size_t i = 0; i < times; i++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		auto end = std::chrono::high_resolution_clock::now();
+		total += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	}
+	return total / times;
+}
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(256, 1024);
+	mcf::Mat<float> answer(16, 1024);
+
+	for (size_t j = 0; j < 1024; j++) {
+		for (size_t i = 0; i < 256; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 16; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.002f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 256, 1024, 1024, 16 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	// fit
+	ncf::StockPool<float> pool(net, 128);
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+	ncf::Batching batching = { 128 };
+
+	net.fit(frame, batching, ncf::optimizer::Adam<float>(0.001f), 5, 0.0001f);
+
+	// quantize the trained cores, int8 per output row
+	ncf::QuantizedNet<float> quantized(net);
+
+	std::cout << "Cores int8 " << quantized.getSize() / 1024 << " KB" << std::endl;
+
+	// both run on the same inference pool
+	ncf::InferencePool<float> inference(net, 128);
+
+	mcf::Mat<float> batch(256, 128);
+	for (size_t j = 0; j < 128; j++)
+		for (size_t i = 0; i < 256; i++) batch(i, j) = data(i, j);
+
+	std::cout << "Predict float " << executionTime([&] { net.predict(batch, inference); }, 10) << " mcs" << std::endl;
+	std::cout << "Predict int8 " << executionTime([&] { quantized.predict(batch, inference); }, 10) << " mcs" << std::endl;
+
+	// accuracy cost of the quantization
+	std::cout << "Float error " << net.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+	std::cout << "Int8 error " << quantized.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+	std::cout << "Delta " << quantized.delta(net, data, answer, inference, ncf::cost::mse<float>) << std::endl;
+
+	return 0;
+}
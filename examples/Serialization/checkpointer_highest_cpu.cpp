@@ -0,0 +1,58 @@
+#include <iostream>
+#include <chrono>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(64, 2048);
+	mcf::Mat<float> answer(8, 2048);
+
+	for (size_t j = 0; j < 2048; j++) {
+		for (size_t i = 0; i < 64; i++) data(i, j) = static_cast<float>((i + j) % 4) * 0.25f;
+		for (size_t i = 0; i < 8; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 64, 512, 512, 8 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setCoreGens(coregen);
+
+	ncf::StockPool<float> pool(net, 128);
+	ncf::Batching batching = { 128 };
+
+	auto run = [&](ncf::Checkpointer<float>* checkpointer) {
+		ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float>, checkpointer };
+
+		auto start = std::chrono::high_resolution_clock::now();
+		float e = net.fit(frame, batching, ncf::optimizer::Adam<float>(0.001f), 5, 0.0001f);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms, error " << e << std::endl;
+	};
+
+	std::cout << "Fit" << std::endl;
+	run(nullptr);
+
+	// a snapshot every 16 steps, written by a background thread
+	ncf::Checkpointer<float> checkpointer("net.ncf", 16);
+
+	std::cout << "Fit with checkpoints" << std::endl;
+	run(&checkpointer);
+
+	checkpointer.wait();
+	std::cout << "Checkpoints written " << checkpointer.getWrittenCount() << std::endl;
+
+	// resume from the last checkpoint
+	ncf::Net<float> resumed;
+	resumed.load("net.ncf");
+
+	std::cout << "Resumed " << resumed.getLayersCount() << " layers" << std::endl;
+
+	return 0;
+}
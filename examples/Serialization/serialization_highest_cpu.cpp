@@ -0,0 +1,54 @@
+#include <iostream>
+#include <chrono>
+#include <NeuroCF/NeuroCF.hpp>
+
+int main()
+{
+	// setup data
+	mcf::Mat<float> data(5, 1000);
+	mcf::Mat<float> answer(3, 1000);
+
+	for (size_t j = 0; j < 1000; j++) {
+		for (size_t i = 0; i < 5; i++) data(i, j) = static_cast<float>((i + j) % 4);
+		for (size_t i = 0; i < 3; i++) answer(i, j) = 0.5f * data(i + 1, j) + 1.0f;
+	}
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		A.full(0.01f);
+	};
+
+	// setup net
+	ncf::Net<float> net({ 5, 64, 64, 3 });
+	net.setActivations(ncf::policy::lrelu{});
+	net.setActivations({ 3 }, ncf::policy::identity{});
+	net.setCoreGens(coregen);
+
+	// fit
+	ncf::StockPool<float> pool(net, 32);
+	ncf::FitFrame<float> frame = { data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+	ncf::Batching batching = { 32 };
+
+	net.fit(frame, batching, ncf::optimizer::Adam<float>(0.01f), 20, 0.0001f);
+
+	// save topology, activations and cores
+	net.save("net.ncf");
+
+	// load: the cores stay in the read-only mapped pages, nothing is copied
+	auto start = std::chrono::high_resolution_clock::now();
+
+	ncf::Net<float> served;
+	served.load("net.ncf", ncf::MAP::READ);
+
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Load " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " mcs" << std::endl;
+
+	// evaluate both
+	ncf::InferencePool<float> inference(net, 32);
+	ncf::InferencePool<float> served_inference(served, 32);
+
+	std::cout << "Trained error " << net.evaluate(data, answer, inference, ncf::cost::mse<float>) << std::endl;
+	std::cout << "Loaded error " << served.evaluate(data, answer, served_inference, ncf::cost::mse<float>) << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <NeuroCF/NeuroCF.hpp>
+
+size_t executionTime(const std::function<void()>& f, size_t times = 1) {
+	size_t total = 0;
+	for (size_t i = 0; i < times; i++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		auto end = std::chrono::high_resolution_clock::now();
+		total += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	}
+	return total / times;
+}
+
+int main()
+{
+	// setup data: bag of features, 20 of 8192 set per example
+	const size_t features = 8192;
+	const size_t examples = 2048;
+
+	mcf::Mat<float> data(features, examples);
+	mcf::Mat<float> answer(8, examples);
+	data.full(0.0f);
+
+	std::mt19937 generator(7);
+	std::uniform_int_distribution<size_t> feature(0, features - 1);
+	for (size_t j = 0; j < examples; j++) {
+		for (size_t k = 0; k < 20; k++) data(feature(generator), j) = 1.0f;
+		for (size_t i = 0; i < 8; i++) answer(i, j) = 0.5f * data(i * 1024 % features, j) + 0.25f;
+	}
+
+	// the same examples in compressed sparse columns
+	ncf::SparseInput<float> sparse;
+	sparse.build(data.getConstArray(), features, examples);
+	std::cout << "Nonzeros " << sparse.getCount() << " of " << features * examples << std::endl;
+
+	// setup core generator
+	auto coregen = [](mcf::Mat<float>& A) {
+		for (size_t i = 0; i < A.getH(); i++)
+			for (size_t j = 0; j < A.getW(); j++) A(i, j) = 0.01f * static_cast<float>((i * 7 + j * 3) % 11) - 0.05f;
+	};
+
+	// two equal nets, the input layer's relu keeps zeros at zero
+	ncf::Net<float> dense_net({ features, 256, 8 });
+	ncf::Net<float> sparse_net({ features, 256, 8 });
+	for (auto net : { &dense_net, &sparse_net }) {
+		net->setActivations(ncf::policy::relu{});
+		net->setActivations({ 2 }, ncf::policy::sigmoid{});
+		net->setCoreGens(coregen);
+	}
+
+	// fit
+	ncf::Batching batching = { 256 };
+
+	ncf::StockPool<float> dense_pool(dense_net, 256);
+	ncf::FitFrame<float> dense_frame = { data, answer, dense_pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+
+	ncf::StockPool<float> sparse_pool(sparse_net, 256);
+	ncf::SparseFrame<float> sparse_frame = { sparse, answer, sparse_pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float> };
+
+	float dense_error = 0.0f, sparse_error = 0.0f;
+	std::cout << "Dense epoch " << executionTime([&] {
+		dense_error = dense_net.fit(dense_frame, batching, ncf::optimizer::GD<float>(0.5f), 1, 0.0f);
+	}, 3) << " mcs" << std::endl;
+	std::cout << "Sparse epoch " << executionTime([&] {
+		sparse_error = sparse_net.fit(sparse_frame, batching, ncf::optimizer::GD<float>(0.5f), 1, 0.0f);
+	}, 3) << " mcs" << std::endl;
+
+	std::cout << "Error dense " << dense_error << " sparse " << sparse_error << std::endl;
+
+	return 0;
+}
@@ -2,7 +2,8 @@
 #include <chrono>
 #include <NeuroCF/NeuroCF.hpp>
 
-void executionTime(const std::function<void()>& f, size_t times = 1) {
+size_t executionTime(const std::function<void()>& f, size_t times = 1) {
+	size_t total = 0;
 	for (size_t i = 0; i < times; i++) {
 		auto start = std::chrono::high_resolution_clock::now();
 		f();
@@ -11,7 +12,9 @@ void executionTime(const std::function<void()>& f, size_t times = 1) {
 		auto mcs = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
 		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 		std::cout << mcs.count() << " mcs (" << ms.count() << " ms)" << std::endl;
+		total += mcs.count();
 	}
+	return total;
 }
 
 int main()
@@ -30,18 +33,54 @@ int main()
 
     // setup net
     ncf::Net<float> net({500, 200, 300});
-    net.setActivations(ncf::activation::lrelu<float>);
-    net.setDerivatives({1}, ncf::derivative::activation::lrelu<float>);
+    net.setActivations(ncf::policy::lrelu{});
     net.setCoreGens({1, 2}, coregen);
 
+    // all cores in one aligned slab
+    net.pack();
+
     // setup matrices stocks pools
     ncf::StockPool<float> pool(net, 1000);
 
+	// forward: separate gemm and activation passes vs fused epilogue
+	ncf::Layer<float>& il = net.getLayer(0);
+	ncf::Layer<float>& hl = net.getLayer(1);
+	ncf::Stock<float>& il_stock = pool.getStock(0);
+	ncf::Stock<float>& hl_stock = pool.getStock(1);
+
+	il.query(data, il_stock);
+	hl.createCore(il.getNeurons());
+
+	// lrelu derives from output, so stocks keep no preout of their own
+	mcf::Mat<float> preout(hl.getNeurons(), 1000);
+
+	// the same tiled gemm in both runs, so only the fusion is timed
+	const float* core = ncf::kernel::data(hl.getCore(il.getNeurons()));
+	const float* in = ncf::kernel::data(il_stock.getConstOut());
+	float* p = ncf::kernel::data(preout);
+	size_t neurons = hl.getNeurons(), prev_neurons = il.getNeurons();
+
+	std::cout << "Forward (gemm + activation)" << std::endl;
+	size_t separate = executionTime([&] {
+		ncf::kernel::gemm(core, in, neurons, prev_neurons, 1000, false, [&](size_t i, size_t j, const float* acc, size_t count) {
+			std::copy(acc, acc + count, p + i * 1000 + j);
+		});
+		ncf::kernel::map<float, &ncf::policy::lrelu::activation<float>>(p, ncf::kernel::data(hl_stock.getOut()), neurons * 1000);
+	}, 5);
+
+	std::cout << "Forward (fused, out only)" << std::endl;
+	size_t fused = executionTime([&] {
+		hl.query(il_stock, hl_stock);
+	}, 5);
+
+	std::cout << "Forward speedup " << static_cast<float>(separate) / fused << "x" << std::endl;
+
     // fit
 	ncf::FitFrame<float> frame = {data, answer, pool, ncf::cost::mse<float>, ncf::derivative::cost::mse<float>};
 
 	float e = 1.0f;
 
+	std::cout << "Fit" << std::endl;
 	executionTime([&] {
 		e = net.fit(frame, 0.025f, 5, 0.001f);
 	}, 5);
@@ -49,4 +88,4 @@ int main()
 	std::cout << "Total error " << e << std::endl;
 
     return 0;
-}
\ No newline at end of file
+}
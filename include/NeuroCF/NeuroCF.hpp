@@ -1,11 +1,326 @@
 #pragma once
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <thread>
+#include <type_traits>
 #include <variant>
+#if defined(__AVX2__) || defined(__AVX512VNNI__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
 #include "MatrixCF.hpp"
 
 namespace ncf{
     using namespace mcf;
     using namespace ecl;
 
+    // 16-bit storage formats: bfloat16 keeps the float exponent, IEEE half keeps more mantissa
+    enum class HALF{BF16, FP16};
+
+    // Kernels
+    namespace kernel{
+        // below this amount of elements OpenMP threads cost more than they give
+        constexpr std::size_t parallel_threshold = 1 << 15;
+
+        template<typename T>
+        T* data(Mat<T>&);
+        template<typename T>
+        const T* data(const Mat<T>&);
+        // target = Mat(data, h, w), MatrixCF's non-owning view: slabs are bound through it,
+        // and a Mat that copied the data instead throws rather than leaving the slab unused
+        template<typename T>
+        void view(Mat<T>& target, T* data, std::size_t h, std::size_t w, const std::string& where);
+
+        template<typename T, T(*f)(const T&)>
+        void map(const T* in, T* out, std::size_t count);
+
+        // output tile kept in registers by gemm before it is handed to the epilogue
+        constexpr std::size_t tile_rows = 4;
+        constexpr std::size_t tile_cols = 16;
+
+        template<typename T, typename E>
+        void gemm(const T* A, const T* B, std::size_t M, std::size_t K, std::size_t N, bool transpose_a, const E& epilogue);
+
+        template<typename T, T(*f)(const T&)>
+        void forward(const T* core, const T* in, T* preout, T* out, std::size_t neurons, std::size_t prev_neurons, std::size_t examples);
+
+        template<typename T, T(*df)(const T&)>
+        void backward(const T* next_core, const T* next_error, const T* preout, T* error, std::size_t neurons, std::size_t next_neurons, std::size_t examples);
+
+        // scale * div_cost(error) * prev_out^T -> grad, error is read once per tile of rows
+        template<typename T, typename F>
+        void gradient(const T* error, const T* prev_out, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale);
+
+        // CSR rows times dense K x N; a row's entries are walked once per column tile of sparse_cols
+        // and the tile is handed to the epilogue like in gemm
+        constexpr std::size_t sparse_cols = 4 * tile_cols;
+
+        template<typename T, typename E>
+        void spmm(const std::size_t* offsets, const std::uint32_t* columns, const T* values, const T* B, std::size_t M, std::size_t N, const E& epilogue);
+
+        // gradient on the entries of a CSR pattern only, the rest of grad is zeroed
+        template<typename T, typename F>
+        void sgradient(const std::size_t* offsets, const std::uint32_t* columns, const T* error, const T* prev_out, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale);
+
+        // dense M x K times CSC K x N: a tile of rows of A is gathered at each nonzero, so the cost is M * nonzeros;
+        // tiles go to the epilogue like in gemm
+        template<typename T, typename E>
+        void dsmm(const T* A, const std::size_t* offsets, const std::uint32_t* indices, const T* values, std::size_t M, std::size_t K, std::size_t N, const E& epilogue);
+
+        // gradient against a CSC prev_out: every nonzero adds one scaled error to its column of grad
+        template<typename T, typename F>
+        void cgradient(const T* error, const std::size_t* offsets, const std::uint32_t* indices, const T* values, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale);
+
+        // in-place fused optimizer updates
+        template<typename T>
+        void gd(T* X, const T* grad, std::size_t count, const T& learning_rate);
+        template<typename T>
+        void momentum(T* X, const T* grad, T* velocity, std::size_t count, const T& learning_rate, const T& momentum);
+        template<typename T>
+        void nesterov(T* X, const T* grad, T* velocity, std::size_t count, const T& learning_rate, const T& momentum);
+        template<typename T>
+        void adam(T* X, const T* grad, T* m, T* v, std::size_t count, const T& step_size, const T& beta1, const T& beta2, const T& epsilon);
+
+        // dst[:, c] = src[:, index[c]], rows of both are contiguous
+        template<typename T>
+        void gather(const T* src, T* dst, std::size_t rows, std::size_t src_cols, const std::size_t* index, std::size_t count);
+        // dst = src[rows, cols] for a src with src_cols columns
+        template<typename T>
+        void submatrix(const T* src, T* dst, std::size_t src_cols, const std::size_t* rows, std::size_t rows_count, const std::size_t* cols, std::size_t cols_count);
+        // sum of cost(answer - out) over the first count columns of a batch, answer read from column offset
+        template<typename T>
+        T cost(const Mat<T>& answer, std::size_t answer_cols, std::size_t offset, const Mat<T>& out, std::size_t count, const std::function<T(const T&)>& cost);
+
+        // symmetric int8 with one scale per row of A: q = round(A / scale), scale = max|row| / 127
+        template<typename T>
+        void quantizeRows(const T* A, std::int8_t* q, T* scale, std::size_t rows, std::size_t cols);
+        // the same per column of X, written transposed: column j of X becomes row j of q
+        template<typename T>
+        void quantizeColumns(const T* X, std::int8_t* q, T* scale, std::size_t rows, std::size_t cols);
+
+        // round to nearest even; out of range halves become infinities
+        std::uint16_t narrow(float, HALF);
+        float widen(std::uint16_t, HALF);
+        // the same over arrays, with F16C conversions for IEEE half when the build targets them;
+        // bfloat16 is a shift either way
+        template<typename T>
+        void narrow(const T* x, std::uint16_t* h, std::size_t count, HALF format);
+        template<typename T>
+        void widen(const std::uint16_t* h, T* x, std::size_t count, HALF format);
+
+        // gemm with A stored in 16 bits: a tile_rows x K strip is widened once and reused for every column tile,
+        // so A is read once at half the bytes and accumulation stays in T
+        template<typename T, typename E>
+        void hgemm(const std::uint16_t* A, HALF format, const T* B, std::size_t M, std::size_t K, std::size_t N, const E& epilogue);
+
+        // int8 dots run on AVX-512 VNNI or AVX2 when the build targets them, portable loops otherwise;
+        // vpdpbusd multiplies unsigned by signed bytes: the core rows A get their sign bit flipped
+        // (a ^ 0x80, a + qbias as unsigned), the activations Bt stay signed, and qgemm subtracts
+        // qbias * the sum of each Bt row from the dots
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        constexpr std::int32_t qbias = 128;
+        constexpr std::size_t qblock_rows = 4;
+        constexpr std::size_t qblock_cols = 4;
+#elif defined(__AVX2__)
+        constexpr std::int32_t qbias = 0;
+        constexpr std::size_t qblock_rows = 2;
+        constexpr std::size_t qblock_cols = 4;
+#else
+        constexpr std::int32_t qbias = 0;
+        constexpr std::size_t qblock_rows = 4;
+        constexpr std::size_t qblock_cols = 4;
+#endif
+
+        // R x C dots of rows of A against rows of Bt, all of length K, kept in registers
+        template<std::size_t R, std::size_t C>
+        void qblock(const std::int8_t* A, const std::int8_t* Bt, std::size_t K, std::int32_t (&acc)[R][C]);
+
+        // A is M x K, Bt is N x K, so every accumulator is an exact int32 dot of two contiguous rows;
+        // a tile row of accumulators goes to the epilogue like in gemm
+        template<typename E>
+        void qgemm(const std::int8_t* A, const std::int8_t* Bt, std::size_t M, std::size_t K, std::size_t N, const E& epilogue);
+
+        // vector primitives for full-batch methods
+        template<typename T>
+        T dot(const T* a, const T* b, std::size_t count);
+        template<typename T>
+        void axpy(const T& alpha, const T* x, T* y, std::size_t count);
+        template<typename T>
+        void scale(const T& alpha, T* x, std::size_t count);
+        template<typename T>
+        void copy(const T* x, T* y, std::size_t count);
+
+        // symmetric eigendecomposition of a row-major n x n A by Householder tridiagonalization and implicit QL:
+        // eigenvalues in descending order, A overwritten with the matching eigenvectors as rows
+        void eigen(double* A, double* values, std::size_t n);
+
+        namespace computer{
+            template<typename T>
+            std::string type();
+            template<typename T>
+            std::string header();
+
+            template<typename T>
+            ecl::ArgumentBase* arg(const Mat<T>&);
+
+            // programs are built once per source and reused
+            void compute(Computer&, const std::string& source, const std::string& name, const std::vector<ecl::ArgumentBase*>& args, const std::vector<std::size_t>& global);
+
+            template<typename T>
+            std::string backward(const std::string& derivative);
+            template<typename T>
+            std::string gradient(const std::string& div_cost);
+            template<typename T>
+            std::string optimizer();
+            template<typename T>
+            std::string blas();
+            // widening forward of a 16-bit core with the activation applied in place
+            template<typename T>
+            std::string half(const std::string& activation, HALF format);
+
+            // partial sums of dot are reduced on the host
+            constexpr std::size_t dot_groups = 256;
+        }
+    }
+
+    // Activations
+    namespace policy{
+        struct Tag{
+            static constexpr bool from_output = false;
+        };
+    }
+
+    template<typename P>
+    constexpr bool is_policy_v = std::is_base_of_v<policy::Tag, P>;
+
+    template<typename T>
+    struct Activation{
+        std::string name = "";
+
+        T(*activation)(const T&) = nullptr;
+        T(*derivative)(const T&) = nullptr;
+
+        void(*activation_kernel)(const T*, T*, std::size_t) = nullptr;
+        void(*derivative_kernel)(const T*, T*, std::size_t) = nullptr;
+
+        // core * in -> preout, activation(preout) -> out in one sweep, preout may be null
+        void(*forward_kernel)(const T*, const T*, T*, T*, std::size_t, std::size_t, std::size_t) = nullptr;
+        // (next_core^T * next_error) . derivative(preout) -> error, preout is left intact;
+        // with from_output the derivative is taken from out instead
+        void(*backward_kernel)(const T*, const T*, const T*, T*, std::size_t, std::size_t, std::size_t) = nullptr;
+
+        std::string computer_activation = "";
+        std::string computer_derivative = "";
+
+        // the derivative is a function of the activation's output, so no preout is kept
+        bool from_output = false;
+        T(*output_derivative)(const T&) = nullptr;
+        std::string computer_output_derivative = "";
+
+        template<typename P>
+        static Activation<T> make();
+
+        template<typename P>
+        static void add();
+        static bool check(const std::string&);
+        static const Activation<T>& get(const std::string&);
+
+    private:
+        static std::map<std::string, Activation<T>>& registry();
+    };
+
+    // Pruning
+    // nonzeros of a pruned core in compressed sparse rows, with the transpose so error gathers instead of scattering
+    template<typename T>
+    struct SparseCore{
+        std::size_t rows = 0;
+        std::size_t cols = 0;
+
+        std::vector<std::size_t> offsets;
+        std::vector<std::uint32_t> columns;
+        std::vector<T> values;
+
+        std::vector<std::size_t> transposed_offsets;
+        std::vector<std::uint32_t> transposed_columns;
+        std::vector<T> transposed_values;
+
+        // sparse products measured faster than dense ones on the probe batch
+        bool active = false;
+
+        // from a row-major rows x cols core
+        void build(const T* core, std::size_t rows, std::size_t cols);
+        // re-reads the kept entries after the dense core was updated in place
+        void sync(const T* core);
+        std::size_t getCount() const;
+    };
+
+    // Sparse input
+    // examples in compressed sparse columns: column j holds values[offsets[j] .. offsets[j + 1]) at rows indices[...]
+    template<typename T>
+    struct SparseInput{
+        std::size_t rows = 0;
+        std::size_t cols = 0;
+
+        std::vector<std::size_t> offsets;
+        std::vector<std::uint32_t> indices;
+        std::vector<T> values;
+
+        // from a row-major rows x cols matrix, keeping its nonzeros
+        void build(const T* data, std::size_t rows, std::size_t cols);
+        // columns index[0 .. count) of src, for batches
+        void gather(const SparseInput& src, const std::size_t* index, std::size_t count);
+        std::size_t getCount() const;
+    };
+
+    // Optimizers
+    template<typename T>
+    struct OptimizerState{
+        // all slots of one core back to back: slots * neurons x prev_neurons
+        Mat<T> buffer;
+        std::size_t slots = 0;
+        std::size_t step = 0;
+    };
+
+    template<typename T>
+    class Optimizer{
+    public:
+        virtual std::size_t getSlotsCount() const = 0;
+
+        virtual void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state) const = 0;
+        virtual void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state, Computer&) const = 0;
+
+        virtual ~Optimizer() = default;
+    };
+
+    namespace optimizer{
+        template<typename T>
+        class LBFGS;
+    }
+
     // Low-level API
     template<typename T>
     class Stock;
@@ -14,6 +329,8 @@ namespace ncf{
     class Layer{
     private:
         std::map<std::size_t, Mat<T>> core;
+        std::map<std::size_t, OptimizerState<T>> state;
+        std::map<std::size_t, SparseCore<T>> sparse;
         std::size_t neurons = 0;
 
         std::function<T(const T&)> activation = nullptr;
@@ -22,6 +339,8 @@ namespace ncf{
         std::string computer_activation = "";
         std::string computer_derivative = "";
 
+        Activation<T> policy;
+
         std::function<void(Mat<T>&)> coregen = nullptr;
 		std::function<void(Mat<T>&, Computer&)> computer_coregen = nullptr;
 
@@ -40,26 +359,58 @@ namespace ncf{
         friend Computer& operator>>(Computer&, Layer<U>&);
 
         bool checkCore(std::size_t) const;
-        void createCore(std::size_t);
-		void createCore(std::size_t, Computer&);
+        Mat<T>& createCore(std::size_t);
+		Mat<T>& createCore(std::size_t, Computer&);
         void releaseCore(std::size_t);
 
+        bool checkState(std::size_t, std::size_t) const;
+        void createState(std::size_t, std::size_t);
+        void createState(std::size_t, std::size_t, Computer&);
+        void releaseState(std::size_t);
+
+        // zeroes weights below threshold in magnitude and keeps a CSR copy of the core; host products use it
+        // when it measures faster on a batch of examples, and training keeps the pruned weights at zero
+        void prune(std::size_t prev_neurons, const T& threshold, std::size_t examples);
+        bool checkPruned(std::size_t) const;
+        // pruned and the CSR copy is the faster one
+        bool checkSparse(std::size_t) const;
+        const SparseCore<T>& getSparse(std::size_t) const;
+        // after the dense core was changed outside train
+        void syncSparse(std::size_t);
+        void releaseSparse(std::size_t);
+
+        // structured pruning, indices ascending: keepNeurons keeps rows of every core and optimizer state
+        // and shrinks the layer, keepInputs keeps columns of the core fed by prev_neurons and re-keys it
+        void keepNeurons(const std::vector<std::size_t>& kept);
+        void keepInputs(std::size_t prev_neurons, const std::vector<std::size_t>& kept);
+
         void setActivation(const std::function<T(const T&)>&);
         void setDerivative(const std::function<T(const T&)>&);
 
         void setActivation(const std::string&);
         void setDerivative(const std::string&);
 
+        void setActivation(const Activation<T>&);
+        template<typename P, typename = std::enable_if_t<is_policy_v<P>>>
+        void setActivation(const P&);
+
         void setCoreGen(const std::function<void(Mat<T>&)>&);
 		void setCoreGen(const std::function<void(Mat<T>&, Computer&)>&);
 
+        // replaces the core, e.g. by a view into a net weight arena
+        void setCore(std::size_t, Mat<T>&&);
+
         std::size_t getNeurons() const;
         Mat<T>& getCore(std::size_t);
         const Mat<T>& getConstCore(std::size_t) const;
+        OptimizerState<T>& getState(std::size_t);
         const std::function<T(const T&)>& getActivation() const;
         const std::function<T(const T&)>& getDerivative() const;
         const std::string& getComputerActivation() const;
         const std::string& getComputerDerivative() const;
+        const Activation<T>& getPolicy() const;
+        // stocks of such layers keep no preout
+        bool checkFromOutput() const;
         const std::function<void(Mat<T>&)>& getCoreGen() const;
 		const std::function<void(Mat<T>&, Computer&)>& getComputerCoreGen() const;
 
@@ -70,19 +421,43 @@ namespace ncf{
         void query(const Mat<T>& in, Mat<T>& preout, Mat<T>& out, const Layer<T>& prev);
         void query(const Mat<T>& in, Mat<T>& preout, Mat<T>& out, const Layer<T>& prev, Computer&);
 
+        // inference only: the core must exist, no preout is kept
+        void query(const Mat<T>& in, Mat<T>& out, const Layer<T>& prev) const;
+        void query(const Mat<T>& in, Mat<T>& out, const Layer<T>& prev, Computer&) const;
+
+        // with a core resolved by the caller, preout may be out;
+        // preout is left untouched when the layer derives from output
+        void query(const Mat<T>& in, Mat<T>& preout, Mat<T>& out, const Mat<T>& core) const;
+        void query(const Mat<T>& in, Mat<T>& preout, Mat<T>& out, const Mat<T>& core, Computer&) const;
+        void query(const Mat<T>& in, Mat<T>& preout, Mat<T>& out, const SparseCore<T>& core) const;
+
+        // sparse input: the activation maps the nonzeros only, so it has to keep zero at zero
+        void query(const SparseInput<T>& in, SparseInput<T>& out) const;
+        void query(const SparseInput<T>& in, Mat<T>& preout, Mat<T>& out, const Mat<T>& core) const;
+
         void error(const Mat<T>& answer, const Mat<T>& out, Mat<T>& error) const;
         void error(const Mat<T>& answer, const Mat<T>& out, Mat<T>& error, Computer&) const;
 
-        void error(const Mat<T>& next_error, Mat<T>& preout, Mat<T>& error, const Layer<T>& next) const;
-        void error(const Mat<T>& next_error, Mat<T>& preout, Mat<T>& error, const Layer<T>& next, Computer&) const;
+        void error(const Mat<T>& next_error, const Mat<T>& preout, Mat<T>& error, const Layer<T>& next) const;
+        void error(const Mat<T>& next_error, const Mat<T>& preout, Mat<T>& error, const Layer<T>& next, Computer&) const;
+
+        // preout is out when the layer derives from output
+        void error(const Mat<T>& next_error, const Mat<T>& preout, Mat<T>& error, const Mat<T>& next_core) const;
+        void error(const Mat<T>& next_error, const Mat<T>& preout, Mat<T>& error, const Mat<T>& next_core, Computer&) const;
+        void error(const Mat<T>& next_error, const Mat<T>& preout, Mat<T>& error, const SparseCore<T>& next_core) const;
 
         T cost(const Mat<T>& error, const std::function<T(const T&)>& cost) const;
 
-        void grad(Mat<T>& error, const Mat<T>& prev_out, Mat<T>& grad, const std::function<T(const T&)>& div_cost) const;
-        void grad(Mat<T>& error, const Mat<T>& prev_out, Mat<T>& grad, const std::string& div_cost, Computer&) const;
+        // a pruned core gets a gradient on its kept entries only
+        void grad(const Mat<T>& error, const Mat<T>& prev_out, Mat<T>& grad, const std::function<T(const T&)>& div_cost) const;
+        void grad(const Mat<T>& error, const Mat<T>& prev_out, Mat<T>& grad, const std::string& div_cost, Computer&) const;
+        void grad(const Mat<T>& error, const SparseInput<T>& prev_out, Mat<T>& grad, const std::function<T(const T&)>& div_cost) const;
 
-        void train(Mat<T>& grad, const Layer<T>& prev, const T& learning_rate);
-        void train(Mat<T>& grad, const Layer<T>& prev, const T& learning_rate, Computer& video);
+        void train(const Mat<T>& grad, const Layer<T>& prev, const T& learning_rate);
+        void train(const Mat<T>& grad, const Layer<T>& prev, const T& learning_rate, Computer& video);
+
+        void train(const Mat<T>& grad, const Layer<T>& prev, const Optimizer<T>& optimizer);
+        void train(const Mat<T>& grad, const Layer<T>& prev, const Optimizer<T>& optimizer, Computer& video);
 
         // High-level methods
         void query(const Mat<T>& in, Stock<T>& stock) const;
@@ -104,6 +479,9 @@ namespace ncf{
 
 		void train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate);
 		void train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate, Computer&);
+
+		void train(const Stock<T>& prev_stock, Stock<T>& stock, const Optimizer<T>& optimizer);
+		void train(const Stock<T>& prev_stock, Stock<T>& stock, const Optimizer<T>& optimizer, Computer&);
     };
 
     template<typename T>
@@ -118,6 +496,10 @@ namespace ncf{
     public:
         Stock(const Layer<T>&, std::size_t);
 
+        // views over external storage of at least neurons x examples each, e.g. a pool slab
+        void bind(T* preout, T* out, T* error, std::size_t examples);
+        void bindGrad(std::size_t prev_neurons, T* grad);
+
         void send(Computer&);
         void receive(Computer&);
         void grab(Computer&);
@@ -137,6 +519,8 @@ namespace ncf{
 
         const Mat<T>& getConstPreout() const;
         const Mat<T>& getConstOut() const;
+        // what the layer's derivative is mapped over: preout, or out when it derives from output
+        const Mat<T>& getConstDerivativeInput() const;
         const Mat<T>& getConstError() const;
         const Layer<T>& getLayer() const;
 
@@ -150,6 +534,9 @@ namespace ncf{
     template<typename T>
     class StockPool;
 
+    template<typename T>
+    class Checkpointer;
+
 	template<typename T>
 	struct FitFrame {
 		const Mat<T>& data;
@@ -157,6 +544,59 @@ namespace ncf{
 		StockPool<T>& pool;
 		std::function<T(const T&)> cost;
 		std::variant<std::function<T(const T&)>, std::string> div_cost;
+		// optional, counts every optimizer step of the fit
+		Checkpointer<T>* checkpointer = nullptr;
+	};
+
+	// mini-batch mode: the frame's pool is sized for one batch of examples
+	struct Batching {
+		std::size_t size;
+		bool shuffle = true;
+		std::size_t seed = 0;
+	};
+
+	// fraction of every core's weights, smallest in magnitude first, that pruning zeroes
+	struct Sparsity {
+		double fraction;
+	};
+
+	template<typename T>
+	class Prefetcher;
+
+    template<typename T>
+    class InferencePool;
+
+    template<typename T>
+    class MemoryPlan;
+
+    template<typename T>
+    class ExecutionPlan;
+
+    template<typename T>
+    class Dataset;
+
+    enum class MAP{READ, PRIVATE};
+
+    class MappedFile;
+
+	template<typename T>
+	struct StreamFrame {
+		Prefetcher<T>& prefetcher;
+		StockPool<T>& pool;
+		std::function<T(const T&)> cost;
+		std::variant<std::function<T(const T&)>, std::string> div_cost;
+		Checkpointer<T>* checkpointer = nullptr;
+	};
+
+	// host only: the sparse input reaches the first core through dsmm and cgradient
+	template<typename T>
+	struct SparseFrame {
+		const SparseInput<T>& data;
+		const Mat<T>& answer;
+		StockPool<T>& pool;
+		std::function<T(const T&)> cost;
+		std::function<T(const T&)> div_cost;
+		Checkpointer<T>* checkpointer = nullptr;
 	};
 
     template<typename T>
@@ -164,7 +604,53 @@ namespace ncf{
     private:
         std::vector<std::pair<Layer<T>*, bool>> layers;
 
+        // cores of consecutive layers back to back in one page aligned slab
+        T* arena = nullptr;
+        std::size_t arena_size = 0;
+        // set when the arena lives in the pages of a loaded weights file
+        MappedFile* mapping = nullptr;
+        // MAP::READ pages fault on a write, the arena is copied out before the first one
+        MAP map_mode = MAP::PRIVATE;
+        // bumped whenever layers are replaced or reshaped, execution plans remember it
+        std::size_t generation = 0;
+
+        // weights file: header, one record per layer, then the arena as pack lays it out
+        struct Header{
+            char magic[4];
+            std::uint32_t version;
+            std::uint32_t dtype;
+            std::uint32_t dtype_size;
+            std::uint64_t layers;
+            std::uint64_t table_offset;
+            std::uint64_t data_offset;
+            std::uint64_t data_size;
+        };
+        struct Record{
+            std::uint64_t neurons;
+            // the core's key, the previous layer's neurons
+            std::uint64_t prev_neurons;
+            // bytes from data_offset
+            std::uint64_t offset;
+            char activation[32];
+        };
+        static constexpr std::uint32_t version = 1;
+
+        Header layout(std::vector<Record>& records, const std::string& method) const;
+        void load(const std::string& path, MAP mode, bool copy);
+
         void checkStockPool(const StockPool<T>&, const std::string&) const;
+        // pack and load hand the layers Mat(T*, h, w) views of the arena, which MatrixCF must not copy;
+        // a net whose cores came out detached is unpacked before the throw
+        void checkViews(const std::string&);
+        // repacks a MAP::READ net into a fresh arena, called by every method that writes the cores
+        void makeWritable();
+        void checkInferencePool(const InferencePool<T>&, const std::string&) const;
+
+        void forward(StockPool<T>& pool);
+        void forward(StockPool<T>& pool, Computer&);
+
+        T fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error, Computer* video);
+        T fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error, Computer* video);
     public:
         Net();
         explicit Net(const std::vector<std::size_t>&);
@@ -183,6 +669,55 @@ namespace ncf{
 		void push_back(Layer<T>*);
 		Layer<T>* pop_back();
 
+        // moves the host cores into the arena, creating missing ones with the coregens;
+        // call before sending the net, the layers keep views into the arena
+        void pack();
+        void unpack();
+        bool checkPacked() const;
+
+        const T* getArena() const;
+        std::size_t getArenaSize() const;
+
+        // versioned binary file of the topology, activation names and cores; layers with
+        // custom functions are saved without a name and come back with no activation set
+        void save(const std::string& path) const;
+        // the bytes save would write, into a buffer that is reused across calls;
+        // the device overload reads the cores back first
+        void snapshot(std::vector<char>& image) const;
+        void snapshot(std::vector<char>& image, Computer&);
+        // replaces the layers, the cores are copied into a fresh arena;
+        // plans compiled before point at the freed layers and have to be compiled again
+        void load(const std::string& path);
+        // replaces the layers, the arena stays in the mapped pages: MAP::READ shares them
+        // read-only for inference, with MAP::PRIVATE a page is copied on its first write;
+        // train, backward, fit, prune, compile and receive copy a MAP::READ arena out first
+        void load(const std::string& path, MAP mode);
+        bool checkMapped() const;
+        std::size_t getGeneration() const;
+
+        // Layer::prune on every core, the dense/sparse crossover is measured per layer on batches of examples
+        void prune(const T& threshold, std::size_t examples);
+        void prune(const Sparsity& sparsity, std::size_t examples);
+
+        // neuron scores of a hidden layer: the L2 norm of its outgoing weights, a column of the next core,
+        // or that norm times the mean |out| of the neuron over the pool's last forward pass
+        std::vector<T> score(std::size_t layer) const;
+        std::vector<T> score(std::size_t layer, const StockPool<T>& pool) const;
+        // removes neurons of a hidden layer: their rows of its core and columns of the next one;
+        // pools, plans and device copies made before have to be created again, stale plans throw
+        void removeNeurons(std::size_t layer, const std::vector<std::size_t>& neurons);
+        // keeps the keep highest scoring neurons
+        void shrink(std::size_t layer, const std::vector<T>& scores, std::size_t keep);
+
+        // validates the chain for an input size and materializes everything the hot loop touches;
+        // the plan keeps raw pointers to layers, cores, grads and states, so load, push_back, pop_back
+        // and removeNeurons leave it stale and its query, backward and fit throw
+        ExecutionPlan<T> compile(std::size_t input, std::size_t batch);
+        ExecutionPlan<T> compile(std::size_t input, std::size_t batch, Computer&);
+
+        ExecutionPlan<T> compile(std::size_t input, std::size_t batch, const Optimizer<T>& optimizer);
+        ExecutionPlan<T> compile(std::size_t input, std::size_t batch, const Optimizer<T>& optimizer, Computer&);
+
         // total setters
         void setActivations(const std::function<T(const T&)>&);
         void setDerivatives(const std::function<T(const T&)>&);
@@ -190,6 +725,10 @@ namespace ncf{
         void setActivations(const std::string&);
         void setDerivatives(const std::string&);
 
+        void setActivations(const Activation<T>&);
+        template<typename P, typename = std::enable_if_t<is_policy_v<P>>>
+        void setActivations(const P&);
+
         void setCoreGens(const std::function<void(Mat<T>&)>&);
 		void setCoreGens(const std::function<void(Mat<T>&, Computer&)>&);
 
@@ -200,6 +739,10 @@ namespace ncf{
         void setActivations(const std::vector<std::size_t>&, const std::string&);
         void setDerivatives(const std::vector<std::size_t>&, const std::string&);
 
+        void setActivations(const std::vector<std::size_t>&, const Activation<T>&);
+        template<typename P, typename = std::enable_if_t<is_policy_v<P>>>
+        void setActivations(const std::vector<std::size_t>&, const P&);
+
         void setCoreGens(const std::vector<std::size_t>&, const std::function<void(Mat<T>&)>&);
 		void setCoreGens(const std::vector<std::size_t>&, const std::function<void(Mat<T>&, Computer&)>&);
 
@@ -210,22 +753,59 @@ namespace ncf{
         // Low-level methods
         void query(const Mat<T>& in, StockPool<T>& pool);
         void query(const Mat<T>& in, StockPool<T>& pool, Computer&);
+        // the input layer's out stays sparse in the pool and layer 1 multiplies and takes its gradient over
+        // the nonzeros; host only, on pools without a plan and with a first core that isn't pruned;
+        // every index must be below the input layer's neurons, and a device grad after it throws
+        void query(const SparseInput<T>& in, StockPool<T>& pool);
 
         void error(const Mat<T>& answer, StockPool<T>& pool);
         void error(const Mat<T>& answer, StockPool<T>& pool, Computer&);
 
         T cost(const StockPool<T>& pool, const std::function<T(const T&)>& cost) const;
 
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool) const;
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool, Computer&) const;
+
         void grad(StockPool<T>& pool, const std::function<T(const T&)>& div_cost);
         void grad(StockPool<T>& pool, const std::string& div_cost, Computer&);
 
         void train(StockPool<T>& pool, const T& learning_rate);
         void train(StockPool<T>& pool, const T& learning_rate, Computer&);
 
+        void train(StockPool<T>& pool, const Optimizer<T>& optimizer);
+        void train(StockPool<T>& pool, const Optimizer<T>& optimizer, Computer&);
+
+        // finishes a step after error: grad and train, or on a planned pool the
+        // remaining errors interleaved with them layer by layer, from the output down
+        void backward(StockPool<T>& pool, const std::function<T(const T&)>& div_cost, const Optimizer<T>& optimizer);
+        void backward(StockPool<T>& pool, const std::string& div_cost, const Optimizer<T>& optimizer, Computer&);
+
 		// High-level methods
 		T fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error);
 		T fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error, Computer&);
 
+		T fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error);
+		T fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, Computer&);
+
+		T fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error);
+		T fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error, Computer&);
+
+		T fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error);
+		T fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error, Computer&);
+
+		T fit(const StreamFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error);
+		T fit(const StreamFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, Computer&);
+
+		T fit(const SparseFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error);
+		T fit(const SparseFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error);
+
+		// mean cost over any number of examples, computed batch by batch in the pool
+		T evaluate(const Mat<T>& data, const Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost) const;
+		T evaluate(const Mat<T>& data, const Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost, Computer&) const;
+
+		T evaluate(Dataset<T>& dataset, InferencePool<T>& pool, const std::function<T(const T&)>& cost) const;
+		T evaluate(Dataset<T>& dataset, InferencePool<T>& pool, const std::function<T(const T&)>& cost, Computer&) const;
+
         ~Net();
     };
 
@@ -233,9 +813,36 @@ namespace ncf{
     class StockPool{
     private:
         std::vector<std::pair<Stock<T>*, bool>> stocks;
+
+        // preout, out and error of every stock sized for capacity examples, then the grads
+        T* slab = nullptr;
+        std::size_t slab_size = 0;
+        std::size_t capacity = 0;
+        std::size_t examples = 0;
+        std::vector<std::size_t> offsets;
+
+        // buffers share memory by lifetime, see MemoryPlan
+        bool planned = false;
+        std::size_t interval = 1;
+
+        // the input layer's out after a sparse query, which layer 1's grad then reads instead of stock 0
+        SparseInput<T> sparse_input;
+        bool sparse = false;
+
+        void bind();
     public:
         StockPool();
         StockPool(const Net<T>&, std::size_t);
+        StockPool(const Net<T>&, std::size_t examples, std::size_t capacity);
+        // buffers with disjoint lifetimes alias at the plan's offsets, which only holds while the stocks
+        // view the slab: Stock::bind goes through kernel::view and throws on a copying MatrixCF
+        StockPool(const Net<T>&, const MemoryPlan<T>&);
+        StockPool(const StockPool&) = delete;
+        StockPool& operator=(const StockPool&) = delete;
+
+        // changes the active batch size without reallocating the host slab;
+        // device buffers follow the matrices, so send the pool again afterwards
+        void resize(std::size_t examples);
 
         void send(Computer&);
         void receive(Computer&);
@@ -257,854 +864,6125 @@ namespace ncf{
         Stock<T>& getStock(std::size_t);
 		Stock<T>& getLastStock();
 
+        std::size_t getCapacity() const;
+        std::size_t getExamples() const;
+        bool checkPlanned() const;
+        // checkpoint interval of the plan, 1 when every layer keeps its activations
+        std::size_t getInterval() const;
+
+        // set by a sparse query, cleared by a dense one
+        bool checkSparseInput() const;
+        void setSparseInput(bool);
+        SparseInput<T>& getSparseInput();
+        const SparseInput<T>& getConstSparseInput() const;
+
         ~StockPool();
     };
-}
 
-namespace ncf{
-    namespace activation {
-		template<typename T>
-		T relu(const T& v){
-			return v > 0 ? v : 0;
-		}
+    enum class BUFFER{PREOUT, OUT, ERROR, GRAD};
 
-		template<typename T>
-		T lrelu(const T& v){
-			return v > 0 ? v : v * T(0.1);
-		}
-	}
-	namespace cost {
-		template<typename T>
-		T mse(const T& v) {
-			return v * v;
-		}
-	}
+    // places the stock buffers of a net in one slab by their lifetimes over the schedule
+    // query 0..n-1, output error, then per layer k from the output down: error k-1, grad k, train k;
+    // the output out and error live to the end, the other stocks are scratch
+    //
+    // with checkpointing only every k-th layer (and the output) keeps its activations through
+    // the backward pass; when it reaches checkpoint c the layers between c - k and c are queried
+    // again from out c - k, the segment below the output is still in place and isn't repeated
+    template<typename T>
+    class MemoryPlan{
+    private:
+        struct Buffer{
+            std::size_t size;
+            std::vector<std::pair<std::size_t, std::size_t>> spans;
+            std::size_t offset;
+        };
+
+        std::vector<Buffer> buffers;
+        std::size_t examples;
+        std::size_t interval;
+        std::size_t recomputed = 0;
+        std::size_t naive = 0;
+        std::size_t peak = 0;
+    public:
+        MemoryPlan(const Net<T>&, std::size_t examples);
+        MemoryPlan(const Net<T>&, std::size_t examples, std::size_t interval);
 
-	namespace derivative {
-		namespace activation {
-			template<typename T>
-			T relu(const T& v) {
-				return v > 0 ? 1 : 0;
-			}
+        std::size_t getExamples() const;
+        std::size_t getLayersCount() const;
+        // 1 when every layer is kept
+        std::size_t getInterval() const;
+        // layer queries repeated by each backward pass
+        std::size_t getRecomputedCount() const;
+        // in elements from the slab start
+        std::size_t getOffset(std::size_t layer, BUFFER) const;
+
+        // elements
+        std::size_t getNaiveSize() const;
+        std::size_t getPeakSize() const;
+    };
 
-			template<typename T>
-			T lrelu(const T& v) {
-				return v > 0 ? 1 : T(0.1);
-			}
-		}
-		namespace cost {
-			template<typename T>
-			T mse(const T& v) {
-				return 2 * v;
-			}
-		}
-	}
+    // built by Net::compile: cores, grads and optimizer states exist up front and every step
+    // runs on pre-resolved matrices; the plan is stale once the net's layers or cores change
+    template<typename T>
+    class ExecutionPlan{
+    private:
+        struct Step{
+            Layer<T>* layer;
+            Stock<T>* stock;
+            Mat<T>* core;
+            Mat<T>* grad;
+            OptimizerState<T>* state;
+        };
+
+        Net<T>& net;
+        StockPool<T> pool;
+        std::vector<Step> steps;
+        std::optional<std::size_t> slots;
+        std::size_t generation;
+
+        void checkOptimizer(const Optimizer<T>&) const;
+        void checkGeneration(const std::string&) const;
+    public:
+        // states are created for optimizers with the given slots count, none without one
+        ExecutionPlan(Net<T>& net, std::size_t batch, std::optional<std::size_t> slots, Computer* video);
+        ExecutionPlan(const ExecutionPlan&) = delete;
+        ExecutionPlan& operator=(const ExecutionPlan&) = delete;
 
-    namespace optimizer{
-        template<typename T>
-        void gd(Mat<T>& X, Mat<T>& grad, const T& learning_rate){
-            grad.mul(learning_rate, grad);
-            X.sub(grad, X);
-        }
-        template<typename T>
-        void gd(Mat<T>& X, Mat<T>& grad, const T& learning_rate, ecl::Computer& video){
-            grad.mul(learning_rate, grad, video);
-            X.sub(grad, X, video);
-        }
-    }
-}
+        StockPool<T>& getPool();
+        std::size_t getBatchSize() const;
 
-// IMPLEMENTATION
+        const Mat<T>& query(const Mat<T>& in);
+        const Mat<T>& query(const Mat<T>& in, Computer&);
 
-// Low-level API
+        void error(const Mat<T>& answer);
+        void error(const Mat<T>& answer, Computer&);
 
-// Layer
-template<typename T>
-ncf::Layer<T>::Layer(std::size_t neurons){
-    this->neurons = neurons;
-}
+        T cost(const std::function<T(const T&)>& cost) const;
 
-template<typename T>
-void ncf::Layer<T>::send(ecl::Computer& video){
-    for(auto& p : core) video << p.second;
-}
-template<typename T>
-void ncf::Layer<T>::receive(ecl::Computer& video){
-    for(auto& p : core) video >> p.second;
-}
-template<typename T>
-void ncf::Layer<T>::grab(ecl::Computer& video){
-    for(auto& p : core) p.second.grab(video);
-}
-template<typename T>
-void ncf::Layer<T>::release(ecl::Computer& video){
-    for(auto& p : core) p.second.release(video);
-}
+        void backward(const std::function<T(const T&)>& div_cost, const Optimizer<T>& optimizer);
+        void backward(const std::string& div_cost, const Optimizer<T>& optimizer, Computer&);
 
-namespace ncf{
-    template<typename T>
-    Computer& operator<<(Computer& video, Layer<T>& other){
-        other.send(video);
-        return video;
-    }
-    template<typename T>
-    Computer& operator>>(Computer& video, Layer<T>& other){
-        other.receive(video);
-        return video;
-    }
-}
+        // the frame must use the plan's pool
+        T fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error);
+        T fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, Computer&);
+    };
 
-template<typename T>
-bool ncf::Layer<T>::checkCore(std::size_t prev_neurons) const{
-    if(core.find(prev_neurons) == core.end()) return false;
-    return true;
-}
-template<typename T>
-void ncf::Layer<T>::createCore(std::size_t prev_neurons){
-    if(!checkCore(prev_neurons)){
-        if(coregen == nullptr)
-            throw std::runtime_error("Layer [create core]: coregen method unsetted");
+    // forward pass only: layer outputs alternate between two buffers sized to the widest layer
+    template<typename T>
+    class InferencePool{
+    private:
+        std::size_t batch;
 
-        Mat<T> new_core(neurons, prev_neurons);
-        coregen(new_core);
-        core.emplace(prev_neurons, std::move(new_core));
-    }
-}
-template<typename T>
-void ncf::Layer<T>::createCore(std::size_t prev_neurons, ecl::Computer& video) {
-	if (!checkCore(prev_neurons)) {
-		Mat<T> new_core(neurons, prev_neurons);
-		video << new_core;
-		computer_coregen(new_core, video);
-		core.emplace(prev_neurons, std::move(new_core));
-	}
-}
-template<typename T>
-void ncf::Layer<T>::releaseCore(std::size_t prev_neurons){
-    auto it = core.find(prev_neurons);
-    if(it != core.end()){
-        core.erase(it);
-    }
-}
+        Mat<T> input;
+        Mat<T> buffers[2];
+        std::vector<Mat<T>> outs;
+    public:
+        InferencePool(const Net<T>&, std::size_t batch);
+        InferencePool(const InferencePool&) = delete;
+        InferencePool& operator=(const InferencePool&) = delete;
+
+        void send(Computer&);
+        void receive(Computer&);
+        void grab(Computer&);
+        void release(Computer&);
+
+        template<typename U>
+        friend Computer& operator<<(Computer&, InferencePool<U>&);
+        template<typename U>
+        friend Computer& operator>>(Computer&, InferencePool<U>&);
+
+        std::size_t getBatchSize() const;
+        std::size_t getLayersCount() const;
+
+        // staging for batches gathered by evaluate
+        Mat<T>& getInput();
+        Mat<T>& getOut(std::size_t);
+        const Mat<T>& getConstOut(std::size_t) const;
+        Mat<T>& getLastOut();
+    };
+
+    // base of the inference copies of a net: they keep the source's layer sizes and activations,
+    // run on an InferencePool of the source net and differ only in how predict stores the cores
+    template<typename T>
+    class InferenceNet{
+    protected:
+        struct Stage{
+            std::size_t neurons;
+            std::size_t prev_neurons;
+
+            Activation<T> policy;
+            std::function<T(const T&)> activation;
+        };
+
+        // class name in the messages of the shared checks
+        std::string name;
+        std::vector<std::size_t> neurons;
+
+        // the source must be non empty, with every layer activated and every core created
+        InferenceNet(const Net<T>&, const std::string& name);
+
+        // sizes and activation of a layer of the source
+        void describe(const Net<T>&, std::size_t layer, Stage&) const;
+        void checkInferencePool(const InferencePool<T>&, const Mat<T>& in, const std::string& method) const;
+
+        // the first layer has no core, its out is the activated input
+        void activateInput(const Stage&, const Mat<T>& in, Mat<T>& out) const;
+        void activate(const Stage&, const T* in, T* out, std::size_t count) const;
+        // epilogue of a gemm accumulating in T
+        void activateTile(const Stage&, const T* acc, T* out, std::size_t count) const;
+    public:
+        virtual const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool) = 0;
+
+        // mean cost like Net::evaluate
+        T evaluate(const Mat<T>& data, const Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost);
+        // evaluate minus the source net's evaluate on the same examples
+        T delta(const Net<T>& net, const Mat<T>& data, const Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost);
+
+        std::size_t getLayersCount() const;
+
+        virtual ~InferenceNet() = default;
+    };
+
+    // post-training int8 copy of a net for host inference: cores are quantized per output row,
+    // each layer's input per example, and the int32 accumulators are dequantized and activated
+    // in the gemm epilogue
+    template<typename T>
+    class QuantizedNet : public InferenceNet<T>{
+    private:
+        struct Stage : InferenceNet<T>::Stage{
+            std::vector<std::int8_t> core;
+            std::vector<T> scale;
+        };
+
+        std::vector<Stage> stages;
+
+        // the input of the current layer, quantized and transposed
+        std::vector<std::int8_t> staging;
+        std::vector<T> staging_scale;
+    public:
+        explicit QuantizedNet(const Net<T>&);
+
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool) override;
+
+        // bytes of int8 cores and their scales
+        std::size_t getSize() const;
+    };
+
+    // inference copy of a net with cores stored as bfloat16 or IEEE half: half the weight bytes of float,
+    // widened to T inside hgemm on the host and inside the forward kernel on the device
+    template<typename T>
+    class HalfNet : public InferenceNet<T>{
+    private:
+        struct Stage : InferenceNet<T>::Stage{
+            std::vector<std::uint16_t> core;
+            // device copy, the 16-bit pairs packed into words
+            Mat<unsigned int>* computer_core = nullptr;
+
+            std::string computer_activation;
+        };
+
+        HALF format;
+        std::vector<Stage> stages;
+    public:
+        HalfNet(const Net<T>&, HALF format);
+        HalfNet(const HalfNet&) = delete;
+        HalfNet& operator=(const HalfNet&) = delete;
+        ~HalfNet();
+
+        // cores are read only on the device: send uploads them, release frees them
+        void send(Computer&);
+        void release(Computer&);
+
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool) override;
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool, Computer&);
+
+        using InferenceNet<T>::evaluate;
+        T evaluate(const Mat<T>& data, const Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost, Computer&);
+
+        HALF getFormat() const;
+        // bytes of 16-bit cores
+        std::size_t getSize() const;
+    };
+
+    // inference copy of a net with every core W replaced by U * V from a truncated SVD, U neurons x rank and V rank x prev_neurons,
+    // so a layer runs two thin gemms instead of one wide one; the rank is the smallest whose relative Frobenius error
+    // ||W - U * V|| / ||W|| stays within the budget, and a layer stays dense when the factors wouldn't be cheaper
+    template<typename T>
+    class LowRankNet : public InferenceNet<T>{
+    private:
+        struct Stage : InferenceNet<T>::Stage{
+            // 0 when the layer stays dense
+            std::size_t rank = 0;
+            std::vector<T> core;
+            std::vector<T> left;
+            std::vector<T> right;
+        };
+
+        std::vector<Stage> stages;
+
+        // V * in of the current layer, rank x examples
+        std::vector<T> staging;
+
+        void factorize(Stage&, const T* core, const T& budget);
+        void forward(const Stage&, const T* core, const T* in, T* out, std::size_t prev_neurons, std::size_t examples) const;
+    public:
+        LowRankNet(const Net<T>&, const T& budget);
+
+        const Mat<T>& predict(const Mat<T>& in, InferencePool<T>& pool) override;
+
+        // ||out - net out|| / ||net out|| over the last layer's outputs on the same examples
+        T deviation(const Net<T>& net, const Mat<T>& data, InferencePool<T>& pool);
+
+        std::size_t getRank(std::size_t layer) const;
+        // multiply-adds per example, of the factors and of the source cores
+        std::size_t getFlops() const;
+        std::size_t getDenseFlops() const;
+        // bytes of the factors and of the source cores
+        std::size_t getSize() const;
+        std::size_t getDenseSize() const;
+    };
+
+    // Files
+    namespace format{
+        // payloads are aligned for mmap and vector loads
+        constexpr std::size_t page = 4096;
+        constexpr std::size_t line = 64;
+
+        std::size_t align(std::size_t offset, std::size_t alignment);
+
+        template<typename T>
+        std::uint32_t dtype();
+
+        void pad(std::ofstream& file, std::size_t offset);
+
+        // writes path.tmp, syncs it and renames it over path, so readers never see a torn file
+        void commit(const std::string& path, const char* data, std::size_t size);
+
+        // locale independent decimal parser, stops at the first character that is not part of the number
+        template<typename T>
+        T parse(const char*& p, const char* end);
+    }
+
+    class MappedFile{
+    private:
+        char* data = nullptr;
+        std::size_t size = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int file = -1;
+#endif
+    public:
+        MappedFile(const std::string& path, MAP mode = MAP::PRIVATE);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        char* getData();
+        const char* getConstData() const;
+        std::size_t getSize() const;
+
+        ~MappedFile();
+    };
+
+    // binary dataset: header, then inputs and answers stored batch by batch,
+    // each batch a row-major neurons x batch block, so it maps straight into a Mat
+    template<typename T>
+    class Dataset{
+    private:
+        struct Header{
+            char magic[4];
+            std::uint32_t version;
+            std::uint32_t dtype;
+            std::uint32_t dtype_size;
+            std::uint64_t inputs;
+            std::uint64_t outputs;
+            std::uint64_t examples;
+            std::uint64_t batch;
+            std::uint64_t batches;
+            std::uint64_t data_offset;
+            std::uint64_t data_stride;
+            std::uint64_t answer_offset;
+            std::uint64_t answer_stride;
+        };
+        static constexpr std::uint32_t version = 1;
+
+        MappedFile file;
+        Header header;
+    public:
+        explicit Dataset(const std::string& path);
+
+        static void save(const std::string& path, const Mat<T>& data, const Mat<T>& answer, std::size_t batch);
+
+        std::size_t getInputs() const;
+        std::size_t getOutputs() const;
+        std::size_t getExamples() const;
+        std::size_t getBatchSize() const;
+        std::size_t getBatchesCount() const;
+
+        // matrices backed by the mapped pages, valid while the dataset lives
+        Mat<T> getData(std::size_t batch);
+        Mat<T> getAnswer(std::size_t batch);
+    };
+
+    // one example per line: the first `inputs` fields go to data, the rest to answer,
+    // both in the neurons x examples layout; the file is parsed by all cores at once
+    template<typename T>
+    class CSV{
+    private:
+        Mat<T> data;
+        Mat<T> answer;
+        std::size_t bytes = 0;
+        double seconds = 0;
+    public:
+        CSV(const std::string& path, std::size_t inputs, char delimiter = ',', bool header = false, std::size_t threads = 0);
+
+        Mat<T>& getData();
+        Mat<T>& getAnswer();
+
+        std::size_t getBytes() const;
+        double getSeconds() const;
+        // MiB/s
+        double getThroughput() const;
+    };
+
+    // Pipeline
+    // a loader thread fills batch N + 1 while batch N is trained, through a bounded ring of slots
+    template<typename T>
+    class Prefetcher{
+    public:
+        using Loader = std::function<void(Mat<T>& data, Mat<T>& answer)>;
+    private:
+        struct Slot{
+            Mat<T> data;
+            Mat<T> answer;
+        };
+
+        std::vector<Slot> slots;
+        Loader loader;
+
+        std::size_t head = 0;
+        std::size_t ready = 0;
+        bool acquired = false;
+        bool stopping = false;
+        std::exception_ptr failure = nullptr;
+
+        std::mutex mutex;
+        std::condition_variable filled;
+        std::condition_variable emptied;
+        std::thread thread;
+
+        void run();
+    public:
+        Prefetcher(std::size_t inputs, std::size_t outputs, std::size_t batch, const Loader& loader, std::size_t capacity = 2);
+        // shuffled mini-batches gathered from full matrices, which must outlive the prefetcher
+        Prefetcher(const Mat<T>& data, const Mat<T>& answer, const Batching& batching, std::size_t capacity = 2);
+        Prefetcher(const Prefetcher&) = delete;
+        Prefetcher& operator=(const Prefetcher&) = delete;
+
+        void send(Computer&);
+        void release(Computer&);
+
+        // waits for the next filled slot; the previous one goes back to the loader
+        std::pair<Mat<T>&, Mat<T>&> acquire();
+        void release();
+
+        std::size_t getCapacity() const;
+        std::size_t getBatchSize() const;
+
+        ~Prefetcher();
+    };
+
+    // snapshots of a net in the Net::save format: at an iteration boundary the cores are
+    // copied into a staging image, then a writer thread syncs it to a temporary file and
+    // renames it over the path while training goes on
+    template<typename T>
+    class Checkpointer{
+    private:
+        std::string path;
+        std::size_t interval;
+        std::size_t iterations = 0;
+        std::size_t written = 0;
+
+        std::vector<char> staging;
+        bool pending = false;
+        bool stopping = false;
+        std::exception_ptr failure = nullptr;
+
+        mutable std::mutex mutex;
+        std::condition_variable queued;
+        std::condition_variable done;
+        std::thread thread;
+
+        void run();
+        // the staging image is free once the previous snapshot is written
+        void settle(std::unique_lock<std::mutex>&);
+    public:
+        // fits that are handed the checkpointer take a snapshot every interval steps
+        Checkpointer(const std::string& path, std::size_t interval);
+        Checkpointer(const Checkpointer&) = delete;
+        Checkpointer& operator=(const Checkpointer&) = delete;
+
+        void step(const Net<T>&);
+        void step(Net<T>&, Computer&);
+
+        // waits only while the previous snapshot is still being written
+        void take(const Net<T>&);
+        void take(Net<T>&, Computer&);
+
+        // returns once the last snapshot is on disk, rethrows a failed write
+        void wait();
+
+        std::size_t getInterval() const;
+        std::size_t getWrittenCount() const;
+
+        ~Checkpointer();
+    };
+}
+
+namespace ncf{
+    namespace activation {
+		template<typename T>
+		T identity(const T& v){
+			return v;
+		}
+
+		template<typename T>
+		T relu(const T& v){
+			return v > 0 ? v : 0;
+		}
+
+		template<typename T>
+		T lrelu(const T& v){
+			return v > 0 ? v : v * T(0.1);
+		}
+
+		template<typename T>
+		T sigmoid(const T& v){
+			return T(1) / (T(1) + std::exp(-v));
+		}
+
+		template<typename T>
+		T tanh(const T& v){
+			return std::tanh(v);
+		}
+	}
+	namespace cost {
+		template<typename T>
+		T mse(const T& v) {
+			return v * v;
+		}
+	}
+
+	namespace derivative {
+		namespace activation {
+			template<typename T>
+			T identity(const T&) {
+				return 1;
+			}
+
+			template<typename T>
+			T relu(const T& v) {
+				return v > 0 ? 1 : 0;
+			}
+
+			template<typename T>
+			T lrelu(const T& v) {
+				return v > 0 ? 1 : T(0.1);
+			}
+
+			template<typename T>
+			T sigmoid(const T& v) {
+				T s = ncf::activation::sigmoid(v);
+				return s * (1 - s);
+			}
+
+			template<typename T>
+			T tanh(const T& v) {
+				T t = std::tanh(v);
+				return 1 - t * t;
+			}
+		}
+		namespace cost {
+			template<typename T>
+			T mse(const T& v) {
+				return 2 * v;
+			}
+		}
+	}
+
+	// compile-time activations: scalar functions, vectorized kernels and computer sources in one type
+	namespace policy {
+		struct identity : Tag {
+			static constexpr const char* name = "identity";
+			static constexpr const char* computer_activation = "ret = v;";
+			static constexpr const char* computer_derivative = "ret = 1;";
+
+			template<typename T>
+			static T activation(const T& v) { return ncf::activation::identity(v); }
+			template<typename T>
+			static T derivative(const T& v) { return ncf::derivative::activation::identity(v); }
+
+			static constexpr bool from_output = true;
+			static constexpr const char* computer_output_derivative = "ret = 1;";
+
+			template<typename T>
+			static T output_derivative(const T&) { return T(1); }
+		};
+
+		struct relu : Tag {
+			static constexpr const char* name = "relu";
+			static constexpr const char* computer_activation = "ret = v > 0 ? v : 0;";
+			static constexpr const char* computer_derivative = "ret = v > 0 ? 1 : 0;";
+
+			template<typename T>
+			static T activation(const T& v) { return ncf::activation::relu(v); }
+			template<typename T>
+			static T derivative(const T& v) { return ncf::derivative::activation::relu(v); }
+
+			static constexpr bool from_output = true;
+			static constexpr const char* computer_output_derivative = "ret = v > 0 ? 1 : 0;";
+
+			template<typename T>
+			static T output_derivative(const T& out) { return out > 0 ? T(1) : T(0); }
+		};
+
+		struct lrelu : Tag {
+			static constexpr const char* name = "lrelu";
+			static constexpr const char* computer_activation = "ret = v > 0 ? v : v * 0.1f;";
+			static constexpr const char* computer_derivative = "ret = v > 0 ? 1 : 0.1f;";
+
+			template<typename T>
+			static T activation(const T& v) { return ncf::activation::lrelu(v); }
+			template<typename T>
+			static T derivative(const T& v) { return ncf::derivative::activation::lrelu(v); }
+
+			static constexpr bool from_output = true;
+			static constexpr const char* computer_output_derivative = "ret = v > 0 ? 1 : 0.1f;";
+
+			template<typename T>
+			static T output_derivative(const T& out) { return out > 0 ? T(1) : T(0.1); }
+		};
+
+		struct sigmoid : Tag {
+			static constexpr const char* name = "sigmoid";
+			static constexpr const char* computer_activation = "ret = 1 / (1 + exp(-v));";
+			static constexpr const char* computer_derivative = "ret = 1 / (1 + exp(-v)); ret = ret * (1 - ret);";
+
+			template<typename T>
+			static T activation(const T& v) { return ncf::activation::sigmoid(v); }
+			template<typename T>
+			static T derivative(const T& v) { return ncf::derivative::activation::sigmoid(v); }
+
+			static constexpr bool from_output = true;
+			static constexpr const char* computer_output_derivative = "ret = v * (1 - v);";
+
+			template<typename T>
+			static T output_derivative(const T& out) { return out * (1 - out); }
+		};
+
+		struct tanh : Tag {
+			static constexpr const char* name = "tanh";
+			static constexpr const char* computer_activation = "ret = tanh(v);";
+			static constexpr const char* computer_derivative = "ret = tanh(v); ret = 1 - ret * ret;";
+
+			template<typename T>
+			static T activation(const T& v) { return ncf::activation::tanh(v); }
+			template<typename T>
+			static T derivative(const T& v) { return ncf::derivative::activation::tanh(v); }
+
+			static constexpr bool from_output = true;
+			static constexpr const char* computer_output_derivative = "ret = 1 - v * v;";
+
+			template<typename T>
+			static T output_derivative(const T& out) { return 1 - out * out; }
+		};
+	}
+
+    namespace optimizer{
+        template<typename T>
+        void gd(Mat<T>& X, const Mat<T>& grad, const T& learning_rate);
+        template<typename T>
+        void gd(Mat<T>& X, const Mat<T>& grad, const T& learning_rate, ecl::Computer& video);
+
+        template<typename T>
+        class GD : public Optimizer<T>{
+        private:
+            T learning_rate;
+        public:
+            explicit GD(const T& learning_rate);
+
+            std::size_t getSlotsCount() const override;
+
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state) const override;
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state, Computer&) const override;
+        };
+
+        template<typename T>
+        class Momentum : public Optimizer<T>{
+        private:
+            T learning_rate;
+            T momentum;
+        public:
+            Momentum(const T& learning_rate, const T& momentum = T(0.9));
+
+            std::size_t getSlotsCount() const override;
+
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state) const override;
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state, Computer&) const override;
+        };
+
+        template<typename T>
+        class Nesterov : public Optimizer<T>{
+        private:
+            T learning_rate;
+            T momentum;
+        public:
+            Nesterov(const T& learning_rate, const T& momentum = T(0.9));
+
+            std::size_t getSlotsCount() const override;
+
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state) const override;
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state, Computer&) const override;
+        };
+
+        template<typename T>
+        class Adam : public Optimizer<T>{
+        private:
+            T learning_rate;
+            T beta1;
+            T beta2;
+            T epsilon;
+
+            T getStepSize(std::size_t step) const;
+        public:
+            Adam(const T& learning_rate, const T& beta1 = T(0.9), const T& beta2 = T(0.999), const T& epsilon = T(1e-8));
+
+            std::size_t getSlotsCount() const override;
+
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state) const override;
+            void update(Mat<T>& X, const Mat<T>& grad, OptimizerState<T>& state, Computer&) const override;
+        };
+
+        // full-batch quasi-Newton, driven by Net::fit
+        template<typename T>
+        class LBFGS{
+        private:
+            std::size_t history;
+            std::size_t max_line_search;
+            T c1;
+        public:
+            explicit LBFGS(std::size_t history = 10, std::size_t max_line_search = 20, const T& c1 = T(1e-4));
+
+            std::size_t getHistory() const;
+            std::size_t getMaxLineSearch() const;
+            const T& getC1() const;
+        };
+    }
+}
+
+// IMPLEMENTATION
+
+// Kernels
+template<typename T>
+T* ncf::kernel::data(mcf::Mat<T>& A){
+    return A.getArray();
+}
+template<typename T>
+const T* ncf::kernel::data(const mcf::Mat<T>& A){
+    return A.getConstArray();
+}
+template<typename T>
+void ncf::kernel::view(mcf::Mat<T>& target, T* data, std::size_t h, std::size_t w, const std::string& where){
+    static_assert(std::is_constructible_v<mcf::Mat<T>, T*, std::size_t, std::size_t>, "NeuroCF: slabs need MatrixCF's Mat(T*, h, w) view constructor");
+
+    target = mcf::Mat<T>(data, h, w);
+    if(h * w > 0 && kernel::data(target) != data)
+        throw std::runtime_error(where + ": mcf::Mat(T*, h, w) copied the data instead of viewing it");
+}
+
+template<typename T, T(*f)(const T&)>
+void ncf::kernel::map(const T* in, T* out, std::size_t count){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++)
+        out[i] = f(in[i]);
+}
+
+template<typename T, typename E>
+void ncf::kernel::gemm(const T* A, const T* B, std::size_t M, std::size_t K, std::size_t N, bool transpose_a, const E& epilogue){
+    // op(A) is M x K, B is K x N, both row-major; A is stored K x M when transposed
+    const std::size_t a_row = transpose_a ? 1 : K;
+    const std::size_t a_col = transpose_a ? M : 1;
+
+    const std::size_t col_tiles = (N + tile_cols - 1) / tile_cols;
+    const std::size_t row_tiles = (M + tile_rows - 1) / tile_rows;
+
+    // column tiles outside, so one K x tile_cols panel of B stays cached for all row tiles
+    #pragma omp parallel for collapse(2) schedule(static) if(M * N * K >= parallel_threshold)
+    for(std::size_t jt = 0; jt < col_tiles; jt++){
+        for(std::size_t it = 0; it < row_tiles; it++){
+            const std::size_t i0 = it * tile_rows;
+            const std::size_t j0 = jt * tile_cols;
+            const std::size_t rows = std::min(tile_rows, M - i0);
+            const std::size_t cols = std::min(tile_cols, N - j0);
+
+            T acc[tile_rows][tile_cols] = {};
+
+            if(rows == tile_rows && cols == tile_cols){
+                for(std::size_t k = 0; k < K; k++){
+                    const T* b = B + k * N + j0;
+                    for(std::size_t r = 0; r < tile_rows; r++){
+                        const T a = A[(i0 + r) * a_row + k * a_col];
+                        #pragma omp simd
+                        for(std::size_t c = 0; c < tile_cols; c++)
+                            acc[r][c] += a * b[c];
+                    }
+                }
+            } else {
+                for(std::size_t k = 0; k < K; k++){
+                    const T* b = B + k * N + j0;
+                    for(std::size_t r = 0; r < rows; r++){
+                        const T a = A[(i0 + r) * a_row + k * a_col];
+                        for(std::size_t c = 0; c < cols; c++)
+                            acc[r][c] += a * b[c];
+                    }
+                }
+            }
+
+            for(std::size_t r = 0; r < rows; r++)
+                epilogue(i0 + r, j0, acc[r], cols);
+        }
+    }
+}
+
+template<typename T, T(*f)(const T&)>
+void ncf::kernel::forward(const T* core, const T* in, T* preout, T* out, std::size_t neurons, std::size_t prev_neurons, std::size_t examples){
+    gemm(core, in, neurons, prev_neurons, examples, false, [=](std::size_t i, std::size_t j, const T* acc, std::size_t count){
+        T* o = out + i * examples + j;
+
+        // no preout: out is the only write
+        if(preout == nullptr){
+            #pragma omp simd
+            for(std::size_t c = 0; c < count; c++)
+                o[c] = f(acc[c]);
+            return;
+        }
+
+        T* p = preout + i * examples + j;
+
+        // preout may alias out, so it is written first
+        #pragma omp simd
+        for(std::size_t c = 0; c < count; c++){
+            p[c] = acc[c];
+            o[c] = f(acc[c]);
+        }
+    });
+}
+
+template<typename T, T(*df)(const T&)>
+void ncf::kernel::backward(const T* next_core, const T* next_error, const T* preout, T* error, std::size_t neurons, std::size_t next_neurons, std::size_t examples){
+    gemm(next_core, next_error, neurons, next_neurons, examples, true, [=](std::size_t i, std::size_t j, const T* acc, std::size_t count){
+        const T* p = preout + i * examples + j;
+        T* e = error + i * examples + j;
+
+        #pragma omp simd
+        for(std::size_t c = 0; c < count; c++)
+            e[c] = acc[c] * df(p[c]);
+    });
+}
+
+template<typename T, typename F>
+void ncf::kernel::gradient(const T* error, const T* prev_out, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale){
+    const std::size_t row_tiles = (neurons + tile_rows - 1) / tile_rows;
+
+    #pragma omp parallel if(neurons * prev_neurons * examples >= parallel_threshold)
+    {
+        std::vector<T> d(tile_rows * examples);
+
+        #pragma omp for schedule(static)
+        for(std::size_t it = 0; it < row_tiles; it++){
+            const std::size_t i0 = it * tile_rows;
+            const std::size_t rows = std::min(tile_rows, neurons - i0);
+
+            // cost derivative is applied on load, error itself stays untouched
+            for(std::size_t r = 0; r < rows; r++){
+                const T* e = error + (i0 + r) * examples;
+                for(std::size_t j = 0; j < examples; j++)
+                    d[r * examples + j] = div_cost(e[j]);
+            }
+
+            // each prev_out row is streamed once per tile of error rows
+            for(std::size_t k = 0; k < prev_neurons; k++){
+                const T* x = prev_out + k * examples;
+                for(std::size_t r = 0; r < rows; r++){
+                    const T* dr = d.data() + r * examples;
+                    T acc = 0;
+                    #pragma omp simd reduction(+:acc)
+                    for(std::size_t j = 0; j < examples; j++)
+                        acc += dr[j] * x[j];
+                    grad[(i0 + r) * prev_neurons + k] = scale * acc;
+                }
+            }
+        }
+    }
+}
+
+template<typename T, typename E>
+void ncf::kernel::spmm(const std::size_t* offsets, const std::uint32_t* columns, const T* values, const T* B, std::size_t M, std::size_t N, const E& epilogue){
+    const std::size_t col_tiles = (N + sparse_cols - 1) / sparse_cols;
+
+    #pragma omp parallel for schedule(static) if(offsets[M] * N >= parallel_threshold)
+    for(std::size_t i = 0; i < M; i++){
+        for(std::size_t jt = 0; jt < col_tiles; jt++){
+            const std::size_t j0 = jt * sparse_cols;
+            const std::size_t cols = std::min(sparse_cols, N - j0);
+
+            // entries ascend in column, so the sum runs in the same order as gemm's without the zeros
+            T acc[sparse_cols] = {};
+
+            if(cols == sparse_cols){
+                for(std::size_t p = offsets[i]; p < offsets[i + 1]; p++){
+                    const T a = values[p];
+                    const T* b = B + columns[p] * N + j0;
+                    #pragma omp simd
+                    for(std::size_t c = 0; c < sparse_cols; c++)
+                        acc[c] += a * b[c];
+                }
+            } else {
+                for(std::size_t p = offsets[i]; p < offsets[i + 1]; p++){
+                    const T a = values[p];
+                    const T* b = B + columns[p] * N + j0;
+                    for(std::size_t c = 0; c < cols; c++)
+                        acc[c] += a * b[c];
+                }
+            }
+
+            epilogue(i, j0, acc, cols);
+        }
+    }
+}
+
+template<typename T, typename F>
+void ncf::kernel::sgradient(const std::size_t* offsets, const std::uint32_t* columns, const T* error, const T* prev_out, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale){
+    #pragma omp parallel if(offsets[neurons] * examples >= parallel_threshold)
+    {
+        std::vector<T> d(examples);
+
+        #pragma omp for schedule(static)
+        for(std::size_t i = 0; i < neurons; i++){
+            const T* e = error + i * examples;
+            for(std::size_t j = 0; j < examples; j++)
+                d[j] = div_cost(e[j]);
+
+            T* g = grad + i * prev_neurons;
+            std::fill(g, g + prev_neurons, T(0));
+
+            for(std::size_t p = offsets[i]; p < offsets[i + 1]; p++){
+                const T* x = prev_out + columns[p] * examples;
+                T acc = 0;
+                #pragma omp simd reduction(+:acc)
+                for(std::size_t j = 0; j < examples; j++)
+                    acc += d[j] * x[j];
+                g[columns[p]] = scale * acc;
+            }
+        }
+    }
+}
+
+template<typename T, typename E>
+void ncf::kernel::dsmm(const T* A, const std::size_t* offsets, const std::uint32_t* indices, const T* values, std::size_t M, std::size_t K, std::size_t N, const E& epilogue){
+    const std::size_t row_tiles = (M + tile_rows - 1) / tile_rows;
+    const std::size_t col_tiles = (N + tile_cols - 1) / tile_cols;
+
+    #pragma omp parallel for schedule(static) if(M * offsets[N] >= parallel_threshold)
+    for(std::size_t it = 0; it < row_tiles; it++){
+        const std::size_t i0 = it * tile_rows;
+        const std::size_t rows = std::min(tile_rows, M - i0);
+        const T* a = A + i0 * K;
+
+        for(std::size_t jt = 0; jt < col_tiles; jt++){
+            const std::size_t j0 = jt * tile_cols;
+            const std::size_t cols = std::min(tile_cols, N - j0);
+
+            // indices ascend within a column, so the sum runs in the same order as gemm's without the zeros
+            T acc[tile_rows][tile_cols] = {};
+
+            for(std::size_t c = 0; c < cols; c++){
+                if(rows == tile_rows){
+                    for(std::size_t p = offsets[j0 + c]; p < offsets[j0 + c + 1]; p++){
+                        const T* x = a + indices[p];
+                        const T v = values[p];
+                        for(std::size_t r = 0; r < tile_rows; r++)
+                            acc[r][c] += x[r * K] * v;
+                    }
+                } else {
+                    for(std::size_t p = offsets[j0 + c]; p < offsets[j0 + c + 1]; p++){
+                        const T* x = a + indices[p];
+                        const T v = values[p];
+                        for(std::size_t r = 0; r < rows; r++)
+                            acc[r][c] += x[r * K] * v;
+                    }
+                }
+            }
+
+            for(std::size_t r = 0; r < rows; r++)
+                epilogue(i0 + r, j0, acc[r], cols);
+        }
+    }
+}
+
+template<typename T, typename F>
+void ncf::kernel::cgradient(const T* error, const std::size_t* offsets, const std::uint32_t* indices, const T* values, T* grad, std::size_t neurons, std::size_t prev_neurons, std::size_t examples, const F& div_cost, const T& scale){
+    #pragma omp parallel for schedule(static) if(neurons * offsets[examples] >= parallel_threshold)
+    for(std::size_t i = 0; i < neurons; i++){
+        const T* e = error + i * examples;
+        T* g = grad + i * prev_neurons;
+        std::fill(g, g + prev_neurons, T(0));
+
+        for(std::size_t j = 0; j < examples; j++){
+            const T d = div_cost(e[j]);
+            for(std::size_t p = offsets[j]; p < offsets[j + 1]; p++)
+                g[indices[p]] += d * values[p];
+        }
+
+        #pragma omp simd
+        for(std::size_t k = 0; k < prev_neurons; k++)
+            g[k] *= scale;
+    }
+}
+
+template<typename T>
+void ncf::kernel::gd(T* X, const T* grad, std::size_t count, const T& learning_rate){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++)
+        X[i] -= learning_rate * grad[i];
+}
+template<typename T>
+void ncf::kernel::momentum(T* X, const T* grad, T* velocity, std::size_t count, const T& learning_rate, const T& momentum){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++){
+        velocity[i] = momentum * velocity[i] + grad[i];
+        X[i] -= learning_rate * velocity[i];
+    }
+}
+template<typename T>
+void ncf::kernel::nesterov(T* X, const T* grad, T* velocity, std::size_t count, const T& learning_rate, const T& momentum){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++){
+        velocity[i] = momentum * velocity[i] + grad[i];
+        X[i] -= learning_rate * (grad[i] + momentum * velocity[i]);
+    }
+}
+template<typename T>
+void ncf::kernel::adam(T* X, const T* grad, T* m, T* v, std::size_t count, const T& step_size, const T& beta1, const T& beta2, const T& epsilon){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++){
+        m[i] = beta1 * m[i] + (1 - beta1) * grad[i];
+        v[i] = beta2 * v[i] + (1 - beta2) * grad[i] * grad[i];
+        X[i] -= step_size * m[i] / (std::sqrt(v[i]) + epsilon);
+    }
+}
+
+template<typename T>
+void ncf::kernel::gather(const T* src, T* dst, std::size_t rows, std::size_t src_cols, const std::size_t* index, std::size_t count){
+    #pragma omp parallel for if(rows * count >= parallel_threshold)
+    for(std::size_t r = 0; r < rows; r++){
+        const T* s = src + r * src_cols;
+        T* d = dst + r * count;
+        for(std::size_t c = 0; c < count; c++)
+            d[c] = s[index[c]];
+    }
+}
+template<typename T>
+void ncf::kernel::submatrix(const T* src, T* dst, std::size_t src_cols, const std::size_t* rows, std::size_t rows_count, const std::size_t* cols, std::size_t cols_count){
+    #pragma omp parallel for if(rows_count * cols_count >= parallel_threshold)
+    for(std::size_t r = 0; r < rows_count; r++){
+        const T* s = src + rows[r] * src_cols;
+        T* d = dst + r * cols_count;
+        for(std::size_t c = 0; c < cols_count; c++)
+            d[c] = s[cols[c]];
+    }
+}
+template<typename T>
+T ncf::kernel::cost(const mcf::Mat<T>& answer, std::size_t answer_cols, std::size_t offset, const mcf::Mat<T>& out, std::size_t count, const std::function<T(const T&)>& cost){
+    const T* a = data(answer);
+    const T* o = data(out);
+    std::size_t rows = out.getH();
+    std::size_t cols = out.getW();
+
+    T result = 0;
+    for(std::size_t i = 0; i < rows; i++){
+        for(std::size_t j = 0; j < count; j++)
+            result += cost(a[i * answer_cols + offset + j] - o[i * cols + j]);
+    }
+    return result;
+}
+
+template<typename T>
+T ncf::kernel::dot(const T* a, const T* b, std::size_t count){
+    T result = 0;
+    #pragma omp parallel for simd reduction(+:result) if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++)
+        result += a[i] * b[i];
+    return result;
+}
+template<typename T>
+void ncf::kernel::quantizeRows(const T* A, std::int8_t* q, T* scale, std::size_t rows, std::size_t cols){
+    #pragma omp parallel for if(rows * cols >= parallel_threshold)
+    for(std::size_t i = 0; i < rows; i++){
+        const T* a = A + i * cols;
+        T peak = 0;
+        for(std::size_t k = 0; k < cols; k++) peak = std::max(peak, std::abs(a[k]));
+
+        // an all-zero row keeps scale 1, so dequantizing never divides by zero
+        T s = peak > 0 ? peak / T(127) : T(1);
+        scale[i] = s;
+
+        std::int8_t* r = q + i * cols;
+        for(std::size_t k = 0; k < cols; k++)
+            r[k] = static_cast<std::int8_t>(std::clamp(std::round(a[k] / s), T(-127), T(127)));
+    }
+}
+template<typename T>
+void ncf::kernel::quantizeColumns(const T* X, std::int8_t* q, T* scale, std::size_t rows, std::size_t cols){
+    // peaks in row order, X is read contiguously
+    std::fill(scale, scale + cols, T(0));
+    for(std::size_t k = 0; k < rows; k++){
+        const T* x = X + k * cols;
+        #pragma omp simd
+        for(std::size_t j = 0; j < cols; j++) scale[j] = std::max(scale[j], std::abs(x[j]));
+    }
+    for(std::size_t j = 0; j < cols; j++) scale[j] = scale[j] > 0 ? scale[j] / T(127) : T(1);
+
+    #pragma omp parallel for if(rows * cols >= parallel_threshold)
+    for(std::size_t j = 0; j < cols; j++){
+        std::int8_t* r = q + j * rows;
+        T inverse = T(1) / scale[j];
+        for(std::size_t k = 0; k < rows; k++)
+            r[k] = static_cast<std::int8_t>(std::clamp(std::round(X[k * cols + j] * inverse), T(-127), T(127)));
+    }
+}
+
+template<std::size_t R, std::size_t C>
+void ncf::kernel::qblock(const std::int8_t* A, const std::int8_t* Bt, std::size_t K, std::int32_t (&acc)[R][C]){
+    std::size_t k = 0;
+    // the R x C accumulators only stay in registers when the block loops are fully unrolled
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    const __m512i flip = _mm512_set1_epi8(static_cast<char>(0x80));
+    __m512i v[R][C];
+    #pragma GCC unroll 16
+    for(std::size_t r = 0; r < R; r++)
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++) v[r][c] = _mm512_setzero_si512();
+
+    for(; k + 64 <= K; k += 64){
+        __m512i b[C];
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++) b[c] = _mm512_loadu_si512(Bt + c * K + k);
+        #pragma GCC unroll 16
+        for(std::size_t r = 0; r < R; r++){
+            // a ^ 0x80 is a + 128 as an unsigned byte
+            __m512i a = _mm512_xor_si512(_mm512_loadu_si512(A + r * K + k), flip);
+            #pragma GCC unroll 16
+            for(std::size_t c = 0; c < C; c++) v[r][c] = _mm512_dpbusd_epi32(v[r][c], a, b[c]);
+        }
+    }
+
+    alignas(64) std::int32_t lanes[16];
+    #pragma GCC unroll 16
+    for(std::size_t r = 0; r < R; r++){
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++){
+            _mm512_store_si512(lanes, v[r][c]);
+            acc[r][c] = 0;
+            for(std::size_t l = 0; l < 16; l++) acc[r][c] += lanes[l];
+        }
+    }
+#elif defined(__AVX2__)
+    // sign extended to int16, vpmaddwd sums adjacent products into int32 without saturating
+    __m256i v[R][C];
+    #pragma GCC unroll 16
+    for(std::size_t r = 0; r < R; r++)
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++) v[r][c] = _mm256_setzero_si256();
+
+    for(; k + 16 <= K; k += 16){
+        __m256i b[C];
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++) b[c] = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Bt + c * K + k)));
+        #pragma GCC unroll 16
+        for(std::size_t r = 0; r < R; r++){
+            __m256i a = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(A + r * K + k)));
+            #pragma GCC unroll 16
+            for(std::size_t c = 0; c < C; c++) v[r][c] = _mm256_add_epi32(v[r][c], _mm256_madd_epi16(a, b[c]));
+        }
+    }
+
+    alignas(32) std::int32_t lanes[8];
+    #pragma GCC unroll 16
+    for(std::size_t r = 0; r < R; r++){
+        #pragma GCC unroll 16
+        for(std::size_t c = 0; c < C; c++){
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v[r][c]);
+            acc[r][c] = 0;
+            for(std::size_t l = 0; l < 8; l++) acc[r][c] += lanes[l];
+        }
+    }
+#else
+    for(std::size_t r = 0; r < R; r++)
+        for(std::size_t c = 0; c < C; c++) acc[r][c] = 0;
+#endif
+
+    // the tail carries the same bias as the vector part
+    for(std::size_t r = 0; r < R; r++){
+        const std::int8_t* a = A + r * K;
+        for(std::size_t c = 0; c < C; c++){
+            const std::int8_t* b = Bt + c * K;
+            std::int32_t sum = 0;
+            #pragma omp simd reduction(+:sum)
+            for(std::size_t i = k; i < K; i++)
+                sum += (static_cast<std::int32_t>(a[i]) + qbias) * static_cast<std::int32_t>(b[i]);
+            acc[r][c] += sum;
+        }
+    }
+}
+
+template<typename E>
+void ncf::kernel::qgemm(const std::int8_t* A, const std::int8_t* Bt, std::size_t M, std::size_t K, std::size_t N, const E& epilogue){
+    // qbias * sum of each Bt row, taken back from the biased dots
+    std::vector<std::int32_t> correction(N, 0);
+    if(qbias != 0){
+        for(std::size_t j = 0; j < N; j++){
+            const std::int8_t* b = Bt + j * K;
+            std::int32_t sum = 0;
+            #pragma omp simd reduction(+:sum)
+            for(std::size_t i = 0; i < K; i++) sum += b[i];
+            correction[j] = qbias * sum;
+        }
+    }
+
+    const std::size_t col_tiles = (N + tile_cols - 1) / tile_cols;
+    const std::size_t row_tiles = (M + tile_rows - 1) / tile_rows;
+    static_assert(tile_rows % qblock_rows == 0 && tile_cols % qblock_cols == 0, "Kernel [qgemm]: register blocks must divide the tile");
+
+    // a tile reads tile_rows rows of A and tile_cols rows of Bt, all of them stay cached
+    #pragma omp parallel for collapse(2) schedule(static) if(M * N * K >= parallel_threshold)
+    for(std::size_t jt = 0; jt < col_tiles; jt++){
+        for(std::size_t it = 0; it < row_tiles; it++){
+            const std::size_t i0 = it * tile_rows;
+            const std::size_t j0 = jt * tile_cols;
+            const std::size_t rows = std::min(tile_rows, M - i0);
+            const std::size_t cols = std::min(tile_cols, N - j0);
+
+            std::int32_t acc[tile_rows][tile_cols];
+            for(std::size_t r = 0; r < rows; r += qblock_rows){
+                for(std::size_t c = 0; c < cols; c += qblock_cols){
+                    const std::int8_t* a = A + (i0 + r) * K;
+                    const std::int8_t* b = Bt + (j0 + c) * K;
+
+                    if(r + qblock_rows <= rows && c + qblock_cols <= cols){
+                        std::int32_t block[qblock_rows][qblock_cols];
+                        qblock(a, b, K, block);
+                        for(std::size_t br = 0; br < qblock_rows; br++)
+                            for(std::size_t bc = 0; bc < qblock_cols; bc++) acc[r + br][c + bc] = block[br][bc];
+                        continue;
+                    }
+
+                    // edges go one dot at a time
+                    for(std::size_t br = r; br < std::min(r + qblock_rows, rows); br++){
+                        for(std::size_t bc = c; bc < std::min(c + qblock_cols, cols); bc++){
+                            std::int32_t single[1][1];
+                            qblock(A + (i0 + br) * K, Bt + (j0 + bc) * K, K, single);
+                            acc[br][bc] = single[0][0];
+                        }
+                    }
+                }
+            }
+
+            for(std::size_t r = 0; r < rows; r++){
+                for(std::size_t c = 0; c < cols; c++) acc[r][c] -= correction[j0 + c];
+                epilogue(i0 + r, j0, acc[r], cols);
+            }
+        }
+    }
+}
+
+inline std::uint16_t ncf::kernel::narrow(float f, HALF format){
+    std::uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    if(format == HALF::BF16){
+        // NaN keeps a mantissa bit so rounding can't turn it into an infinity
+        if((x & 0x7FFFFFFF) > 0x7F800000) return static_cast<std::uint16_t>((x >> 16) | 0x40);
+        x += 0x7FFF + ((x >> 16) & 1);
+        return static_cast<std::uint16_t>(x >> 16);
+    }
+
+#if defined(__F16C__)
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    std::uint32_t sign = (x >> 16) & 0x8000;
+    std::uint32_t abs = x & 0x7FFFFFFF;
+
+    if(abs >= 0x7F800000) return static_cast<std::uint16_t>(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    // 65520 and up round past the largest half
+    if(abs >= 0x477FF000) return static_cast<std::uint16_t>(sign | 0x7C00);
+
+    std::uint32_t result, rest, halfway;
+    if(abs < 0x38800000){
+        // subnormal half: units of 2^-24
+        if(abs < 0x33000000) return static_cast<std::uint16_t>(sign);
+        std::uint32_t shift = 126 - (abs >> 23);
+        std::uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        result = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        result = (abs - 0x38000000) >> 13;
+        rest = abs & 0x1FFF;
+        halfway = 0x1000;
+    }
+    if(rest > halfway || (rest == halfway && (result & 1))) result++;
+    return static_cast<std::uint16_t>(sign | result);
+#endif
+}
+inline float ncf::kernel::widen(std::uint16_t h, HALF format){
+    float f;
+    if(format == HALF::BF16){
+        std::uint32_t x = static_cast<std::uint32_t>(h) << 16;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000) << 16;
+    std::uint32_t exponent = (h >> 10) & 0x1F;
+    std::uint32_t mantissa = h & 0x3FF;
+
+    if(exponent == 0){
+        f = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -f : f;
+    }
+
+    std::uint32_t x = exponent == 0x1F ? sign | 0x7F800000 | (mantissa << 13) : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+#endif
+}
+template<typename T>
+void ncf::kernel::narrow(const T* x, std::uint16_t* h, std::size_t count, HALF format){
+    std::size_t i = 0;
+    if constexpr (std::is_same_v<T, float>){
+#if defined(__F16C__)
+        if(format == HALF::FP16){
+            for(; i + 8 <= count; i += 8)
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(h + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+    }
+    for(; i < count; i++) h[i] = narrow(static_cast<float>(x[i]), format);
+}
+template<typename T>
+void ncf::kernel::widen(const std::uint16_t* h, T* x, std::size_t count, HALF format){
+    if(format == HALF::BF16){
+        // a shift into the high half, vectorized as it is
+        #pragma omp simd
+        for(std::size_t i = 0; i < count; i++){
+            std::uint32_t bits = static_cast<std::uint32_t>(h[i]) << 16;
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            x[i] = static_cast<T>(f);
+        }
+        return;
+    }
+
+    std::size_t i = 0;
+#if defined(__F16C__)
+    if constexpr (std::is_same_v<T, float>){
+        for(; i + 8 <= count; i += 8)
+            _mm256_storeu_ps(x + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i))));
+    }
+#endif
+    for(; i < count; i++) x[i] = static_cast<T>(widen(h[i], format));
+}
+
+template<typename T, typename E>
+void ncf::kernel::hgemm(const std::uint16_t* A, HALF format, const T* B, std::size_t M, std::size_t K, std::size_t N, const E& epilogue){
+    const std::size_t col_tiles = (N + tile_cols - 1) / tile_cols;
+    const std::size_t row_tiles = (M + tile_rows - 1) / tile_rows;
+
+    // row tiles outside: every thread widens its own strip of A, B is shared and stays cached
+    #pragma omp parallel if(M * N * K >= parallel_threshold)
+    {
+        std::vector<T> strip(tile_rows * K);
+
+        #pragma omp for schedule(static)
+        for(std::size_t it = 0; it < row_tiles; it++){
+            const std::size_t i0 = it * tile_rows;
+            const std::size_t rows = std::min(tile_rows, M - i0);
+            widen(A + i0 * K, strip.data(), rows * K, format);
+
+            for(std::size_t jt = 0; jt < col_tiles; jt++){
+                const std::size_t j0 = jt * tile_cols;
+                const std::size_t cols = std::min(tile_cols, N - j0);
+
+                T acc[tile_rows][tile_cols] = {};
+
+                if(rows == tile_rows && cols == tile_cols){
+                    for(std::size_t k = 0; k < K; k++){
+                        const T* b = B + k * N + j0;
+                        for(std::size_t r = 0; r < tile_rows; r++){
+                            const T a = strip[r * K + k];
+                            #pragma omp simd
+                            for(std::size_t c = 0; c < tile_cols; c++)
+                                acc[r][c] += a * b[c];
+                        }
+                    }
+                } else {
+                    for(std::size_t k = 0; k < K; k++){
+                        const T* b = B + k * N + j0;
+                        for(std::size_t r = 0; r < rows; r++){
+                            const T a = strip[r * K + k];
+                            for(std::size_t c = 0; c < cols; c++)
+                                acc[r][c] += a * b[c];
+                        }
+                    }
+                }
+
+                for(std::size_t r = 0; r < rows; r++)
+                    epilogue(i0 + r, j0, acc[r], cols);
+            }
+        }
+    }
+}
+
+template<typename T>
+void ncf::kernel::axpy(const T& alpha, const T* x, T* y, std::size_t count){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++)
+        y[i] += alpha * x[i];
+}
+template<typename T>
+void ncf::kernel::scale(const T& alpha, T* x, std::size_t count){
+    #pragma omp parallel for simd if(count >= parallel_threshold)
+    for(std::size_t i = 0; i < count; i++)
+        x[i] *= alpha;
+}
+template<typename T>
+void ncf::kernel::copy(const T* x, T* y, std::size_t count){
+    std::copy(x, x + count, y);
+}
+
+inline void ncf::kernel::eigen(double* A, double* values, std::size_t n){
+    if(n == 0) return;
+
+    // Householder reduction to tridiagonal form, the transformations accumulated in V; the textbook
+    // algorithm walks columns, so it runs on the transpose (A is symmetric) and every inner loop is a row
+    std::vector<double> V(A, A + n * n);
+    std::vector<double> d(n), e(n);
+    auto v = [&](std::size_t i, std::size_t j) -> double& { return V[j * n + i]; };
+
+    for(std::size_t j = 0; j < n; j++) d[j] = v(n - 1, j);
+    for(std::size_t i = n - 1; i > 0; i--){
+        double scale = 0, h = 0;
+        for(std::size_t k = 0; k < i; k++) scale += std::abs(d[k]);
+
+        if(scale == 0){
+            e[i] = d[i - 1];
+            for(std::size_t j = 0; j < i; j++){
+                d[j] = v(i - 1, j);
+                v(i, j) = 0;
+                v(j, i) = 0;
+            }
+        } else {
+            for(std::size_t k = 0; k < i; k++){
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            double f = d[i - 1];
+            double g = f > 0 ? -std::sqrt(h) : std::sqrt(h);
+            e[i] = scale * g;
+            h -= f * g;
+            d[i - 1] = f - g;
+            for(std::size_t j = 0; j < i; j++) e[j] = 0;
+
+            for(std::size_t j = 0; j < i; j++){
+                f = d[j];
+                v(j, i) = f;
+                g = e[j] + v(j, j) * f;
+                for(std::size_t k = j + 1; k < i; k++){
+                    g += v(k, j) * d[k];
+                    e[k] += v(k, j) * f;
+                }
+                e[j] = g;
+            }
+            f = 0;
+            for(std::size_t j = 0; j < i; j++){
+                e[j] /= h;
+                f += e[j] * d[j];
+            }
+            double hh = f / (h + h);
+            for(std::size_t j = 0; j < i; j++) e[j] -= hh * d[j];
+            for(std::size_t j = 0; j < i; j++){
+                f = d[j];
+                g = e[j];
+                for(std::size_t k = j; k < i; k++) v(k, j) -= f * e[k] + g * d[k];
+                d[j] = v(i - 1, j);
+                v(i, j) = 0;
+            }
+        }
+        d[i] = h;
+    }
+
+    for(std::size_t i = 0; i + 1 < n; i++){
+        v(n - 1, i) = v(i, i);
+        v(i, i) = 1;
+        double h = d[i + 1];
+        if(h != 0){
+            for(std::size_t k = 0; k <= i; k++) d[k] = v(k, i + 1) / h;
+            for(std::size_t j = 0; j <= i; j++){
+                double g = 0;
+                for(std::size_t k = 0; k <= i; k++) g += v(k, i + 1) * v(k, j);
+                for(std::size_t k = 0; k <= i; k++) v(k, j) -= g * d[k];
+            }
+        }
+        for(std::size_t k = 0; k <= i; k++) v(k, i + 1) = 0;
+    }
+    for(std::size_t j = 0; j < n; j++){
+        d[j] = v(n - 1, j);
+        v(n - 1, j) = 0;
+    }
+    v(n - 1, n - 1) = 1;
+
+    // implicit QL on the tridiagonal matrix; V holds the eigenvectors as rows, so every rotation is contiguous too
+    for(std::size_t i = 1; i < n; i++) e[i - 1] = e[i];
+    e[n - 1] = 0;
+
+    double f = 0, tst1 = 0;
+    const double eps = std::numeric_limits<double>::epsilon();
+    for(std::size_t l = 0; l < n; l++){
+        tst1 = std::max(tst1, std::abs(d[l]) + std::abs(e[l]));
+        std::size_t m = l;
+        while(m < n - 1 && std::abs(e[m]) > eps * tst1) m++;
+
+        if(m > l){
+            do{
+                double g = d[l];
+                double p = (d[l + 1] - g) / (2 * e[l]);
+                double r = std::hypot(p, 1.0);
+                if(p < 0) r = -r;
+                d[l] = e[l] / (p + r);
+                d[l + 1] = e[l] * (p + r);
+                double dl1 = d[l + 1];
+                double h = g - d[l];
+                for(std::size_t i = l + 2; i < n; i++) d[i] -= h;
+                f += h;
+
+                p = d[m];
+                double c = 1, c2 = 1, c3 = 1, s = 0, s2 = 0;
+                double el1 = e[l + 1];
+                for(std::size_t i = m; i-- > l;){
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c * e[i];
+                    h = c * p;
+                    r = std::hypot(p, e[i]);
+                    e[i + 1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i + 1] = h + s * (c * g + s * d[i]);
+
+                    double* a = V.data() + i * n;
+                    double* b = a + n;
+                    #pragma omp simd
+                    for(std::size_t k = 0; k < n; k++){
+                        double t = b[k];
+                        b[k] = s * a[k] + c * t;
+                        a[k] = c * a[k] - s * t;
+                    }
+                }
+                p = -s * s2 * c3 * el1 * e[l] / dl1;
+                e[l] = s * p;
+                d[l] = c * p;
+            } while(std::abs(e[l]) > eps * tst1);
+        }
+        d[l] += f;
+        e[l] = 0;
+    }
+
+    std::vector<std::size_t> order(n);
+    std::iota(order.begin(), order.end(), std::size_t(0));
+    std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){ return d[a] > d[b]; });
+    for(std::size_t i = 0; i < n; i++){
+        values[i] = d[order[i]];
+        std::copy(V.begin() + order[i] * n, V.begin() + (order[i] + 1) * n, A + i * n);
+    }
+}
+
+template<typename T>
+std::string ncf::kernel::computer::type(){
+    if constexpr (std::is_same_v<T, float>) return "float";
+    else if constexpr (std::is_same_v<T, double>) return "double";
+    else if constexpr (std::is_same_v<T, int>) return "int";
+    else if constexpr (std::is_same_v<T, unsigned int>) return "uint";
+    else static_assert(!std::is_same_v<T, T>, "Computer: unsupported type");
+}
+template<typename T>
+std::string ncf::kernel::computer::header(){
+    std::string result = "#define T " + type<T>() + "\n";
+    if constexpr (std::is_same_v<T, double>)
+        result = "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n" + result;
+    return result;
+}
+
+template<typename T>
+ecl::ArgumentBase* ncf::kernel::computer::arg(const mcf::Mat<T>& A){
+    return const_cast<mcf::Mat<T>*>(&A);
+}
+
+inline void ncf::kernel::computer::compute(ecl::Computer& video, const std::string& source, const std::string& name, const std::vector<ecl::ArgumentBase*>& args, const std::vector<std::size_t>& global){
+    static std::map<std::string, ecl::Program> programs;
+    static std::mutex mutex;
+
+    ecl::Program* program = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = programs.find(source);
+        if(it == programs.end()) it = programs.emplace(source, source).first;
+        program = &it->second;
+    }
+
+    ecl::Kernel kernel = name;
+    video.compute(*program, kernel, args, global);
+}
+
+template<typename T>
+std::string ncf::kernel::computer::backward(const std::string& derivative){
+    return header<T>() +
+        "__kernel void backward(__global const T* next_core, __global const T* next_error, __global const T* preout, __global T* error, const uint neurons, const uint next_neurons, const uint examples){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    size_t j = get_global_id(1);\n"
+        "    T acc = 0;\n"
+        "    for(uint k = 0; k < next_neurons; k++) acc += next_core[k * neurons + i] * next_error[k * examples + j];\n"
+        "    T v = preout[i * examples + j];\n"
+        "    T ret;\n"
+        "    " + derivative + "\n"
+        "    error[i * examples + j] = acc * ret;\n"
+        "}\n";
+}
+template<typename T>
+std::string ncf::kernel::computer::gradient(const std::string& div_cost){
+    return header<T>() +
+        "__kernel void gradient(__global const T* error, __global const T* prev_out, __global T* grad, const uint prev_neurons, const uint examples, const T scale){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    size_t k = get_global_id(1);\n"
+        "    T acc = 0;\n"
+        "    for(uint j = 0; j < examples; j++){\n"
+        "        T v = error[i * examples + j];\n"
+        "        T ret;\n"
+        "        " + div_cost + "\n"
+        "        acc += ret * prev_out[k * examples + j];\n"
+        "    }\n"
+        "    grad[i * prev_neurons + k] = scale * acc;\n"
+        "}\n";
+}
+template<typename T>
+std::string ncf::kernel::computer::optimizer(){
+    // slots of one core live in a single buffer: velocity / m at 0, v at count
+    return header<T>() +
+        "__kernel void gd(__global T* X, __global const T* grad, const T learning_rate){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    X[i] -= learning_rate * grad[i];\n"
+        "}\n"
+        "__kernel void momentum(__global T* X, __global const T* grad, __global T* velocity, const T learning_rate, const T momentum){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    velocity[i] = momentum * velocity[i] + grad[i];\n"
+        "    X[i] -= learning_rate * velocity[i];\n"
+        "}\n"
+        "__kernel void nesterov(__global T* X, __global const T* grad, __global T* velocity, const T learning_rate, const T momentum){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    velocity[i] = momentum * velocity[i] + grad[i];\n"
+        "    X[i] -= learning_rate * (grad[i] + momentum * velocity[i]);\n"
+        "}\n"
+        "__kernel void adam(__global T* X, __global const T* grad, __global T* state, const uint count, const T step_size, const T beta1, const T beta2, const T epsilon){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    T g = grad[i];\n"
+        "    T m = beta1 * state[i] + (1 - beta1) * g;\n"
+        "    T v = beta2 * state[count + i] + (1 - beta2) * g * g;\n"
+        "    state[i] = m;\n"
+        "    state[count + i] = v;\n"
+        "    X[i] -= step_size * m / (sqrt(v) + epsilon);\n"
+        "}\n";
+}
+template<typename T>
+std::string ncf::kernel::computer::blas(){
+    return header<T>() +
+        "__kernel void axpy(const T alpha, __global const T* x, __global T* y){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    y[i] += alpha * x[i];\n"
+        "}\n"
+        "__kernel void scale(const T alpha, __global T* x){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    x[i] *= alpha;\n"
+        "}\n"
+        "__kernel void copy(__global const T* x, __global T* y){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    y[i] = x[i];\n"
+        "}\n"
+        "__kernel void dot(__global const T* a, __global const T* b, __global T* partial, const uint count){\n"
+        "    size_t g = get_global_id(0);\n"
+        "    size_t groups = get_global_size(0);\n"
+        "    T acc = 0;\n"
+        "    for(size_t i = g; i < count; i += groups) acc += a[i] * b[i];\n"
+        "    partial[g] = acc;\n"
+        "}\n";
+}
+
+template<typename T>
+std::string ncf::kernel::computer::half(const std::string& activation, HALF format){
+    // vload_half needs no cl_khr_fp16, bfloat16 is the high half of a float
+    std::string load = format == HALF::FP16 ? "vload_half(i, (__global const half*)core)" : "as_float((uint)core[i] << 16)";
+    return header<T>() +
+        "#define LOAD(core, i) ((T)" + load + ")\n"
+        "__kernel void forward(__global const ushort* core, __global const T* in, __global T* out, const uint prev_neurons, const uint examples){\n"
+        "    size_t i = get_global_id(0);\n"
+        "    size_t j = get_global_id(1);\n"
+        "    __global const ushort* row = core + i * prev_neurons;\n"
+        "    T acc = 0;\n"
+        "    for(uint k = 0; k < prev_neurons; k++) acc += LOAD(row, k) * in[k * examples + j];\n"
+        "    T v = acc;\n"
+        "    T ret;\n"
+        "    " + activation + "\n"
+        "    out[i * examples + j] = ret;\n"
+        "}\n";
+}
+
+// Activation
+template<typename T>
+template<typename P>
+ncf::Activation<T> ncf::Activation<T>::make(){
+    Activation<T> result;
+
+    result.name = P::name;
+    result.activation = &P::template activation<T>;
+    result.derivative = &P::template derivative<T>;
+    result.activation_kernel = &kernel::map<T, &P::template activation<T>>;
+    result.derivative_kernel = &kernel::map<T, &P::template derivative<T>>;
+    result.forward_kernel = &kernel::forward<T, &P::template activation<T>>;
+    result.backward_kernel = &kernel::backward<T, &P::template derivative<T>>;
+    result.computer_activation = P::computer_activation;
+    result.computer_derivative = P::computer_derivative;
+
+    if constexpr (P::from_output){
+        result.from_output = true;
+        result.output_derivative = &P::template output_derivative<T>;
+        result.backward_kernel = &kernel::backward<T, &P::template output_derivative<T>>;
+        result.computer_output_derivative = P::computer_output_derivative;
+    }
+
+    return result;
+}
+
+template<typename T>
+std::map<std::string, ncf::Activation<T>>& ncf::Activation<T>::registry(){
+    static std::map<std::string, Activation<T>> activations = {
+        {policy::identity::name, make<policy::identity>()},
+        {policy::relu::name, make<policy::relu>()},
+        {policy::lrelu::name, make<policy::lrelu>()},
+        {policy::sigmoid::name, make<policy::sigmoid>()},
+        {policy::tanh::name, make<policy::tanh>()}
+    };
+    return activations;
+}
+
+template<typename T>
+template<typename P>
+void ncf::Activation<T>::add(){
+    registry()[P::name] = make<P>();
+}
+template<typename T>
+bool ncf::Activation<T>::check(const std::string& name){
+    return registry().find(name) != registry().end();
+}
+template<typename T>
+const ncf::Activation<T>& ncf::Activation<T>::get(const std::string& name){
+    auto it = registry().find(name);
+    if(it == registry().end())
+        throw std::runtime_error("Activation [get]: unknown activation '" + name + "'");
+    return it->second;
+}
+
+// Low-level API
+
+// SparseCore
+template<typename T>
+void ncf::SparseCore<T>::build(const T* core, std::size_t rows, std::size_t cols){
+    if(cols > std::numeric_limits<std::uint32_t>::max())
+        throw std::runtime_error("SparseCore [build]: too many columns");
+
+    this->rows = rows;
+    this->cols = cols;
+
+    offsets.assign(rows + 1, 0);
+    transposed_offsets.assign(cols + 1, 0);
+    for(std::size_t i = 0; i < rows; i++){
+        for(std::size_t k = 0; k < cols; k++){
+            if(core[i * cols + k] == T(0)) continue;
+            offsets[i + 1]++;
+            transposed_offsets[k + 1]++;
+        }
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::partial_sum(transposed_offsets.begin(), transposed_offsets.end(), transposed_offsets.begin());
+
+    columns.resize(offsets[rows]);
+    transposed_columns.resize(offsets[rows]);
+
+    // rows are visited in order, so every transposed row comes out sorted as well
+    std::vector<std::size_t> next(transposed_offsets.begin(), transposed_offsets.end() - 1);
+    std::size_t p = 0;
+    for(std::size_t i = 0; i < rows; i++){
+        for(std::size_t k = 0; k < cols; k++){
+            if(core[i * cols + k] == T(0)) continue;
+            columns[p++] = static_cast<std::uint32_t>(k);
+            transposed_columns[next[k]++] = static_cast<std::uint32_t>(i);
+        }
+    }
+
+    values.resize(offsets[rows]);
+    transposed_values.resize(offsets[rows]);
+    sync(core);
+}
+template<typename T>
+void ncf::SparseCore<T>::sync(const T* core){
+    for(std::size_t i = 0; i < rows; i++)
+        for(std::size_t p = offsets[i]; p < offsets[i + 1]; p++) values[p] = core[i * cols + columns[p]];
+    for(std::size_t k = 0; k < cols; k++)
+        for(std::size_t p = transposed_offsets[k]; p < transposed_offsets[k + 1]; p++) transposed_values[p] = core[transposed_columns[p] * cols + k];
+}
+template<typename T>
+std::size_t ncf::SparseCore<T>::getCount() const{
+    return values.size();
+}
+
+// SparseInput
+template<typename T>
+void ncf::SparseInput<T>::build(const T* data, std::size_t rows, std::size_t cols){
+    this->rows = rows;
+    this->cols = cols;
+
+    offsets.assign(cols + 1, 0);
+    indices.clear();
+    values.clear();
+    for(std::size_t j = 0; j < cols; j++){
+        for(std::size_t i = 0; i < rows; i++){
+            if(data[i * cols + j] == T(0)) continue;
+            indices.push_back(static_cast<std::uint32_t>(i));
+            values.push_back(data[i * cols + j]);
+        }
+        offsets[j + 1] = indices.size();
+    }
+}
+template<typename T>
+void ncf::SparseInput<T>::gather(const SparseInput& src, const std::size_t* index, std::size_t count){
+    rows = src.rows;
+    cols = count;
+
+    offsets.resize(count + 1);
+    offsets[0] = 0;
+    for(std::size_t c = 0; c < count; c++)
+        offsets[c + 1] = offsets[c] + src.offsets[index[c] + 1] - src.offsets[index[c]];
+
+    indices.resize(offsets[count]);
+    values.resize(offsets[count]);
+    for(std::size_t c = 0; c < count; c++){
+        std::size_t from = src.offsets[index[c]];
+        std::size_t size = offsets[c + 1] - offsets[c];
+        std::copy(src.indices.begin() + from, src.indices.begin() + from + size, indices.begin() + offsets[c]);
+        std::copy(src.values.begin() + from, src.values.begin() + from + size, values.begin() + offsets[c]);
+    }
+}
+template<typename T>
+std::size_t ncf::SparseInput<T>::getCount() const{
+    return values.size();
+}
+
+// Layer
+template<typename T>
+ncf::Layer<T>::Layer(std::size_t neurons){
+    this->neurons = neurons;
+}
+
+template<typename T>
+void ncf::Layer<T>::send(ecl::Computer& video){
+    for(auto& p : core) video << p.second;
+    for(auto& p : state){
+        if(p.second.slots > 0) video << p.second.buffer;
+    }
+}
+template<typename T>
+void ncf::Layer<T>::receive(ecl::Computer& video){
+    for(auto& p : core) video >> p.second;
+    for(auto& p : state){
+        if(p.second.slots > 0) video >> p.second.buffer;
+    }
+    // device training doesn't keep the pattern, the CSR copy follows whatever came back
+    for(auto& p : sparse) p.second.build(kernel::data(core.at(p.first)), neurons, p.first);
+}
+template<typename T>
+void ncf::Layer<T>::grab(ecl::Computer& video){
+    for(auto& p : core) p.second.grab(video);
+    for(auto& p : state){
+        if(p.second.slots > 0) p.second.buffer.grab(video);
+    }
+    for(auto& p : sparse) p.second.build(kernel::data(core.at(p.first)), neurons, p.first);
+}
+template<typename T>
+void ncf::Layer<T>::release(ecl::Computer& video){
+    for(auto& p : core) p.second.release(video);
+    for(auto& p : state){
+        if(p.second.slots > 0) p.second.buffer.release(video);
+    }
+}
+
+namespace ncf{
+    template<typename T>
+    Computer& operator<<(Computer& video, Layer<T>& other){
+        other.send(video);
+        return video;
+    }
+    template<typename T>
+    Computer& operator>>(Computer& video, Layer<T>& other){
+        other.receive(video);
+        return video;
+    }
+}
+
+template<typename T>
+bool ncf::Layer<T>::checkCore(std::size_t prev_neurons) const{
+    if(core.find(prev_neurons) == core.end()) return false;
+    return true;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Layer<T>::createCore(std::size_t prev_neurons){
+    auto it = core.find(prev_neurons);
+    if(it != core.end()) return it->second;
+
+    if(coregen == nullptr)
+        throw std::runtime_error("Layer [create core]: coregen method unsetted");
+
+    Mat<T> new_core(neurons, prev_neurons);
+    coregen(new_core);
+    return core.emplace(prev_neurons, std::move(new_core)).first->second;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Layer<T>::createCore(std::size_t prev_neurons, ecl::Computer& video) {
+	auto it = core.find(prev_neurons);
+	if (it != core.end()) return it->second;
+
+	Mat<T> new_core(neurons, prev_neurons);
+	video << new_core;
+	computer_coregen(new_core, video);
+	return core.emplace(prev_neurons, std::move(new_core)).first->second;
+}
+template<typename T>
+void ncf::Layer<T>::releaseCore(std::size_t prev_neurons){
+    auto it = core.find(prev_neurons);
+    if(it != core.end()){
+        core.erase(it);
+    }
+    releaseState(prev_neurons);
+    releaseSparse(prev_neurons);
+}
+
+template<typename T>
+bool ncf::Layer<T>::checkState(std::size_t prev_neurons, std::size_t slots) const{
+    auto it = state.find(prev_neurons);
+    if(it == state.end() || it->second.slots != slots) return false;
+    return true;
+}
+template<typename T>
+void ncf::Layer<T>::createState(std::size_t prev_neurons, std::size_t slots){
+    if(!checkState(prev_neurons, slots)){
+        OptimizerState<T> new_state;
+        new_state.slots = slots;
+        if(slots > 0){
+            new_state.buffer = Mat<T>(slots * neurons, prev_neurons);
+            new_state.buffer.full(0);
+        }
+        state[prev_neurons] = std::move(new_state);
+    }
+}
+template<typename T>
+void ncf::Layer<T>::createState(std::size_t prev_neurons, std::size_t slots, ecl::Computer& video){
+    if(!checkState(prev_neurons, slots)){
+        OptimizerState<T> new_state;
+        new_state.slots = slots;
+        if(slots > 0){
+            new_state.buffer = Mat<T>(slots * neurons, prev_neurons);
+            new_state.buffer.full(0);
+            video << new_state.buffer;
+        }
+        state[prev_neurons] = std::move(new_state);
+    }
+}
+template<typename T>
+void ncf::Layer<T>::releaseState(std::size_t prev_neurons){
+    auto it = state.find(prev_neurons);
+    if(it != state.end()){
+        state.erase(it);
+    }
+}
+
+template<typename T>
+void ncf::Layer<T>::prune(std::size_t prev_neurons, const T& threshold, std::size_t examples){
+    if(!checkCore(prev_neurons))
+        throw std::runtime_error("Layer [prune]: core unsetted");
+    if(examples == 0)
+        throw std::runtime_error("Layer [prune]: empty probe batch");
+
+    mcf::Mat<T>& A = getCore(prev_neurons);
+    T* a = kernel::data(A);
+    std::size_t count = neurons * prev_neurons;
+    for(std::size_t i = 0; i < count; i++)
+        if(std::abs(a[i]) < threshold) a[i] = 0;
+
+    // optimizer history would grow the pruned weights back
+    auto it = state.find(prev_neurons);
+    if(it != state.end() && it->second.slots > 0){
+        T* s = kernel::data(it->second.buffer);
+        for(std::size_t slot = 0; slot < it->second.slots; slot++)
+            for(std::size_t i = 0; i < count; i++)
+                if(a[i] == T(0)) s[slot * count + i] = 0;
+    }
+
+    SparseCore<T>& result = sparse[prev_neurons];
+    result.build(a, neurons, prev_neurons);
+
+    // the crossover depends on the machine, the density and the batch width, so it is measured
+    std::vector<T> in(prev_neurons * examples, T(1));
+    std::vector<T> out(neurons * examples);
+    auto store = [&](std::size_t i, std::size_t j, const T* acc, std::size_t cols){
+        std::copy(acc, acc + cols, out.data() + i * examples + j);
+    };
+    auto best = [](const std::function<void()>& f){
+        auto result = std::chrono::steady_clock::duration::max();
+        for(std::size_t r = 0; r < 3; r++){
+            auto start = std::chrono::steady_clock::now();
+            f();
+            result = std::min(result, std::chrono::steady_clock::now() - start);
+        }
+        return result;
+    };
+
+    auto dense = best([&]{ kernel::gemm(a, in.data(), neurons, prev_neurons, examples, false, store); });
+    auto csr = best([&]{ kernel::spmm(result.offsets.data(), result.columns.data(), result.values.data(), in.data(), neurons, examples, store); });
+    result.active = csr < dense;
+}
+template<typename T>
+bool ncf::Layer<T>::checkPruned(std::size_t prev_neurons) const{
+    return sparse.find(prev_neurons) != sparse.end();
+}
+template<typename T>
+bool ncf::Layer<T>::checkSparse(std::size_t prev_neurons) const{
+    auto it = sparse.find(prev_neurons);
+    return it != sparse.end() && it->second.active;
+}
+template<typename T>
+const ncf::SparseCore<T>& ncf::Layer<T>::getSparse(std::size_t prev_neurons) const{
+    return sparse.at(prev_neurons);
+}
+template<typename T>
+void ncf::Layer<T>::syncSparse(std::size_t prev_neurons){
+    auto it = sparse.find(prev_neurons);
+    if(it != sparse.end()) it->second.sync(kernel::data(getConstCore(prev_neurons)));
+}
+template<typename T>
+void ncf::Layer<T>::releaseSparse(std::size_t prev_neurons){
+    sparse.erase(prev_neurons);
+}
+
+template<typename T>
+void ncf::Layer<T>::keepNeurons(const std::vector<std::size_t>& kept){
+    if(kept.empty())
+        throw std::runtime_error("Layer [keep neurons]: a layer needs at least one neuron");
+    for(std::size_t r = 0; r < kept.size(); r++){
+        if(kept[r] >= neurons || (r > 0 && kept[r] <= kept[r - 1]))
+            throw std::runtime_error("Layer [keep neurons]: indices must ascend below the neurons count");
+    }
+
+    std::size_t count = kept.size();
+    std::vector<std::size_t> all;
+    for(auto& p : core){
+        std::size_t prev_neurons = p.first;
+        all.resize(prev_neurons);
+        std::iota(all.begin(), all.end(), std::size_t(0));
+
+        // views into a net arena become owning cores here
+        mcf::Mat<T> kept_core(count, prev_neurons);
+        kernel::submatrix(kernel::data(p.second), kernel::data(kept_core), prev_neurons, kept.data(), count, all.data(), prev_neurons);
+        p.second = std::move(kept_core);
+    }
+    for(auto& p : state){
+        if(p.second.slots == 0) continue;
+
+        // every slot is a neurons x prev_neurons block of its own
+        std::size_t prev_neurons = p.first;
+        std::vector<std::size_t> rows;
+        for(std::size_t slot = 0; slot < p.second.slots; slot++)
+            for(std::size_t r : kept) rows.push_back(slot * neurons + r);
+        all.resize(prev_neurons);
+        std::iota(all.begin(), all.end(), std::size_t(0));
+
+        mcf::Mat<T> kept_buffer(rows.size(), prev_neurons);
+        kernel::submatrix(kernel::data(p.second.buffer), kernel::data(kept_buffer), prev_neurons, rows.data(), rows.size(), all.data(), prev_neurons);
+        p.second.buffer = std::move(kept_buffer);
+    }
+
+    neurons = count;
+    for(auto& p : sparse) p.second.build(kernel::data(core.at(p.first)), neurons, p.first);
+}
+template<typename T>
+void ncf::Layer<T>::keepInputs(std::size_t prev_neurons, const std::vector<std::size_t>& kept){
+    std::size_t count = kept.size();
+    if(!checkCore(prev_neurons))
+        throw std::runtime_error("Layer [keep inputs]: core unsetted");
+    if(count == 0)
+        throw std::runtime_error("Layer [keep inputs]: a core needs at least one input");
+    if(count != prev_neurons && core.find(count) != core.end())
+        throw std::runtime_error("Layer [keep inputs]: a core for " + std::to_string(count) + " inputs already exists");
+    for(std::size_t c = 0; c < count; c++){
+        if(kept[c] >= prev_neurons || (c > 0 && kept[c] <= kept[c - 1]))
+            throw std::runtime_error("Layer [keep inputs]: indices must ascend below the inputs count");
+    }
+
+    std::vector<std::size_t> all(neurons);
+    std::iota(all.begin(), all.end(), std::size_t(0));
+
+    mcf::Mat<T> kept_core(neurons, count);
+    kernel::submatrix(kernel::data(core.at(prev_neurons)), kernel::data(kept_core), prev_neurons, all.data(), neurons, kept.data(), count);
+    core.erase(prev_neurons);
+    core.emplace(count, std::move(kept_core));
+
+    auto it = state.find(prev_neurons);
+    if(it != state.end()){
+        OptimizerState<T> kept_state = std::move(it->second);
+        state.erase(it);
+
+        if(kept_state.slots > 0){
+            all.resize(kept_state.slots * neurons);
+            std::iota(all.begin(), all.end(), std::size_t(0));
+
+            mcf::Mat<T> kept_buffer(all.size(), count);
+            kernel::submatrix(kernel::data(kept_state.buffer), kernel::data(kept_buffer), prev_neurons, all.data(), all.size(), kept.data(), count);
+            kept_state.buffer = std::move(kept_buffer);
+        }
+        state.emplace(count, std::move(kept_state));
+    }
+
+    auto sit = sparse.find(prev_neurons);
+    if(sit != sparse.end()){
+        SparseCore<T> kept_sparse = std::move(sit->second);
+        sparse.erase(sit);
+        kept_sparse.build(kernel::data(core.at(count)), neurons, count);
+        sparse.emplace(count, std::move(kept_sparse));
+    }
+}
+
+template<typename T>
+void ncf::Layer<T>::setActivation(const std::function<T(const T&)>& activation){
+    this->activation = activation;
+
+    // slow fallback: drop the vectorized kernel bound to the previous policy
+    policy.name = "";
+    policy.activation = nullptr;
+    policy.activation_kernel = nullptr;
+    policy.forward_kernel = nullptr;
+    policy.from_output = false;
+}
+template<typename T>
+void ncf::Layer<T>::setDerivative(const std::function<T(const T&)>& derivative){
+    this->derivative = derivative;
+
+    policy.name = "";
+    policy.derivative = nullptr;
+    policy.derivative_kernel = nullptr;
+    policy.backward_kernel = nullptr;
+    policy.from_output = false;
+}
+
+template<typename T>
+void ncf::Layer<T>::setActivation(const std::string& activation){
+    this->computer_activation = activation;
+    policy.name = "";
+    policy.from_output = false;
+}
+template<typename T>
+void ncf::Layer<T>::setDerivative(const std::string& derivative){
+    this->computer_derivative = derivative;
+    policy.name = "";
+    policy.from_output = false;
+}
+
+template<typename T>
+void ncf::Layer<T>::setActivation(const Activation<T>& policy){
+    this->policy = policy;
+
+    activation = policy.activation;
+    derivative = policy.derivative;
+    computer_activation = policy.computer_activation;
+    computer_derivative = policy.computer_derivative;
+}
+template<typename T>
+template<typename P, typename>
+void ncf::Layer<T>::setActivation(const P&){
+    setActivation(Activation<T>::template make<P>());
+}
+
+template<typename T>
+void ncf::Layer<T>::setCore(std::size_t prev_neurons, Mat<T>&& new_core){
+    if(new_core.getH() != neurons || new_core.getW() != prev_neurons)
+        throw std::runtime_error("Layer [set core]: invalid core size");
+    core[prev_neurons] = std::move(new_core);
+
+    auto it = sparse.find(prev_neurons);
+    if(it != sparse.end()) it->second.build(kernel::data(core[prev_neurons]), neurons, prev_neurons);
+}
+
+template<typename T>
+void ncf::Layer<T>::setCoreGen(const std::function<void(mcf::Mat<T>&)>& coregen){
+    this->coregen = coregen;
+}
+template<typename T>
+void ncf::Layer<T>::setCoreGen(const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen) {
+	this->computer_coregen = coregen;
+}
+
+template<typename T>
+std::size_t ncf::Layer<T>::getNeurons() const{
+    return neurons;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Layer<T>::getCore(std::size_t prev_neurons){
+    return core.at(prev_neurons);
+}
+template<typename T>
+const mcf::Mat<T>& ncf::Layer<T>::getConstCore(std::size_t prev_neurons) const{
+    return core.at(prev_neurons);
+}
+template<typename T>
+ncf::OptimizerState<T>& ncf::Layer<T>::getState(std::size_t prev_neurons){
+    return state.at(prev_neurons);
+}
+template<typename T>
+const std::string& ncf::Layer<T>::getComputerActivation() const{
+    return computer_activation;
+}
+template<typename T>
+const std::string& ncf::Layer<T>::getComputerDerivative() const{
+    return computer_derivative;
+}
+template<typename T>
+const ncf::Activation<T>& ncf::Layer<T>::getPolicy() const{
+    return policy;
+}
+template<typename T>
+bool ncf::Layer<T>::checkFromOutput() const{
+    return policy.from_output;
+}
+template<typename T>
+const std::function<void(mcf::Mat<T>&)>& ncf::Layer<T>::getCoreGen() const{
+    return coregen;
+}
+template<typename T>
+const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& ncf::Layer<T>::getComputerCoreGen() const {
+	return computer_coregen;
+}
+template<typename T>
+const std::function<T(const T&)>& ncf::Layer<T>::getActivation() const{
+    return activation;
+}
+template<typename T>
+const std::function<T(const T&)>& ncf::Layer<T>::getDerivative() const{
+    return derivative;
+}
+
+// Low-level methods
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out) const{
+    if(policy.activation_kernel != nullptr){
+        if(in.getH() != out.getH() || in.getW() != out.getW())
+            throw std::runtime_error("Layer [query]: invalid out size");
+        policy.activation_kernel(kernel::data(in), kernel::data(out), in.getH() * in.getW());
+        return;
+    }
+
+    if(activation == nullptr)
+        throw std::runtime_error("Layer [query]: activation function unsetted");
+    in.map(activation, out);
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out, ecl::Computer& video) const{
+    in.map(computer_activation, out, video);
+}
+
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const Layer<T>& prev){
+    const mcf::Mat<T>& core = createCore(prev.neurons);
+    if(checkSparse(prev.neurons)) query(in, preout, out, getSparse(prev.neurons));
+    else query(in, preout, out, core);
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const Layer<T>& prev, ecl::Computer& video){
+    query(in, preout, out, createCore(prev.neurons, video), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out, const Layer<T>& prev) const{
+    if(!checkCore(prev.neurons))
+        throw std::runtime_error("Layer [query]: core unsetted");
+    if(checkSparse(prev.neurons)) query(in, out, out, getSparse(prev.neurons));
+    else query(in, out, out, getConstCore(prev.neurons));
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out, const Layer<T>& prev, ecl::Computer& video) const{
+    if(!checkCore(prev.neurons))
+        throw std::runtime_error("Layer [query]: core unsetted");
+    query(in, out, out, getConstCore(prev.neurons), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const mcf::Mat<T>& core) const{
+    if(policy.forward_kernel != nullptr){
+        std::size_t examples = in.getW();
+        std::size_t prev_neurons = core.getW();
+        bool keep = !policy.from_output && &preout != &out;
+
+        if(core.getH() != neurons || in.getH() != prev_neurons)
+            throw std::runtime_error("Layer [query]: invalid in size");
+        if(out.getH() != neurons || out.getW() != examples || (keep && (preout.getH() != neurons || preout.getW() != examples)))
+            throw std::runtime_error("Layer [query]: invalid out size");
+
+        policy.forward_kernel(kernel::data(core), kernel::data(in), keep ? kernel::data(preout) : nullptr, kernel::data(out), neurons, prev_neurons, examples);
+        return;
+    }
+
+    if(activation == nullptr)
+        throw std::runtime_error("Layer [query]: activation function unsetted");
+
+    core.mul(in, preout);
+    preout.map(activation, out);
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const mcf::Mat<T>& core, ecl::Computer& video) const{
+    if(policy.from_output){
+        core.mul(in, out, video);
+        out.map(computer_activation, out, video);
+        return;
+    }
+
+    core.mul(in, preout, video);
+    preout.map(computer_activation, out, video);
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const SparseCore<T>& core) const{
+    if(policy.activation == nullptr && activation == nullptr)
+        throw std::runtime_error("Layer [query]: activation function unsetted");
+
+    std::size_t examples = in.getW();
+    bool keep = !policy.from_output && &preout != &out;
+    if(core.rows != neurons || in.getH() != core.cols)
+        throw std::runtime_error("Layer [query]: invalid in size");
+    if(out.getH() != neurons || out.getW() != examples || (keep && (preout.getH() != neurons || preout.getW() != examples)))
+        throw std::runtime_error("Layer [query]: invalid out size");
+
+    T* p = keep ? kernel::data(preout) : nullptr;
+    T* o = kernel::data(out);
+    kernel::spmm(core.offsets.data(), core.columns.data(), core.values.data(), kernel::data(in), neurons, examples, [&](std::size_t i, std::size_t j, const T* acc, std::size_t count){
+        std::size_t offset = i * examples + j;
+        if(p != nullptr) std::copy(acc, acc + count, p + offset);
+
+        if(policy.activation != nullptr){
+            for(std::size_t c = 0; c < count; c++) o[offset + c] = policy.activation(acc[c]);
+            return;
+        }
+        for(std::size_t c = 0; c < count; c++) o[offset + c] = activation(acc[c]);
+    });
+}
+
+template<typename T>
+void ncf::Layer<T>::query(const SparseInput<T>& in, SparseInput<T>& out) const{
+    if(policy.activation == nullptr && activation == nullptr)
+        throw std::runtime_error("Layer [query]: activation function unsetted");
+    if((policy.activation != nullptr ? policy.activation(T(0)) : activation(T(0))) != T(0))
+        throw std::runtime_error("Layer [query]: sparse input needs an activation that keeps zero");
+    if(in.rows != neurons || in.offsets.size() != in.cols + 1 || in.offsets[in.cols] != in.indices.size() || in.indices.size() != in.values.size())
+        throw std::runtime_error("Layer [query]: invalid sparse input");
+    // dsmm and cgradient index the core with these unchecked
+    for(std::size_t j = 0; j < in.cols; j++){
+        if(in.offsets[j] > in.offsets[j + 1])
+            throw std::runtime_error("Layer [query]: invalid sparse input");
+    }
+    for(std::uint32_t i : in.indices){
+        if(i >= in.rows)
+            throw std::runtime_error("Layer [query]: sparse index " + std::to_string(i) + " out of " + std::to_string(in.rows) + " inputs");
+    }
+
+    out.rows = in.rows;
+    out.cols = in.cols;
+    out.offsets = in.offsets;
+    out.indices = in.indices;
+    out.values.resize(in.values.size());
+
+    if(policy.activation_kernel != nullptr){
+        policy.activation_kernel(in.values.data(), out.values.data(), in.values.size());
+        return;
+    }
+    std::transform(in.values.begin(), in.values.end(), out.values.begin(), activation);
+}
+template<typename T>
+void ncf::Layer<T>::query(const SparseInput<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const mcf::Mat<T>& core) const{
+    if(policy.activation == nullptr && activation == nullptr)
+        throw std::runtime_error("Layer [query]: activation function unsetted");
+
+    std::size_t examples = in.cols;
+    bool keep = !policy.from_output && &preout != &out;
+    if(core.getH() != neurons || in.rows != core.getW())
+        throw std::runtime_error("Layer [query]: invalid in size");
+    if(out.getH() != neurons || out.getW() != examples || (keep && (preout.getH() != neurons || preout.getW() != examples)))
+        throw std::runtime_error("Layer [query]: invalid out size");
+
+    T* p = keep ? kernel::data(preout) : nullptr;
+    T* o = kernel::data(out);
+    kernel::dsmm(kernel::data(core), in.offsets.data(), in.indices.data(), in.values.data(), neurons, in.rows, examples, [&](std::size_t i, std::size_t j, const T* acc, std::size_t count){
+        std::size_t offset = i * examples + j;
+        if(p != nullptr) std::copy(acc, acc + count, p + offset);
+
+        if(policy.activation != nullptr){
+            for(std::size_t c = 0; c < count; c++) o[offset + c] = policy.activation(acc[c]);
+            return;
+        }
+        for(std::size_t c = 0; c < count; c++) o[offset + c] = activation(acc[c]);
+    });
+}
+
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& answer, const mcf::Mat<T>& out, mcf::Mat<T>& error) const{
+    answer.sub(out, error);
+}
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& answer, const mcf::Mat<T>& out, mcf::Mat<T>& error, ecl::Computer& video) const{
+    answer.sub(out, error, video);
+}
+
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, const mcf::Mat<T>& preout, mcf::Mat<T>& error, const Layer<T>& next) const{
+    if(next_error.getH() != next.neurons)
+        throw std::runtime_error("Layer [error]: invalid next error size");
+    if(next.checkSparse(neurons)) this->error(next_error, preout, error, next.getSparse(neurons));
+    else this->error(next_error, preout, error, next.getConstCore(neurons));
+}
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, const mcf::Mat<T>& preout, mcf::Mat<T>& error, const Layer<T>& next, ecl::Computer& video) const{
+    if(next_error.getH() != next.neurons)
+        throw std::runtime_error("Layer [error]: invalid next error size");
+    this->error(next_error, preout, error, next.getConstCore(neurons), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, const mcf::Mat<T>& preout, mcf::Mat<T>& error, const mcf::Mat<T>& next_core) const{
+    if(policy.backward_kernel == nullptr && derivative == nullptr)
+        throw std::runtime_error("Layer [query]: derivative function unsetted");
+
+    std::size_t examples = next_error.getW();
+    std::size_t next_neurons = next_core.getH();
+    if(next_error.getH() != next_neurons || next_core.getW() != neurons)
+        throw std::runtime_error("Layer [error]: invalid next error size");
+    if(preout.getH() != neurons || preout.getW() != examples || error.getH() != neurons || error.getW() != examples)
+        throw std::runtime_error("Layer [error]: invalid error size");
+
+    if(policy.backward_kernel != nullptr){
+        policy.backward_kernel(kernel::data(next_core), kernel::data(next_error), kernel::data(preout), kernel::data(error), neurons, next_neurons, examples);
+        return;
+    }
+
+    next_core.mul(next_error, error, ncf::TRANSPOSE::FIRST);
+
+    const T* p = kernel::data(preout);
+    T* e = kernel::data(error);
+    for(std::size_t i = 0; i < neurons * examples; i++)
+        e[i] *= derivative(p[i]);
+}
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, const mcf::Mat<T>& preout, mcf::Mat<T>& error, const mcf::Mat<T>& next_core, ecl::Computer& video) const{
+    std::size_t examples = next_error.getW();
+    std::size_t next_neurons = next_core.getH();
+    if(next_error.getH() != next_neurons || next_core.getW() != neurons)
+        throw std::runtime_error("Layer [error]: invalid next error size");
+    if(preout.getH() != neurons || preout.getW() != examples || error.getH() != neurons || error.getW() != examples)
+        throw std::runtime_error("Layer [error]: invalid error size");
+
+    ecl::Var<unsigned int> n(static_cast<unsigned int>(neurons));
+    ecl::Var<unsigned int> next_n(static_cast<unsigned int>(next_neurons));
+    ecl::Var<unsigned int> e(static_cast<unsigned int>(examples));
+
+    std::vector<ecl::ArgumentBase*> args = {
+        kernel::computer::arg(next_core), kernel::computer::arg(next_error),
+        kernel::computer::arg(preout), kernel::computer::arg(error), &n, &next_n, &e
+    };
+    const std::string& derivative = policy.from_output ? policy.computer_output_derivative : computer_derivative;
+    kernel::computer::compute(video, kernel::computer::backward<T>(derivative), "backward", args, {neurons, examples});
+}
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, const mcf::Mat<T>& preout, mcf::Mat<T>& error, const SparseCore<T>& next_core) const{
+    if(policy.derivative == nullptr && derivative == nullptr)
+        throw std::runtime_error("Layer [query]: derivative function unsetted");
+
+    std::size_t examples = next_error.getW();
+    if(next_error.getH() != next_core.rows || next_core.cols != neurons)
+        throw std::runtime_error("Layer [error]: invalid next error size");
+    if(preout.getH() != neurons || preout.getW() != examples || error.getH() != neurons || error.getW() != examples)
+        throw std::runtime_error("Layer [error]: invalid error size");
+
+    // rows of the transpose: next_core^T * next_error without scattering
+    const T* p = kernel::data(preout);
+    T* e = kernel::data(error);
+    T(*df)(const T&) = policy.from_output ? policy.output_derivative : policy.derivative;
+    kernel::spmm(next_core.transposed_offsets.data(), next_core.transposed_columns.data(), next_core.transposed_values.data(), kernel::data(next_error), neurons, examples, [&](std::size_t i, std::size_t j, const T* acc, std::size_t count){
+        std::size_t offset = i * examples + j;
+        if(df != nullptr){
+            for(std::size_t c = 0; c < count; c++) e[offset + c] = acc[c] * df(p[offset + c]);
+            return;
+        }
+        for(std::size_t c = 0; c < count; c++) e[offset + c] = acc[c] * derivative(p[offset + c]);
+    });
+}
+
+template<typename T>
+T ncf::Layer<T>::cost(const mcf::Mat<T>& error, const std::function<T(const T&)>& cost) const{
+    size_t count = error.getH() * error.getW();
+    return error.mreduce(cost) / static_cast<T>(count);
+}
+
+template<typename T>
+void ncf::Layer<T>::grad(const mcf::Mat<T>& error, const mcf::Mat<T>& prev_out, mcf::Mat<T>& grad, const std::function<T(const T&)>& div_cost) const{
+    std::size_t examples = error.getW();
+    std::size_t prev_neurons = prev_out.getH();
+    if(prev_out.getW() != examples || grad.getH() != error.getH() || grad.getW() != prev_neurons)
+        throw std::runtime_error("Layer [grad]: invalid grad size");
+
+    T scale = -T(1) / static_cast<T>(error.getW() * error.getH());
+    auto it = sparse.find(prev_neurons);
+    if(it != sparse.end()){
+        kernel::sgradient(it->second.offsets.data(), it->second.columns.data(), kernel::data(error), kernel::data(prev_out), kernel::data(grad), error.getH(), prev_neurons, examples, div_cost, scale);
+        return;
+    }
+    kernel::gradient(kernel::data(error), kernel::data(prev_out), kernel::data(grad), error.getH(), prev_neurons, examples, div_cost, scale);
+}
+template<typename T>
+void ncf::Layer<T>::grad(const mcf::Mat<T>& error, const mcf::Mat<T>& prev_out, mcf::Mat<T>& grad, const std::string& div_cost, ecl::Computer& video) const{
+    std::size_t examples = error.getW();
+    std::size_t prev_neurons = prev_out.getH();
+    if(prev_out.getW() != examples || grad.getH() != error.getH() || grad.getW() != prev_neurons)
+        throw std::runtime_error("Layer [grad]: invalid grad size");
+
+    // the scale is a kernel argument, so one program serves every batch size
+    ecl::Var<unsigned int> p(static_cast<unsigned int>(prev_neurons));
+    ecl::Var<unsigned int> e(static_cast<unsigned int>(examples));
+    ecl::Var<T> scale(-T(1) / static_cast<T>(error.getW() * error.getH()));
+
+    std::vector<ecl::ArgumentBase*> args = {
+        kernel::computer::arg(error), kernel::computer::arg(prev_out), kernel::computer::arg(grad), &p, &e, &scale
+    };
+    kernel::computer::compute(video, kernel::computer::gradient<T>(div_cost), "gradient", args, {error.getH(), prev_neurons});
+}
+template<typename T>
+void ncf::Layer<T>::grad(const mcf::Mat<T>& error, const SparseInput<T>& prev_out, mcf::Mat<T>& grad, const std::function<T(const T&)>& div_cost) const{
+    std::size_t examples = error.getW();
+    std::size_t prev_neurons = prev_out.rows;
+    if(prev_out.cols != examples || grad.getH() != error.getH() || grad.getW() != prev_neurons)
+        throw std::runtime_error("Layer [grad]: invalid grad size");
+
+    T scale = -T(1) / static_cast<T>(error.getW() * error.getH());
+    kernel::cgradient(kernel::data(error), prev_out.offsets.data(), prev_out.indices.data(), prev_out.values.data(), kernel::data(grad), error.getH(), prev_neurons, examples, div_cost, scale);
+}
+
+template<typename T>
+void ncf::Layer<T>::train(const mcf::Mat<T>& grad, const Layer<T>& prev, const T& learning_rate){
+    train(grad, prev, optimizer::GD<T>(learning_rate));
+}
+template<typename T>
+void ncf::Layer<T>::train(const mcf::Mat<T>& grad, const Layer<T>& prev, const T& learning_rate, ecl::Computer& video){
+    train(grad, prev, optimizer::GD<T>(learning_rate), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::train(const mcf::Mat<T>& grad, const Layer<T>& prev, const Optimizer<T>& optimizer){
+    mcf::Mat<T>& core = createCore(prev.neurons);
+    createState(prev.neurons, optimizer.getSlotsCount());
+
+    optimizer.update(core, grad, getState(prev.neurons));
+    syncSparse(prev.neurons);
+}
+template<typename T>
+void ncf::Layer<T>::train(const mcf::Mat<T>& grad, const Layer<T>& prev, const Optimizer<T>& optimizer, ecl::Computer& video){
+    mcf::Mat<T>& core = createCore(prev.neurons, video);
+    createState(prev.neurons, optimizer.getSlotsCount(), video);
+
+    optimizer.update(core, grad, getState(prev.neurons), video);
+}
+
+// High-level methods
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, Stock<T>& stock) const{
+	query(in, stock.getOut());
+}
+template<typename T>
+void ncf::Layer<T>::query(const mcf::Mat<T>& in, Stock<T>& stock, ecl::Computer& video) const{
+	query(in, stock.getOut(), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::query(const Stock<T>& prev_stock, Stock<T>& stock){
+	query(prev_stock.getConstOut(), stock.getPreout(), stock.getOut(), prev_stock.getLayer());
+}
+template<typename T>
+void ncf::Layer<T>::query(const Stock<T>& prev_stock, Stock<T>& stock, ecl::Computer& video){
+	query(prev_stock.getConstOut(), stock.getPreout(), stock.getOut(), prev_stock.getLayer(), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& answer, Stock<T>& stock) const{
+	error(answer, stock.getConstOut(), stock.getError());
+}
+template<typename T>
+void ncf::Layer<T>::error(const mcf::Mat<T>& answer, Stock<T>& stock, ecl::Computer& video) const{
+	error(answer, stock.getConstOut(), stock.getError(), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::error(const Stock<T>& next_stock, Stock<T>& stock) const{
+	error(next_stock.getConstError(), stock.getConstDerivativeInput(), stock.getError(), next_stock.getLayer());
+}
+template<typename T>
+void ncf::Layer<T>::error(const Stock<T>& next_stock, Stock<T>& stock, ecl::Computer& video) const{
+	error(next_stock.getConstError(), stock.getConstDerivativeInput(), stock.getError(), next_stock.getLayer(), video);
+}
+
+template<typename T>
+T ncf::Layer<T>::cost(const Stock<T>& stock, const std::function<T(const T&)>& cost) const{
+	return this->cost(stock.getConstError(), cost);
+}
+
+template<typename T>
+void ncf::Layer<T>::grad(const Stock<T>& prev_stock, Stock<T>& stock, const std::function<T(const T&)>& div_cost) const {
+	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
+	stock.createGrad(prev_neurons);
+
+	grad(stock.getConstError(), prev_stock.getConstOut(), stock.getGrad(prev_neurons), div_cost);
+}
+template<typename T>
+void ncf::Layer<T>::grad(const Stock<T>& prev_stock, Stock<T>& stock, const std::string& div_cost, ecl::Computer& video) const {
+	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
+	stock.createGrad(prev_neurons, video);
+
+	grad(stock.getConstError(), prev_stock.getConstOut(), stock.getGrad(prev_neurons), div_cost, video);
+}
+
+template<typename T>
+void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate) {
+	train(prev_stock, stock, optimizer::GD<T>(learning_rate));
+}
+template<typename T>
+void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate, ecl::Computer& video) {
+	train(prev_stock, stock, optimizer::GD<T>(learning_rate), video);
+}
+
+template<typename T>
+void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const Optimizer<T>& optimizer) {
+	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
+	createState(prev_neurons, optimizer.getSlotsCount());
+
+	optimizer.update(getCore(prev_neurons), stock.getGrad(prev_neurons), getState(prev_neurons));
+	syncSparse(prev_neurons);
+}
+template<typename T>
+void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const Optimizer<T>& optimizer, ecl::Computer& video) {
+	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
+	createState(prev_neurons, optimizer.getSlotsCount(), video);
+
+	optimizer.update(getCore(prev_neurons), stock.getGrad(prev_neurons), getState(prev_neurons), video);
+}
+
+// Optimizers
+template<typename T>
+void ncf::optimizer::gd(mcf::Mat<T>& X, const mcf::Mat<T>& grad, const T& learning_rate){
+    if(X.getH() != grad.getH() || X.getW() != grad.getW())
+        throw std::runtime_error("Optimizer [gd]: invalid grad size");
+    kernel::gd(kernel::data(X), kernel::data(grad), X.getH() * X.getW(), learning_rate);
+}
+template<typename T>
+void ncf::optimizer::gd(mcf::Mat<T>& X, const mcf::Mat<T>& grad, const T& learning_rate, ecl::Computer& video){
+    if(X.getH() != grad.getH() || X.getW() != grad.getW())
+        throw std::runtime_error("Optimizer [gd]: invalid grad size");
+
+    ecl::Var<T> lr(learning_rate);
+    kernel::computer::compute(video, kernel::computer::optimizer<T>(), "gd", {&X, kernel::computer::arg(grad), &lr}, {X.getH() * X.getW()});
+}
+
+// GD
+template<typename T>
+ncf::optimizer::GD<T>::GD(const T& learning_rate) : learning_rate(learning_rate) {}
+
+template<typename T>
+std::size_t ncf::optimizer::GD<T>::getSlotsCount() const{
+    return 0;
+}
+template<typename T>
+void ncf::optimizer::GD<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state) const{
+    gd(X, grad, learning_rate);
+    state.step++;
+}
+template<typename T>
+void ncf::optimizer::GD<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state, ecl::Computer& video) const{
+    gd(X, grad, learning_rate, video);
+    state.step++;
+}
+
+// Momentum
+template<typename T>
+ncf::optimizer::Momentum<T>::Momentum(const T& learning_rate, const T& momentum) : learning_rate(learning_rate), momentum(momentum) {}
+
+template<typename T>
+std::size_t ncf::optimizer::Momentum<T>::getSlotsCount() const{
+    return 1;
+}
+template<typename T>
+void ncf::optimizer::Momentum<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state) const{
+    kernel::momentum(kernel::data(X), kernel::data(grad), kernel::data(state.buffer), X.getH() * X.getW(), learning_rate, momentum);
+    state.step++;
+}
+template<typename T>
+void ncf::optimizer::Momentum<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state, ecl::Computer& video) const{
+    ecl::Var<T> lr(learning_rate);
+    ecl::Var<T> mu(momentum);
+
+    kernel::computer::compute(video, kernel::computer::optimizer<T>(), "momentum", {&X, kernel::computer::arg(grad), &state.buffer, &lr, &mu}, {X.getH() * X.getW()});
+    state.step++;
+}
+
+// Nesterov
+template<typename T>
+ncf::optimizer::Nesterov<T>::Nesterov(const T& learning_rate, const T& momentum) : learning_rate(learning_rate), momentum(momentum) {}
+
+template<typename T>
+std::size_t ncf::optimizer::Nesterov<T>::getSlotsCount() const{
+    return 1;
+}
+template<typename T>
+void ncf::optimizer::Nesterov<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state) const{
+    kernel::nesterov(kernel::data(X), kernel::data(grad), kernel::data(state.buffer), X.getH() * X.getW(), learning_rate, momentum);
+    state.step++;
+}
+template<typename T>
+void ncf::optimizer::Nesterov<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state, ecl::Computer& video) const{
+    ecl::Var<T> lr(learning_rate);
+    ecl::Var<T> mu(momentum);
+
+    kernel::computer::compute(video, kernel::computer::optimizer<T>(), "nesterov", {&X, kernel::computer::arg(grad), &state.buffer, &lr, &mu}, {X.getH() * X.getW()});
+    state.step++;
+}
+
+// Adam
+template<typename T>
+ncf::optimizer::Adam<T>::Adam(const T& learning_rate, const T& beta1, const T& beta2, const T& epsilon) : learning_rate(learning_rate), beta1(beta1), beta2(beta2), epsilon(epsilon) {}
+
+template<typename T>
+T ncf::optimizer::Adam<T>::getStepSize(std::size_t step) const{
+    // bias correction folded into the step size
+    T t = static_cast<T>(step);
+    return learning_rate * std::sqrt(1 - std::pow(beta2, t)) / (1 - std::pow(beta1, t));
+}
+
+template<typename T>
+std::size_t ncf::optimizer::Adam<T>::getSlotsCount() const{
+    return 2;
+}
+template<typename T>
+void ncf::optimizer::Adam<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state) const{
+    std::size_t count = X.getH() * X.getW();
+    T* m = kernel::data(state.buffer);
+
+    state.step++;
+    kernel::adam(kernel::data(X), kernel::data(grad), m, m + count, count, getStepSize(state.step), beta1, beta2, epsilon);
+}
+template<typename T>
+void ncf::optimizer::Adam<T>::update(mcf::Mat<T>& X, const mcf::Mat<T>& grad, OptimizerState<T>& state, ecl::Computer& video) const{
+    std::size_t count = X.getH() * X.getW();
+
+    state.step++;
+    ecl::Var<unsigned int> n(static_cast<unsigned int>(count));
+    ecl::Var<T> step_size(getStepSize(state.step));
+    ecl::Var<T> b1(beta1);
+    ecl::Var<T> b2(beta2);
+    ecl::Var<T> eps(epsilon);
+
+    kernel::computer::compute(video, kernel::computer::optimizer<T>(), "adam", {&X, kernel::computer::arg(grad), &state.buffer, &n, &step_size, &b1, &b2, &eps}, {count});
+}
+
+// LBFGS
+template<typename T>
+ncf::optimizer::LBFGS<T>::LBFGS(std::size_t history, std::size_t max_line_search, const T& c1) : history(history), max_line_search(max_line_search), c1(c1) {}
+
+template<typename T>
+std::size_t ncf::optimizer::LBFGS<T>::getHistory() const{
+    return history;
+}
+template<typename T>
+std::size_t ncf::optimizer::LBFGS<T>::getMaxLineSearch() const{
+    return max_line_search;
+}
+template<typename T>
+const T& ncf::optimizer::LBFGS<T>::getC1() const{
+    return c1;
+}
+
+// Stock
+template<typename T>
+ncf::Stock<T>::Stock(const Layer<T>& layer, std::size_t examples) : layer(layer){
+    out = mcf::Mat<T>(layer.getNeurons(), examples);
+    if(!layer.checkFromOutput()) preout = mcf::Mat<T>(layer.getNeurons(), examples);
+    error = mcf::Mat<T>(layer.getNeurons(), examples);
+}
+
+template<typename T>
+void ncf::Stock<T>::bind(T* preout, T* out, T* error, std::size_t examples){
+    std::size_t neurons = layer.getNeurons();
+    if(layer.checkFromOutput()) this->preout = mcf::Mat<T>();
+    else kernel::view(this->preout, preout, neurons, examples, "Stock [bind]");
+    kernel::view(this->out, out, neurons, examples, "Stock [bind]");
+    kernel::view(this->error, error, neurons, examples, "Stock [bind]");
+}
+template<typename T>
+void ncf::Stock<T>::bindGrad(std::size_t prev_neurons, T* grad){
+    kernel::view(this->grad[prev_neurons], grad, layer.getNeurons(), prev_neurons, "Stock [bind grad]");
+}
+
+template<typename T>
+void ncf::Stock<T>::send(ecl::Computer& video){
+    for(auto& p : grad){
+        if(p.second != nullptr) video << p.second;
+    }
+    if(preout != nullptr) video << preout;
+    video << error;
+    video << out;
+}
+template<typename T>
+void ncf::Stock<T>::receive(ecl::Computer& video){
+    for(auto& p : grad){
+		bool dump = p.second != nullptr;
+        if(p.second != nullptr) video >> p.second;
+    }
+    if(preout != nullptr) video >> preout;
+    video >> error;
+    video >> out;
+}
+template<typename T>
+void ncf::Stock<T>::grab(ecl::Computer& video){
+    for(auto& p : grad){
+        if(p.second != nullptr) p.second.grab(video);
+    }
+    if(preout != nullptr) preout.grab(video);
+    error.grab(video);
+    out.grab(video);
+}
+template<typename T>
+void ncf::Stock<T>::release(ecl::Computer& video){
+    for(auto& p : grad){
+        if(p.second != nullptr) p.second.release(video);
+    }
+    if(preout != nullptr) preout.release(video);
+    error.release(video);
+    out.release(video);
+}
+
+namespace ncf{
+    template<typename T>
+    Computer& operator<<(Computer& video, Stock<T>& other){
+        other.send(video);
+        return video;
+    }
+    template<typename T>
+    Computer& operator>>(Computer& video, Stock<T>& other){
+        other.receive(video);
+        return video;
+    }
+	template<typename T>
+	std::ostream& operator<<(std::ostream& s, Stock<T>& other) {
+		s << other.getConstOut();
+		return s;
+	}
+}
+
+template<typename T>
+mcf::Mat<T>& ncf::Stock<T>::getPreout(){
+    return preout;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Stock<T>::getOut(){
+    return out;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Stock<T>::getError(){
+    return error;
+}
+template<typename T>
+mcf::Mat<T>& ncf::Stock<T>::getGrad(std::size_t prev_neurons){
+    return grad.at(prev_neurons);
+}
+
+template<typename T>
+const mcf::Mat<T>& ncf::Stock<T>::getConstPreout() const{
+    return preout;
+}
+template<typename T>
+const mcf::Mat<T>& ncf::Stock<T>::getConstOut() const{
+    return out;
+}
+template<typename T>
+const mcf::Mat<T>& ncf::Stock<T>::getConstError() const{
+    return error;
+}
+template<typename T>
+const mcf::Mat<T>& ncf::Stock<T>::getConstDerivativeInput() const{
+    return layer.checkFromOutput() ? out : preout;
+}
+template<typename T>
+const ncf::Layer<T>& ncf::Stock<T>::getLayer() const{
+    return layer;
+}
+
+template<typename T>
+bool ncf::Stock<T>::checkGrad(std::size_t prev_neurons) const{
+    if(grad.find(prev_neurons) == grad.end()) return false;
+    return true;
+}
+template<typename T>
+void ncf::Stock<T>::createGrad(std::size_t prev_neurons){
+    if(!checkGrad(prev_neurons)){
+        if(layer.getCoreGen() == nullptr)
+            throw std::runtime_error("Stock [create grad]: layer's coregen method unsetted");
+
+        Mat<T> new_grad(layer.getNeurons(), prev_neurons);
+        layer.getCoreGen()(new_grad);
+        grad.emplace(prev_neurons, std::move(new_grad));
+    }
+}
+template<typename T>
+void ncf::Stock<T>::createGrad(std::size_t prev_neurons, ecl::Computer& video) {
+	if (!checkGrad(prev_neurons)) {
+		Mat<T> new_grad(layer.getNeurons(), prev_neurons);
+		video << new_grad;
+		layer.getComputerCoreGen()(new_grad, video);
+		grad.emplace(prev_neurons, std::move(new_grad));
+	}
+}
+
+template<typename T>
+void ncf::Stock<T>::releaseGrad(std::size_t prev_neurons){
+    auto it = grad.find(prev_neurons);
+    if(it != grad.end()){
+        grad.erase(it);
+    }
+}
+
+// High-level API
+
+// Net
+template<typename T>
+void ncf::Net<T>::checkStockPool(const ncf::StockPool<T>& pool, const std::string& where) const{
+    if(pool.getStocksCount() != layers.size())
+        throw std::runtime_error("Net [" + where + "]: invalid pool");
+}
+
+template<typename T>
+void ncf::Net<T>::checkInferencePool(const InferencePool<T>& pool, const std::string& method) const{
+    if(pool.getLayersCount() != layers.size())
+        throw std::runtime_error("Net [" + method + "]: inference pool doesn't fit the net");
+}
+template<typename T>
+ncf::Net<T>::Net() {}
+
+template<typename T>
+ncf::Net<T>::Net(const std::vector<std::size_t>& neurons){
+    for(auto n : neurons)
+        layers.push_back(std::make_pair(new Layer<T>(n), true));
+}
+template<typename T>
+ncf::Net<T>::Net(const std::vector<Layer<T>*>& layers) {
+	for (auto* l : layers)
+		this->layers.push_back(std::make_pair(l, false));
+}
+
+template<typename T>
+void ncf::Net<T>::send(ecl::Computer& video){
+    for(auto& p : layers) p.first->send(video);
+}
+template<typename T>
+void ncf::Net<T>::receive(ecl::Computer& video){
+    makeWritable();
+    for(auto& p : layers) p.first->receive(video);
+}
+template<typename T>
+void ncf::Net<T>::grab(ecl::Computer& video){
+    for(auto& p : layers) p.first->grab(video);
+}
+template<typename T>
+void ncf::Net<T>::release(ecl::Computer& video){
+    for(auto& p : layers) p.first->release(video);
+}
+
+namespace ncf{
+    template<typename T>
+    Computer& operator<<(Computer& video, Net<T>& net){
+        net.send(video);
+        return video;
+    }
+    template<typename T>
+    Computer& operator>>(Computer& video, Net<T>& net){
+        net.receive(video);
+        return video;
+    }
+}
+
+template<typename T>
+void ncf::Net<T>::push_back(Layer<T>* layer) {
+	unpack();
+	layers.push_back(std::make_pair(layer, false));
+	generation++;
+}
+template<typename T>
+ncf::Layer<T>* ncf::Net<T>::pop_back() {
+	unpack();
+	Layer<T>* result = layers.back().first;
+	layers.pop_back();
+	generation++;
+	return result;
+}
+
+template<typename T>
+void ncf::Net<T>::pack(){
+    unpack();
+
+    size_t count = layers.size();
+    std::size_t alignment = format::line / sizeof(T);
+
+    std::vector<std::size_t> offsets(count + 1, 0);
+    for(size_t i = 1; i < count; i++)
+        offsets[i + 1] = offsets[i] + format::align(layers.at(i).first->getNeurons() * layers.at(i - 1).first->getNeurons(), alignment);
+
+    std::size_t size = offsets[count];
+    if(count < 2 || size == 0) return;
+
+    T* slab = static_cast<T*>(::operator new(size * sizeof(T), std::align_val_t(format::page)));
+    try{
+        for(size_t i = 1; i < count; i++){
+            std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+            const mcf::Mat<T>& core = layers.at(i).first->createCore(prev_neurons);
+
+            std::size_t block_size = core.getH() * core.getW();
+            std::memcpy(slab + offsets[i], kernel::data(core), block_size * sizeof(T));
+            std::fill(slab + offsets[i] + block_size, slab + offsets[i + 1], T(0));
+        }
+    } catch(...){
+        ::operator delete(slab, std::align_val_t(format::page));
+        throw;
+    }
+
+    for(size_t i = 1; i < count; i++){
+        Layer<T>& layer = *layers.at(i).first;
+        std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+        layer.setCore(prev_neurons, mcf::Mat<T>(slab + offsets[i], layer.getNeurons(), prev_neurons));
+    }
+
+    arena = slab;
+    arena_size = size;
+    checkViews("pack");
+}
+template<typename T>
+void ncf::Net<T>::unpack(){
+    if(arena == nullptr) return;
+
+    // the layers get owning copies back, so they outlive the arena
+    size_t count = layers.size();
+    for(size_t i = 1; i < count; i++){
+        Layer<T>& layer = *layers.at(i).first;
+        std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+        if(!layer.checkCore(prev_neurons)) continue;
+
+        const mcf::Mat<T>& view = layer.getConstCore(prev_neurons);
+        mcf::Mat<T> owned(view.getH(), view.getW());
+        std::memcpy(kernel::data(owned), kernel::data(view), view.getH() * view.getW() * sizeof(T));
+        layer.setCore(prev_neurons, std::move(owned));
+    }
+
+    if(mapping != nullptr){
+        delete mapping;
+        mapping = nullptr;
+    }
+    else ::operator delete(arena, std::align_val_t(format::page));
+    arena = nullptr;
+    arena_size = 0;
+}
+template<typename T>
+bool ncf::Net<T>::checkPacked() const{
+    return arena != nullptr;
+}
+template<typename T>
+void ncf::Net<T>::checkViews(const std::string& method){
+    static_assert(std::is_constructible_v<mcf::Mat<T>, T*, std::size_t, std::size_t>, "Net: the arena needs MatrixCF's Mat(T*, h, w) view constructor");
+
+    for(size_t i = 1; i < layers.size(); i++){
+        const T* core = kernel::data(layers.at(i).first->getConstCore(layers.at(i - 1).first->getNeurons()));
+        if(core < arena || core >= arena + arena_size){
+            unpack();
+            throw std::runtime_error("Net [" + method + "]: mcf::Mat(T*, h, w) copied a core instead of viewing the arena");
+        }
+    }
+}
+
+template<typename T>
+const T* ncf::Net<T>::getArena() const{
+    return arena;
+}
+template<typename T>
+std::size_t ncf::Net<T>::getArenaSize() const{
+    return arena_size;
+}
+
+template<typename T>
+typename ncf::Net<T>::Header ncf::Net<T>::layout(std::vector<Record>& records, const std::string& method) const{
+    size_t count = layers.size();
+    if(count == 0)
+        throw std::runtime_error("Net [" + method + "]: empty net");
+
+    std::size_t alignment = format::line / sizeof(T);
+
+    Header h = {};
+    std::memcpy(h.magic, "NCFN", 4);
+    h.version = version;
+    h.dtype = format::dtype<T>();
+    h.dtype_size = sizeof(T);
+    h.layers = count;
+    h.table_offset = sizeof(Header);
+    h.data_offset = format::align(sizeof(Header) + count * sizeof(Record), format::page);
+
+    records.resize(count);
+    std::size_t offset = 0;
+    for(size_t i = 0; i < count; i++){
+        const Layer<T>& layer = *layers.at(i).first;
+        Record& r = records[i];
+        r = {};
+        r.neurons = layer.getNeurons();
+
+        const std::string& name = layer.getPolicy().name;
+        if(name.size() >= sizeof(r.activation))
+            throw std::runtime_error("Net [" + method + "]: activation name '" + name + "' is too long");
+        std::memcpy(r.activation, name.data(), name.size());
+
+        if(i == 0) continue;
+        r.prev_neurons = layers.at(i - 1).first->getNeurons();
+        if(!layer.checkCore(r.prev_neurons))
+            throw std::runtime_error("Net [" + method + "]: layer " + std::to_string(i) + " has no core");
+
+        r.offset = offset * sizeof(T);
+        offset += format::align(r.neurons * r.prev_neurons, alignment);
+    }
+    h.data_size = offset * sizeof(T);
+
+    return h;
+}
+
+template<typename T>
+void ncf::Net<T>::save(const std::string& path) const{
+    std::vector<Record> records;
+    Header h = layout(records, "save");
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out)
+        throw std::runtime_error("Net [save]: can't open '" + path + "'");
+    out.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+
+    for(size_t i = 1; i < records.size(); i++){
+        const mcf::Mat<T>& core = layers.at(i).first->getConstCore(records[i].prev_neurons);
+        format::pad(out, h.data_offset + records[i].offset);
+        out.write(reinterpret_cast<const char*>(kernel::data(core)), core.getH() * core.getW() * sizeof(T));
+    }
+    format::pad(out, h.data_offset + h.data_size);
+
+    if(!out)
+        throw std::runtime_error("Net [save]: write to '" + path + "' failed");
+}
+
+template<typename T>
+void ncf::Net<T>::snapshot(std::vector<char>& image) const{
+    std::vector<Record> records;
+    Header h = layout(records, "snapshot");
+
+    image.resize(h.data_offset + h.data_size);
+    char* base = image.data();
+
+    std::size_t table_end = h.table_offset + records.size() * sizeof(Record);
+    std::memcpy(base, &h, sizeof(Header));
+    std::memcpy(base + h.table_offset, records.data(), records.size() * sizeof(Record));
+    std::fill(base + table_end, base + h.data_offset, 0);
+
+    // every core is followed by the padding up to the next one
+    for(size_t i = 1; i < records.size(); i++){
+        const mcf::Mat<T>& core = layers.at(i).first->getConstCore(records[i].prev_neurons);
+        std::size_t bytes = core.getH() * core.getW() * sizeof(T);
+        std::size_t next = i + 1 < records.size() ? records[i + 1].offset : h.data_size;
+
+        char* block = base + h.data_offset + records[i].offset;
+        std::memcpy(block, kernel::data(core), bytes);
+        std::fill(block + bytes, base + h.data_offset + next, 0);
+    }
+}
+template<typename T>
+void ncf::Net<T>::snapshot(std::vector<char>& image, ecl::Computer& video){
+    size_t count = layers.size();
+    for(size_t i = 1; i < count; i++){
+        Layer<T>& layer = *layers.at(i).first;
+        std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+        if(layer.checkCore(prev_neurons)) video >> layer.getCore(prev_neurons);
+    }
+    snapshot(image);
+}
+
+template<typename T>
+void ncf::Net<T>::load(const std::string& path){
+    load(path, MAP::READ, true);
+}
+template<typename T>
+void ncf::Net<T>::load(const std::string& path, MAP mode){
+    load(path, mode, false);
+}
+
+template<typename T>
+void ncf::Net<T>::load(const std::string& path, MAP mode, bool copy){
+    MappedFile* file = new MappedFile(path, mode);
+    T* slab = nullptr;
+    std::vector<Layer<T>*> loaded;
+    std::vector<Record> records;
+
+    try{
+        if(file->getSize() < sizeof(Header))
+            throw std::runtime_error("Net [load]: '" + path + "' is too small");
+        Header h;
+        std::memcpy(&h, file->getConstData(), sizeof(Header));
+
+        if(std::memcmp(h.magic, "NCFN", 4) != 0)
+            throw std::runtime_error("Net [load]: '" + path + "' is not a weights file");
+        if(h.version != version)
+            throw std::runtime_error("Net [load]: unsupported version " + std::to_string(h.version));
+        if(h.dtype != format::dtype<T>() || h.dtype_size != sizeof(T))
+            throw std::runtime_error("Net [load]: dtype mismatch");
+        if(h.layers == 0 || h.data_offset % format::page != 0)
+            throw std::runtime_error("Net [load]: '" + path + "' is corrupted");
+        // bounds are compared by division, sums and products of file fields could wrap
+        std::size_t size = file->getSize();
+        if(h.table_offset > size || h.layers > (size - h.table_offset) / sizeof(Record) ||
+           h.data_offset > size || h.data_size > size - h.data_offset)
+            throw std::runtime_error("Net [load]: '" + path + "' is truncated");
+
+        records.resize(h.layers);
+        std::memcpy(records.data(), file->getConstData() + h.table_offset, h.layers * sizeof(Record));
+
+        // everything is checked before the net is touched
+        for(size_t i = 0; i < records.size(); i++){
+            Record& r = records[i];
+            r.activation[sizeof(r.activation) - 1] = '\0';
+            if(r.activation[0] != '\0' && !Activation<T>::check(r.activation))
+                throw std::runtime_error("Net [load]: unknown activation '" + std::string(r.activation) + "'");
+
+            if(r.neurons == 0)
+                throw std::runtime_error("Net [load]: '" + path + "' is corrupted");
+            if(i == 0) continue;
+            if(r.prev_neurons == 0 || r.prev_neurons != records[i - 1].neurons || r.offset % format::line != 0 ||
+               r.offset > h.data_size || r.neurons > (h.data_size - r.offset) / sizeof(T) / r.prev_neurons)
+                throw std::runtime_error("Net [load]: '" + path + "' is corrupted");
+        }
+
+        for(auto& r : records){
+            loaded.push_back(new Layer<T>(r.neurons));
+            if(r.activation[0] != '\0') loaded.back()->setActivation(Activation<T>::get(r.activation));
+        }
+
+        if(h.data_size > 0){
+            if(copy){
+                // the payload is already laid out as an arena
+                slab = static_cast<T*>(::operator new(h.data_size, std::align_val_t(format::page)));
+                std::memcpy(slab, file->getConstData() + h.data_offset, h.data_size);
+            }
+            else slab = reinterpret_cast<T*>(file->getData() + h.data_offset);
+        }
+        if(copy || slab == nullptr){
+            delete file;
+            file = nullptr;
+        }
+
+        unpack();
+        for(auto& p : layers){
+            if(p.second == true) delete p.first;
+        }
+        layers.clear();
+
+        arena_size = h.data_size / sizeof(T);
+    } catch(...){
+        for(auto* l : loaded) delete l;
+        if(copy && slab != nullptr) ::operator delete(slab, std::align_val_t(format::page));
+        delete file;
+        throw;
+    }
+
+    for(auto* l : loaded)
+        layers.push_back(std::make_pair(l, true));
+
+    for(size_t i = 1; i < records.size(); i++){
+        const Record& r = records[i];
+        loaded[i]->setCore(r.prev_neurons, mcf::Mat<T>(slab + r.offset / sizeof(T), r.neurons, r.prev_neurons));
+    }
+
+    arena = slab;
+    if(arena == nullptr) arena_size = 0;
+    mapping = file;
+    map_mode = mode;
+    generation++;
+    if(arena != nullptr) checkViews("load");
+}
+
+template<typename T>
+std::size_t ncf::Net<T>::getGeneration() const{
+    return generation;
+}
+template<typename T>
+bool ncf::Net<T>::checkMapped() const{
+    return mapping != nullptr;
+}
+template<typename T>
+void ncf::Net<T>::makeWritable(){
+    if(mapping != nullptr && map_mode == MAP::READ) pack();
+}
+
+template<typename T>
+void ncf::Net<T>::prune(const T& threshold, std::size_t examples){
+    makeWritable();
+    for(size_t i = 1; i < layers.size(); i++)
+        layers.at(i).first->prune(layers.at(i - 1).first->getNeurons(), threshold, examples);
+}
+template<typename T>
+void ncf::Net<T>::prune(const Sparsity& sparsity, std::size_t examples){
+    if(sparsity.fraction < 0 || sparsity.fraction >= 1)
+        throw std::runtime_error("Net [prune]: sparsity fraction must be in [0, 1)");
+    makeWritable();
+
+    std::vector<T> magnitudes;
+    for(size_t i = 1; i < layers.size(); i++){
+        Layer<T>& layer = *layers.at(i).first;
+        std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+        if(!layer.checkCore(prev_neurons))
+            throw std::runtime_error("Net [prune]: layer " + std::to_string(i) + " has no core");
+
+        // every core loses the same fraction, whatever the scale of its weights
+        const T* a = kernel::data(layer.getConstCore(prev_neurons));
+        magnitudes.resize(layer.getNeurons() * prev_neurons);
+        for(std::size_t k = 0; k < magnitudes.size(); k++) magnitudes[k] = std::abs(a[k]);
+
+        auto nth = magnitudes.begin() + static_cast<std::ptrdiff_t>(sparsity.fraction * static_cast<double>(magnitudes.size()));
+        std::nth_element(magnitudes.begin(), nth, magnitudes.end());
+        layer.prune(prev_neurons, *nth, examples);
+    }
+}
+
+template<typename T>
+std::vector<T> ncf::Net<T>::score(std::size_t layer) const{
+    if(layer == 0 || layer + 1 >= layers.size())
+        throw std::runtime_error("Net [score]: only hidden layers are scored");
+
+    std::size_t neurons = layers.at(layer).first->getNeurons();
+    const Layer<T>& next = *layers.at(layer + 1).first;
+    if(!next.checkCore(neurons))
+        throw std::runtime_error("Net [score]: layer " + std::to_string(layer + 1) + " has no core");
+
+    // outgoing weights of neuron k are column k of the next core, rows are summed in memory order
+    const T* a = kernel::data(next.getConstCore(neurons));
+    std::vector<T> result(neurons, T(0));
+    for(std::size_t i = 0; i < next.getNeurons(); i++)
+        for(std::size_t k = 0; k < neurons; k++) result[k] += a[i * neurons + k] * a[i * neurons + k];
+    for(auto& v : result) v = std::sqrt(v);
+
+    return result;
+}
+template<typename T>
+std::vector<T> ncf::Net<T>::score(std::size_t layer, const StockPool<T>& pool) const{
+    checkStockPool(pool, "score");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [score]: planned pools don't keep every out");
+
+    std::vector<T> result = score(layer);
+
+    const mcf::Mat<T>& out = pool.getConstStock(layer).getConstOut();
+    std::size_t examples = out.getW();
+    const T* o = kernel::data(out);
+    for(std::size_t k = 0; k < result.size(); k++){
+        T sum = 0;
+        for(std::size_t j = 0; j < examples; j++) sum += std::abs(o[k * examples + j]);
+        result[k] *= sum / static_cast<T>(examples);
+    }
+
+    return result;
+}
+template<typename T>
+void ncf::Net<T>::removeNeurons(std::size_t layer, const std::vector<std::size_t>& neurons){
+    if(layer == 0 || layer + 1 >= layers.size())
+        throw std::runtime_error("Net [remove neurons]: only hidden layers lose neurons");
+
+    Layer<T>& target = *layers.at(layer).first;
+    Layer<T>& next = *layers.at(layer + 1).first;
+    std::size_t count = target.getNeurons();
+    if(!next.checkCore(count))
+        throw std::runtime_error("Net [remove neurons]: layer " + std::to_string(layer + 1) + " has no core");
+
+    std::vector<bool> removed(count, false);
+    for(std::size_t k : neurons){
+        if(k >= count)
+            throw std::runtime_error("Net [remove neurons]: neuron " + std::to_string(k) + " out of range");
+        removed[k] = true;
+    }
+    std::vector<std::size_t> kept;
+    for(std::size_t k = 0; k < count; k++)
+        if(!removed[k]) kept.push_back(k);
+    if(kept.size() == count) return;
+
+    // what keepNeurons and keepInputs would throw on is checked before the net is unpacked
+    if(kept.empty())
+        throw std::runtime_error("Net [remove neurons]: a layer needs at least one neuron");
+    if(next.checkCore(kept.size()))
+        throw std::runtime_error("Net [remove neurons]: layer " + std::to_string(layer + 1) + " already has a core for " + std::to_string(kept.size()) + " inputs");
+
+    // the arena has the old shapes baked in, it is laid out again afterwards
+    bool packed = checkPacked();
+    unpack();
+
+    next.keepInputs(count, kept);
+    target.keepNeurons(kept);
+    generation++;
+
+    if(packed) pack();
+}
+template<typename T>
+void ncf::Net<T>::shrink(std::size_t layer, const std::vector<T>& scores, std::size_t keep){
+    if(layer == 0 || layer + 1 >= layers.size())
+        throw std::runtime_error("Net [shrink]: only hidden layers lose neurons");
+
+    std::size_t count = layers.at(layer).first->getNeurons();
+    if(scores.size() != count)
+        throw std::runtime_error("Net [shrink]: one score per neuron expected");
+    if(keep == 0 || keep > count)
+        throw std::runtime_error("Net [shrink]: invalid count of kept neurons");
+
+    // lowest scores go first, among equal scores the earlier neuron
+    std::vector<std::size_t> order(count);
+    std::iota(order.begin(), order.end(), std::size_t(0));
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){ return scores[a] < scores[b]; });
+
+    removeNeurons(layer, std::vector<std::size_t>(order.begin(), order.begin() + static_cast<std::ptrdiff_t>(count - keep)));
+}
+
+template<typename T>
+ncf::ExecutionPlan<T> ncf::Net<T>::compile(std::size_t input, std::size_t batch){
+    if(layers.empty() || layers.front().first->getNeurons() != input)
+        throw std::runtime_error("Net [compile]: input size doesn't match the input layer");
+    makeWritable();
+    return ExecutionPlan<T>(*this, batch, std::nullopt, nullptr);
+}
+template<typename T>
+ncf::ExecutionPlan<T> ncf::Net<T>::compile(std::size_t input, std::size_t batch, ecl::Computer& video){
+    if(layers.empty() || layers.front().first->getNeurons() != input)
+        throw std::runtime_error("Net [compile]: input size doesn't match the input layer");
+    makeWritable();
+    return ExecutionPlan<T>(*this, batch, std::nullopt, &video);
+}
+template<typename T>
+ncf::ExecutionPlan<T> ncf::Net<T>::compile(std::size_t input, std::size_t batch, const Optimizer<T>& optimizer){
+    if(layers.empty() || layers.front().first->getNeurons() != input)
+        throw std::runtime_error("Net [compile]: input size doesn't match the input layer");
+    makeWritable();
+    return ExecutionPlan<T>(*this, batch, optimizer.getSlotsCount(), nullptr);
+}
+template<typename T>
+ncf::ExecutionPlan<T> ncf::Net<T>::compile(std::size_t input, std::size_t batch, const Optimizer<T>& optimizer, ecl::Computer& video){
+    if(layers.empty() || layers.front().first->getNeurons() != input)
+        throw std::runtime_error("Net [compile]: input size doesn't match the input layer");
+    makeWritable();
+    return ExecutionPlan<T>(*this, batch, optimizer.getSlotsCount(), &video);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const std::function<T(const T&)>& activation){
+    for(auto& p : layers) p.first->setActivation(activation);
+}
+template<typename T>
+void ncf::Net<T>::setDerivatives(const std::function<T(const T&)>& derivative){
+    for(auto& p : layers) p.first->setDerivative(derivative);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const std::string& activation){
+    for(auto& p : layers) p.first->setActivation(activation);
+}
+template<typename T>
+void ncf::Net<T>::setDerivatives(const std::string& derivative){
+    for(auto& p : layers) p.first->setDerivative(derivative);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const Activation<T>& policy){
+    for(auto& p : layers) p.first->setActivation(policy);
+}
+template<typename T>
+template<typename P, typename>
+void ncf::Net<T>::setActivations(const P&){
+    setActivations(Activation<T>::template make<P>());
+}
+
+template<typename T>
+void ncf::Net<T>::setCoreGens(const std::function<void(mcf::Mat<T>&)>& coregen){
+    for(auto& p : layers) p.first->setCoreGen(coregen);
+}
+template<typename T>
+void ncf::Net<T>::setCoreGens(const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen){
+    for(auto& p : layers) p.first->setCoreGen(coregen);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const std::function<T(const T&)>& activation){
+    for(auto n : indexes) layers.at(n).first->setActivation(activation);
+}
+template<typename T>
+void ncf::Net<T>::setDerivatives(const std::vector<std::size_t>& indexes, const std::function<T(const T&)>& derivative){
+    for(auto n : indexes) layers.at(n).first->setDerivative(derivative);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const std::string& activation){
+    for(auto n : indexes) layers.at(n).first->setActivation(activation);
+}
+template<typename T>
+void ncf::Net<T>::setDerivatives(const std::vector<std::size_t>& indexes, const std::string& derivative){
+    for(auto n : indexes) layers.at(n).first->setDerivative(derivative);
+}
+
+template<typename T>
+void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const Activation<T>& policy){
+    for(auto n : indexes) layers.at(n).first->setActivation(policy);
+}
+template<typename T>
+template<typename P, typename>
+void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const P&){
+    setActivations(indexes, Activation<T>::template make<P>());
+}
+
+template<typename T>
+void ncf::Net<T>::setCoreGens(const std::vector<std::size_t>& indexes, const std::function<void(mcf::Mat<T>&)>& coregen){
+    for(auto n : indexes) layers.at(n).first->setCoreGen(coregen);
+}
+template<typename T>
+void ncf::Net<T>::setCoreGens(const std::vector<std::size_t>& indexes, const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen){
+    for(auto n : indexes) layers.at(n).first->setCoreGen(coregen);
+}
+
+template<typename T>
+std::size_t ncf::Net<T>::getLayersCount() const{
+    return layers.size();
+}
+template<typename T>
+const ncf::Layer<T>& ncf::Net<T>::getConstLayer(std::size_t index) const{
+    return *layers.at(index).first;
+}
+
+template<typename T>
+ncf::Layer<T>& ncf::Net<T>::getLayer(std::size_t index){
+    return *layers.at(index).first;
+}
+
+template<typename T>
+void ncf::Net<T>::forward(StockPool<T>& pool){
+    size_t count = pool.getStocksCount();
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i));
+}
+template<typename T>
+void ncf::Net<T>::forward(StockPool<T>& pool, ecl::Computer& video){
+    size_t count = pool.getStocksCount();
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i), video);
+}
+
+template<typename T>
+void ncf::Net<T>::query(const mcf::Mat<T>& in, StockPool<T>& pool){
+    checkStockPool(pool, "query");
+    pool.setSparseInput(false);
+
+    layers.at(0).first->query(in, pool.getStock(0));
+    forward(pool);
+}
+template<typename T>
+void ncf::Net<T>::query(const mcf::Mat<T>& in, StockPool<T>& pool, ecl::Computer& video){
+    checkStockPool(pool, "query");
+    pool.setSparseInput(false);
+
+    layers.at(0).first->query(in, pool.getStock(0), video);
+    forward(pool, video);
+}
+template<typename T>
+void ncf::Net<T>::query(const SparseInput<T>& in, StockPool<T>& pool){
+    checkStockPool(pool, "query");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [query]: sparse input on a planned pool");
+
+    size_t count = pool.getStocksCount();
+    if(count < 2)
+        throw std::runtime_error("Net [query]: sparse input needs a trainable layer");
+    if(in.cols != pool.getConstStock(0).getConstOut().getW())
+        throw std::runtime_error("Net [query]: invalid in size");
+
+    // a pruned core keeps its zeros only while its grad skips them, which the sparse grad doesn't
+    Layer<T>& first = *layers.at(1).first;
+    std::size_t prev_neurons = layers.at(0).first->getNeurons();
+    if(first.checkPruned(prev_neurons))
+        throw std::runtime_error("Net [query]: sparse input into a pruned core");
+
+    SparseInput<T>& input = pool.getSparseInput();
+    layers.at(0).first->query(in, input);
+    pool.setSparseInput(true);
+
+    Stock<T>& stock = pool.getStock(1);
+    first.query(input, stock.getPreout(), stock.getOut(), first.createCore(prev_neurons));
+
+    for(size_t i = 2; i < count; i++)
+        layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i));
+}
+
+template<typename T>
+void ncf::Net<T>::error(const mcf::Mat<T>& answer, StockPool<T>& pool){
+    checkStockPool(pool, "error");
+
+    size_t count = pool.getStocksCount();
+    size_t last = count - 1;
+
+    layers.at(last).first->error(answer, pool.getStock(last));
+
+    // on a planned pool the hidden errors are produced by backward
+    if(pool.checkPlanned()) return;
+
+    for(int i = last - 1; i >= 1; i--)
+        layers.at(i).first->error(pool.getConstStock(i + 1), pool.getStock(i));
+}
+template<typename T>
+void ncf::Net<T>::error(const mcf::Mat<T>& answer, StockPool<T>& pool, ecl::Computer& video){
+    checkStockPool(pool, "error");
+
+    size_t count = pool.getStocksCount();
+    size_t last = count - 1;
+
+    layers.at(last).first->error(answer, pool.getStock(last), video);
+
+    if(pool.checkPlanned()) return;
+
+    for(int i = last - 1; i >= 1; i--)
+        layers.at(i).first->error(pool.getConstStock(i + 1), pool.getStock(i), video);
+}
+
+template<typename T>
+T ncf::Net<T>::cost(const StockPool<T>& pool, const std::function<T(const T&)>& cost) const{
+    checkStockPool(pool, "cost");
+
+    size_t count = pool.getStocksCount();
+    size_t last = count - 1;
+
+    return layers.at(last).first->cost(pool.getConstStock(last), cost);
+}
+
+template<typename T>
+const mcf::Mat<T>& ncf::Net<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool) const{
+    checkInferencePool(pool, "predict");
+
+    layers.at(0).first->query(in, pool.getOut(0));
+
+    size_t count = layers.size();
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->query(pool.getConstOut(i - 1), pool.getOut(i), *layers.at(i - 1).first);
+
+    return pool.getLastOut();
+}
+template<typename T>
+const mcf::Mat<T>& ncf::Net<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool, ecl::Computer& video) const{
+    checkInferencePool(pool, "predict");
+
+    layers.at(0).first->query(in, pool.getOut(0), video);
+
+    size_t count = layers.size();
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->query(pool.getConstOut(i - 1), pool.getOut(i), *layers.at(i - 1).first, video);
+
+    return pool.getLastOut();
+}
+
+template<typename T>
+void ncf::Net<T>::grad(StockPool<T>& pool, const std::function<T(const T&)>& div_cost){
+    checkStockPool(pool, "grad");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [grad]: planned pool, use backward");
+
+    size_t count = pool.getStocksCount();
+    size_t first = 1;
+
+    // after a sparse query layer 1 reads the pool's sparse input instead of stock 0
+    if(pool.checkSparseInput()){
+        std::size_t prev_neurons = layers.at(0).first->getNeurons();
+        Stock<T>& stock = pool.getStock(1);
+        stock.createGrad(prev_neurons);
+
+        layers.at(1).first->grad(stock.getConstError(), pool.getConstSparseInput(), stock.getGrad(prev_neurons), div_cost);
+        first = 2;
+    }
+    
+    for(size_t i = first; i < count; i++)
+        layers.at(i).first->grad(pool.getConstStock(i - 1), pool.getStock(i), div_cost);
+}
+template<typename T>
+void ncf::Net<T>::grad(StockPool<T>& pool, const std::string& div_cost, ecl::Computer& video){
+    checkStockPool(pool, "grad");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [grad]: planned pool, use backward");
+    // the sparse input stays on the host, the device stock 0 is from an older dense query
+    if(pool.checkSparseInput())
+        throw std::runtime_error("Net [grad]: sparse input is host only");
+
+    size_t count = pool.getStocksCount();
+    
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->grad(pool.getConstStock(i - 1), pool.getStock(i), div_cost, video);
+}
+
+template<typename T>
+void ncf::Net<T>::train(StockPool<T>& pool, const T& learning_rate){
+    train(pool, optimizer::GD<T>(learning_rate));
+}
+template<typename T>
+void ncf::Net<T>::train(StockPool<T>& pool, const T& learning_rate, ecl::Computer& video){
+    train(pool, optimizer::GD<T>(learning_rate), video);
+}
+
+template<typename T>
+void ncf::Net<T>::train(StockPool<T>& pool, const Optimizer<T>& optimizer){
+    checkStockPool(pool, "train");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [train]: planned pool, use backward");
+    makeWritable();
+
+    size_t count = pool.getStocksCount();
+    
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->train(pool.getConstStock(i - 1), pool.getStock(i), optimizer);
+}
+template<typename T>
+void ncf::Net<T>::train(StockPool<T>& pool, const Optimizer<T>& optimizer, ecl::Computer& video){
+    checkStockPool(pool, "train");
+    if(pool.checkPlanned())
+        throw std::runtime_error("Net [train]: planned pool, use backward");
+    makeWritable();
+
+    size_t count = pool.getStocksCount();
+    
+    for(size_t i = 1; i < count; i++)
+        layers.at(i).first->train(pool.getConstStock(i - 1), pool.getStock(i), optimizer, video);
+}
+
+template<typename T>
+void ncf::Net<T>::backward(StockPool<T>& pool, const std::function<T(const T&)>& div_cost, const Optimizer<T>& optimizer){
+    if(!pool.checkPlanned()){
+        grad(pool, div_cost);
+        train(pool, optimizer);
+        return;
+    }
+    checkStockPool(pool, "backward");
+    makeWritable();
+
+    // error k - 1 reads core k, so core k is trained right after it
+    size_t count = pool.getStocksCount();
+    size_t last = count - 1;
+    size_t interval = pool.getInterval();
+    for(size_t k = last; k >= 1; k--){
+        // a checkpoint brings back the activations of the segment below it
+        if(k < last && k % interval == 0){
+            for(size_t i = k - interval + 1; i < k; i++)
+                layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i));
+        }
+        if(k >= 2) layers.at(k - 1).first->error(pool.getConstStock(k), pool.getStock(k - 1));
+
+        layers.at(k).first->grad(pool.getConstStock(k - 1), pool.getStock(k), div_cost);
+        layers.at(k).first->train(pool.getConstStock(k - 1), pool.getStock(k), optimizer);
+    }
+}
+template<typename T>
+void ncf::Net<T>::backward(StockPool<T>& pool, const std::string& div_cost, const Optimizer<T>& optimizer, ecl::Computer& video){
+    if(!pool.checkPlanned()){
+        grad(pool, div_cost, video);
+        train(pool, optimizer, video);
+        return;
+    }
+    checkStockPool(pool, "backward");
+    makeWritable();
+
+    size_t count = pool.getStocksCount();
+    size_t last = count - 1;
+    size_t interval = pool.getInterval();
+    for(size_t k = last; k >= 1; k--){
+        if(k < last && k % interval == 0){
+            for(size_t i = k - interval + 1; i < k; i++)
+                layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i), video);
+        }
+        if(k >= 2) layers.at(k - 1).first->error(pool.getConstStock(k), pool.getStock(k - 1), video);
+
+        layers.at(k).first->grad(pool.getConstStock(k - 1), pool.getStock(k), div_cost, video);
+        layers.at(k).first->train(pool.getConstStock(k - 1), pool.getStock(k), optimizer, video);
+    }
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error) {
+	return fit(frame, optimizer::GD<T>(learning_rate), max_iterations, min_error);
+}
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error, ecl::Computer& video) {
+	return fit(frame, optimizer::GD<T>(learning_rate), max_iterations, min_error, video);
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error) {
+	const mcf::Mat<T>& data = frame.data;
+	const mcf::Mat<T>& answer = frame.answer;
+	StockPool<T>& pool = frame.pool;
+	const std::function<T(const T&)>& cost = frame.cost;
+	const std::function<T(const T&)>& div_cost = std::get<0>(frame.div_cost);
+
+	T e = 1;
+	for (size_t i = 0; i < max_iterations; i++) {
+		query(data, pool);
+		error(answer, pool);
+
+		e = this->cost(pool, cost);
+		if (e < min_error) break;
+
+		backward(pool, div_cost, optimizer);
+		if (frame.checkpointer != nullptr) frame.checkpointer->step(*this);
+	}
+
+	return e;
+}
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, ecl::Computer& video) {
+	const mcf::Mat<T>& data = frame.data;
+	const mcf::Mat<T>& answer = frame.answer;
+	StockPool<T>& pool = frame.pool;
+	const std::function<T(const T&)>& cost = frame.cost;
+	const std::string& div_cost = std::get<1>(frame.div_cost);
+
+	T e = 1;
+	for (size_t i = 0; i < max_iterations; i++) {
+		query(data, pool, video);
+		error(answer, pool, video);
+
+		video >> pool.getStock(pool.getStocksCount() - 1).getError();
+		e = this->cost(pool, cost);
+		if (e < min_error) break;
+
+		backward(pool, div_cost, optimizer, video);
+		if (frame.checkpointer != nullptr) frame.checkpointer->step(*this, video);
+	}
+
+	return e;
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error) {
+	return fit(frame, batching, optimizer, epochs, min_error, nullptr);
+}
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error, ecl::Computer& video) {
+	return fit(frame, batching, optimizer, epochs, min_error, &video);
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error, ecl::Computer* video) {
+	const mcf::Mat<T>& data = frame.data;
+	const mcf::Mat<T>& answer = frame.answer;
+	StockPool<T>& pool = frame.pool;
+	const std::function<T(const T&)>& cost = frame.cost;
+
+	checkStockPool(pool, "fit");
+
+	std::size_t examples = data.getW();
+	std::size_t batch = batching.size;
+	if (batch == 0 || answer.getW() != examples)
+		throw std::runtime_error("Net [fit]: invalid batching");
+
+	Stock<T>& input = pool.getStock(0);
+	Stock<T>& output = pool.getLastStock();
+	if (input.getConstOut().getW() != batch || input.getConstOut().getH() != data.getH())
+		throw std::runtime_error("Net [fit]: pool is not sized for one batch");
+	pool.setSparseInput(false);
+
+	// batch columns are gathered through the permutation, the dataset itself is never reordered
+	std::vector<std::size_t> permutation(examples);
+	std::iota(permutation.begin(), permutation.end(), 0);
+	std::mt19937_64 generator(batching.seed);
+
+	std::vector<std::size_t> index(batch);
+	mcf::Mat<T> batch_answer(answer.getH(), batch);
+	if (video != nullptr) *video << batch_answer;
+
+	std::size_t batches = (examples + batch - 1) / batch;
+
+	T e = 1;
+	for (size_t epoch = 0; epoch < epochs; epoch++) {
+		if (batching.shuffle)
+			std::shuffle(permutation.begin(), permutation.end(), generator);
+
+		T total = 0;
+		for (size_t b = 0; b < batches; b++) {
+			// the last batch wraps around to the start of the permutation
+			for (size_t c = 0; c < batch; c++)
+				index[c] = permutation[(b * batch + c) % examples];
+
+			kernel::gather(kernel::data(data), kernel::data(input.getOut()), data.getH(), examples, index.data(), batch);
+			kernel::gather(kernel::data(answer), kernel::data(batch_answer), answer.getH(), examples, index.data(), batch);
+
+			if (video == nullptr) {
+				layers.at(0).first->query(input.getConstOut(), input.getOut());
+				forward(pool);
+				error(batch_answer, pool);
+
+				total += this->cost(pool, cost);
+
+				backward(pool, std::get<0>(frame.div_cost), optimizer);
+				if (frame.checkpointer != nullptr) frame.checkpointer->step(*this);
+			} else {
+				*video << input.getOut() << batch_answer;
+
+				layers.at(0).first->query(input.getConstOut(), input.getOut(), *video);
+				forward(pool, *video);
+				error(batch_answer, pool, *video);
+
+				*video >> output.getError();
+				total += this->cost(pool, cost);
+
+				backward(pool, std::get<1>(frame.div_cost), optimizer, *video);
+				if (frame.checkpointer != nullptr) frame.checkpointer->step(*this, *video);
+			}
+		}
+
+		e = total / static_cast<T>(batches);
+		if (e < min_error) break;
+	}
+
+	return e;
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const StreamFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error) {
+	Prefetcher<T>& prefetcher = frame.prefetcher;
+	StockPool<T>& pool = frame.pool;
+	const std::function<T(const T&)>& div_cost = std::get<0>(frame.div_cost);
+
+	T e = 1;
+	for (size_t i = 0; i < max_iterations; i++) {
+		// the loader keeps filling the other slots meanwhile
+		auto batch = prefetcher.acquire();
+
+		query(batch.first, pool);
+		error(batch.second, pool);
+
+		e = this->cost(pool, frame.cost);
+		if (e < min_error) break;
+
+		backward(pool, div_cost, optimizer);
+		if (frame.checkpointer != nullptr) frame.checkpointer->step(*this);
+	}
+	prefetcher.release();
+
+	return e;
+}
+template<typename T>
+T ncf::Net<T>::fit(const StreamFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, ecl::Computer& video) {
+	Prefetcher<T>& prefetcher = frame.prefetcher;
+	StockPool<T>& pool = frame.pool;
+	const std::string& div_cost = std::get<1>(frame.div_cost);
+
+	T e = 1;
+	for (size_t i = 0; i < max_iterations; i++) {
+		auto batch = prefetcher.acquire();
+		video << batch.first << batch.second;
+
+		query(batch.first, pool, video);
+		error(batch.second, pool, video);
+
+		video >> pool.getLastStock().getError();
+		e = this->cost(pool, frame.cost);
+		if (e < min_error) break;
+
+		backward(pool, div_cost, optimizer, video);
+		if (frame.checkpointer != nullptr) frame.checkpointer->step(*this, video);
+	}
+	prefetcher.release();
+
+	return e;
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const SparseFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error) {
+	StockPool<T>& pool = frame.pool;
+
+	T e = 1;
+	for (size_t i = 0; i < max_iterations; i++) {
+		query(frame.data, pool);
+		error(frame.answer, pool);
+
+		e = this->cost(pool, frame.cost);
+		if (e < min_error) break;
+
+		backward(pool, frame.div_cost, optimizer);
+		if (frame.checkpointer != nullptr) frame.checkpointer->step(*this);
+	}
+
+	return e;
+}
+template<typename T>
+T ncf::Net<T>::fit(const SparseFrame<T>& frame, const Batching& batching, const Optimizer<T>& optimizer, std::size_t epochs, const T& min_error) {
+	const SparseInput<T>& data = frame.data;
+	const mcf::Mat<T>& answer = frame.answer;
+	StockPool<T>& pool = frame.pool;
+
+	checkStockPool(pool, "fit");
+
+	std::size_t examples = data.cols;
+	std::size_t batch = batching.size;
+	if (batch == 0 || answer.getW() != examples)
+		throw std::runtime_error("Net [fit]: invalid batching");
+	if (pool.getConstStock(0).getConstOut().getW() != batch || pool.getConstStock(0).getConstOut().getH() != data.rows)
+		throw std::runtime_error("Net [fit]: pool is not sized for one batch");
+
+	std::vector<std::size_t> permutation(examples);
+	std::iota(permutation.begin(), permutation.end(), 0);
+	std::mt19937_64 generator(batching.seed);
+
+	std::vector<std::size_t> index(batch);
+	SparseInput<T> batch_data;
+	mcf::Mat<T> batch_answer(answer.getH(), batch);
+
+	std::size_t batches = (examples + batch - 1) / batch;
+
+	T e = 1;
+	for (size_t epoch = 0; epoch < epochs; epoch++) {
+		if (batching.shuffle)
+			std::shuffle(permutation.begin(), permutation.end(), generator);
+
+		T total = 0;
+		for (size_t b = 0; b < batches; b++) {
+			for (size_t c = 0; c < batch; c++)
+				index[c] = permutation[(b * batch + c) % examples];
+
+			batch_data.gather(data, index.data(), batch);
+			kernel::gather(kernel::data(answer), kernel::data(batch_answer), answer.getH(), examples, index.data(), batch);
+
+			query(batch_data, pool);
+			error(batch_answer, pool);
+
+			total += this->cost(pool, frame.cost);
+
+			backward(pool, frame.div_cost, optimizer);
+			if (frame.checkpointer != nullptr) frame.checkpointer->step(*this);
+		}
+
+		e = total / static_cast<T>(batches);
+		if (e < min_error) break;
+	}
+
+	return e;
+}
+
+template<typename T>
+T ncf::Net<T>::evaluate(const mcf::Mat<T>& data, const mcf::Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost) const{
+    std::size_t examples = data.getW();
+    std::size_t batch = pool.getBatchSize();
+    if(answer.getW() != examples || examples == 0)
+        throw std::runtime_error("Net [evaluate]: invalid answer size");
+
+    mcf::Mat<T>& input = pool.getInput();
+    std::vector<std::size_t> index(batch);
+
+    T result = 0;
+    for(std::size_t j = 0; j < examples; j += batch){
+        std::size_t count = std::min(batch, examples - j);
+
+        // a short tail repeats its last example, those columns are not counted
+        for(std::size_t c = 0; c < batch; c++) index[c] = j + std::min(c, count - 1);
+        kernel::gather(kernel::data(data), kernel::data(input), data.getH(), examples, index.data(), batch);
+
+        result += kernel::cost(answer, examples, j, predict(input, pool), count, cost);
+    }
+
+    return result / static_cast<T>(answer.getH() * examples);
+}
+template<typename T>
+T ncf::Net<T>::evaluate(const mcf::Mat<T>& data, const mcf::Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost, ecl::Computer& video) const{
+    std::size_t examples = data.getW();
+    std::size_t batch = pool.getBatchSize();
+    if(answer.getW() != examples || examples == 0)
+        throw std::runtime_error("Net [evaluate]: invalid answer size");
+
+    mcf::Mat<T>& input = pool.getInput();
+    mcf::Mat<T>& out = pool.getLastOut();
+    std::vector<std::size_t> index(batch);
+
+    T result = 0;
+    for(std::size_t j = 0; j < examples; j += batch){
+        std::size_t count = std::min(batch, examples - j);
+
+        for(std::size_t c = 0; c < batch; c++) index[c] = j + std::min(c, count - 1);
+        kernel::gather(kernel::data(data), kernel::data(input), data.getH(), examples, index.data(), batch);
+        video << input;
+
+        predict(input, pool, video);
+        video >> out;
+
+        result += kernel::cost(answer, examples, j, out, count, cost);
+    }
+
+    return result / static_cast<T>(answer.getH() * examples);
+}
+
+template<typename T>
+T ncf::Net<T>::evaluate(Dataset<T>& dataset, InferencePool<T>& pool, const std::function<T(const T&)>& cost) const{
+    std::size_t batch = dataset.getBatchSize();
+    if(pool.getBatchSize() != batch)
+        throw std::runtime_error("Net [evaluate]: pool batch size differs from dataset");
+
+    T result = 0;
+    std::size_t batches = dataset.getBatchesCount();
+    for(std::size_t b = 0; b < batches; b++){
+        // the last batch wraps to the first examples, those columns are not counted
+        std::size_t count = std::min(batch, dataset.getExamples() - b * batch);
+        mcf::Mat<T> answer = dataset.getAnswer(b);
+
+        result += kernel::cost(answer, batch, 0, predict(dataset.getData(b), pool), count, cost);
+    }
+
+    return result / static_cast<T>(dataset.getOutputs() * dataset.getExamples());
+}
+template<typename T>
+T ncf::Net<T>::evaluate(Dataset<T>& dataset, InferencePool<T>& pool, const std::function<T(const T&)>& cost, ecl::Computer& video) const{
+    std::size_t batch = dataset.getBatchSize();
+    if(pool.getBatchSize() != batch)
+        throw std::runtime_error("Net [evaluate]: pool batch size differs from dataset");
+
+    mcf::Mat<T>& input = pool.getInput();
+    mcf::Mat<T>& out = pool.getLastOut();
+
+    T result = 0;
+    std::size_t batches = dataset.getBatchesCount();
+    for(std::size_t b = 0; b < batches; b++){
+        std::size_t count = std::min(batch, dataset.getExamples() - b * batch);
+        mcf::Mat<T> data = dataset.getData(b);
+        mcf::Mat<T> answer = dataset.getAnswer(b);
+
+        // mapped pages are staged through the pool input, which owns the device buffer
+        std::memcpy(kernel::data(input), kernel::data(data), input.getH() * batch * sizeof(T));
+        video << input;
+
+        predict(input, pool, video);
+        video >> out;
+
+        result += kernel::cost(answer, batch, 0, out, count, cost);
+    }
+
+    return result / static_cast<T>(dataset.getOutputs() * dataset.getExamples());
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error) {
+	return fit(frame, optimizer, max_iterations, min_error, nullptr);
+}
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error, ecl::Computer& video) {
+	return fit(frame, optimizer, max_iterations, min_error, &video);
+}
+
+template<typename T>
+T ncf::Net<T>::fit(const FitFrame<T>& frame, const optimizer::LBFGS<T>& optimizer, std::size_t max_iterations, const T& min_error, ecl::Computer* video) {
+	const mcf::Mat<T>& data = frame.data;
+	const mcf::Mat<T>& answer = frame.answer;
+	StockPool<T>& pool = frame.pool;
+	const std::function<T(const T&)>& cost = frame.cost;
+
+	checkStockPool(pool, "fit");
+	if (pool.checkPlanned())
+		throw std::runtime_error("Net [fit]: L-BFGS needs all gradients at once, planned pools are unsupported");
+	makeWritable();
+
+	// the same pool serves the gradient passes and every line search probe
+	auto evaluate = [&]() {
+		if (video == nullptr) {
+			// line search probes move the dense cores directly
+			for (size_t i = 1; i < layers.size(); i++)
+				layers.at(i).first->syncSparse(layers.at(i - 1).first->getNeurons());
+			query(data, pool);
+			error(answer, pool);
+		} else {
+			query(data, pool, *video);
+			error(answer, pool, *video);
+			*video >> pool.getLastStock().getError();
+		}
+		return this->cost(pool, cost);
+	};
+	auto gradient = [&]() {
+		if (video == nullptr) grad(pool, std::get<0>(frame.div_cost));
+		else grad(pool, std::get<1>(frame.div_cost), *video);
+	};
+
+	T e = evaluate();
+	if (e < min_error || max_iterations == 0) return e;
+	gradient();
+
+	// parameters and gradients as lists of cores
+	std::vector<mcf::Mat<T>*> X;
+	std::vector<mcf::Mat<T>*> G;
+	for (size_t i = 1; i < layers.size(); i++) {
+		std::size_t prev_neurons = layers.at(i - 1).first->getNeurons();
+		X.push_back(&layers.at(i).first->getCore(prev_neurons));
+		G.push_back(&pool.getStock(i).getGrad(prev_neurons));
+	}
+
+	auto create = [&]() {
+		std::vector<mcf::Mat<T>> result;
+		for (auto* A : X) {
+			result.emplace_back(A->getH(), A->getW());
+			if (video != nullptr) *video << result.back();
+		}
+		return result;
+	};
+	auto pointers = [](std::vector<mcf::Mat<T>>& v) {
+		std::vector<mcf::Mat<T>*> result;
+		for (auto& A : v) result.push_back(&A);
+		return result;
+	};
+
+	mcf::Mat<T> partial(1, kernel::computer::dot_groups);
+	if (video != nullptr) *video << partial;
+
+	auto dot = [&](const std::vector<mcf::Mat<T>*>& a, const std::vector<mcf::Mat<T>*>& b) {
+		T result = 0;
+		for (size_t i = 0; i < a.size(); i++) {
+			std::size_t count = a[i]->getH() * a[i]->getW();
+			if (video == nullptr) {
+				result += kernel::dot(kernel::data(*a[i]), kernel::data(*b[i]), count);
+				continue;
+			}
+
+			ecl::Var<unsigned int> n(static_cast<unsigned int>(count));
+			kernel::computer::compute(*video, kernel::computer::blas<T>(), "dot", {a[i], b[i], &partial, &n}, {kernel::computer::dot_groups});
+			*video >> partial;
+			const T* p = kernel::data(partial);
+			result += std::accumulate(p, p + kernel::computer::dot_groups, T(0));
+		}
+		return result;
+	};
+	auto axpy = [&](const T& alpha, const std::vector<mcf::Mat<T>*>& x, const std::vector<mcf::Mat<T>*>& y) {
+		for (size_t i = 0; i < x.size(); i++) {
+			std::size_t count = x[i]->getH() * x[i]->getW();
+			if (video == nullptr) {
+				kernel::axpy(alpha, kernel::data(*x[i]), kernel::data(*y[i]), count);
+				continue;
+			}
+
+			ecl::Var<T> a(alpha);
+			kernel::computer::compute(*video, kernel::computer::blas<T>(), "axpy", {&a, x[i], y[i]}, {count});
+		}
+	};
+	auto scale = [&](const T& alpha, const std::vector<mcf::Mat<T>*>& x) {
+		for (auto* A : x) {
+			std::size_t count = A->getH() * A->getW();
+			if (video == nullptr) {
+				kernel::scale(alpha, kernel::data(*A), count);
+				continue;
+			}
+
+			ecl::Var<T> a(alpha);
+			kernel::computer::compute(*video, kernel::computer::blas<T>(), "scale", {&a, A}, {count});
+		}
+	};
+	auto copy = [&](const std::vector<mcf::Mat<T>*>& x, const std::vector<mcf::Mat<T>*>& y) {
+		for (size_t i = 0; i < x.size(); i++) {
+			std::size_t count = x[i]->getH() * x[i]->getW();
+			if (video == nullptr) {
+				kernel::copy(kernel::data(*x[i]), kernel::data(*y[i]), count);
+				continue;
+			}
+
+			kernel::computer::compute(*video, kernel::computer::blas<T>(), "copy", {x[i], y[i]}, {count});
+		}
+	};
+
+	// bounded history ring of (s, y) pairs, allocated once
+	std::size_t m = std::max<std::size_t>(optimizer.getHistory(), 1);
+	std::vector<std::vector<mcf::Mat<T>>> s_storage, y_storage;
+	std::vector<std::vector<mcf::Mat<T>*>> S, Y;
+	for (size_t k = 0; k < m; k++) {
+		s_storage.push_back(create());
+		y_storage.push_back(create());
+	}
+	for (size_t k = 0; k < m; k++) {
+		S.push_back(pointers(s_storage[k]));
+		Y.push_back(pointers(y_storage[k]));
+	}
+	std::vector<T> rho(m), alpha(m);
+	std::size_t stored = 0, newest = 0;
+
+	std::vector<mcf::Mat<T>> d_storage = create(), x0_storage = create(), g0_storage = create();
+	std::vector<mcf::Mat<T>*> D = pointers(d_storage), X0 = pointers(x0_storage), G0 = pointers(g0_storage);
+
+	for (size_t it = 0; it < max_iterations; it++) {
+		// two-loop recursion: D = -H * G
+		copy(G, D);
+		for (size_t k = 0; k < stored; k++) {
+			std::size_t idx = (newest + m - k) % m;
+			alpha[idx] = rho[idx] * dot(S[idx], D);
+			axpy(-alpha[idx], Y[idx], D);
+		}
+		if (stored > 0) {
+			T yy = dot(Y[newest], Y[newest]);
+			if (yy > 0) scale(1 / (rho[newest] * yy), D);
+		}
+		for (size_t k = stored; k-- > 0;) {
+			std::size_t idx = (newest + m - k) % m;
+			T beta = rho[idx] * dot(Y[idx], D);
+			axpy(alpha[idx] - beta, S[idx], D);
+		}
+		scale(T(-1), D);
+
+		T slope = dot(G, D);
+		if (!(slope < 0)) {
+			// not a descent direction: restart from steepest descent
+			stored = 0;
+			copy(G, D);
+			scale(T(-1), D);
+			slope = dot(G, D);
+		}
+
+		T step = 1;
+		if (stored == 0) step = std::min(T(1), 1 / std::sqrt(-slope));
+
+		// backtracking Armijo line search
+		copy(X, X0);
+		T e0 = e;
+		bool accepted = false;
+		for (size_t k = 0; k < optimizer.getMaxLineSearch(); k++) {
+			copy(X0, X);
+			axpy(step, D, X);
+
+			e = evaluate();
+			if (e <= e0 + optimizer.getC1() * step * slope) {
+				accepted = true;
+				break;
+			}
+			step /= 2;
+		}
+
+		if (!accepted) {
+			copy(X0, X);
+			e = evaluate();
+			break;
+		}
+		if (frame.checkpointer != nullptr) {
+			if (video == nullptr) frame.checkpointer->step(*this);
+			else frame.checkpointer->step(*this, *video);
+		}
+		if (e < min_error) break;
+
+		copy(G, G0);
+		gradient();
+
+		// s = step * D, y = G - G0
+		std::size_t next = stored == 0 ? 0 : (newest + 1) % m;
+		copy(D, S[next]);
+		scale(step, S[next]);
+		copy(G, Y[next]);
+		axpy(T(-1), G0, Y[next]);
+
+		T sy = dot(S[next], Y[next]);
+		if (sy > std::numeric_limits<T>::epsilon()) {
+			rho[next] = 1 / sy;
+			newest = next;
+			stored = std::min(stored + 1, m);
+		} else if (stored == m) {
+			// the oldest pair was overwritten by the rejected one
+			stored--;
+		}
+	}
+
+	return e;
+}
 
-template<typename T>
-void ncf::Layer<T>::setActivation(const std::function<T(const T&)>& activation){
-    this->activation = activation;
-}
-template<typename T>
-void ncf::Layer<T>::setDerivative(const std::function<T(const T&)>& derivative){
-    this->derivative = derivative;
-}
 
 template<typename T>
-void ncf::Layer<T>::setActivation(const std::string& activation){
-    this->computer_activation = activation;
+ncf::Net<T>::~Net(){
+    // external layers keep their cores after the arena is gone
+    bool external = std::any_of(layers.begin(), layers.end(), [](const std::pair<Layer<T>*, bool>& p){ return p.second == false; });
+    if(external) unpack();
+    else if(mapping != nullptr) delete mapping;
+    else if(arena != nullptr) ::operator delete(arena, std::align_val_t(format::page));
+
+    for(auto& p : layers){
+        if(p.second == true) delete p.first;
+    }
+    layers.clear();
 }
+
+
+// StockPool
 template<typename T>
-void ncf::Layer<T>::setDerivative(const std::string& derivative){
-    this->computer_derivative = derivative;
+ncf::StockPool<T>::StockPool() {}
+
+template<typename T>
+ncf::StockPool<T>::StockPool(const ncf::Net<T>& net, std::size_t examples) : StockPool(net, examples, examples) {}
+
+template<typename T>
+ncf::StockPool<T>::StockPool(const ncf::Net<T>& net, std::size_t examples, std::size_t capacity) : capacity(capacity), examples(examples){
+    if(examples == 0 || examples > capacity)
+        throw std::runtime_error("StockPool: examples out of capacity");
+
+    size_t count = net.getLayersCount();
+    std::size_t alignment = format::line / sizeof(T);
+
+    // per stock: preout, out, error and the grad for the previous layer
+    offsets.assign(4 * count + 1, 0);
+    for(size_t i = 0; i < count; i++){
+        std::size_t neurons = net.getConstLayer(i).getNeurons();
+        std::size_t prev_neurons = i > 0 ? net.getConstLayer(i - 1).getNeurons() : 0;
+
+        std::size_t preout = net.getConstLayer(i).checkFromOutput() ? 0 : neurons * capacity;
+
+        std::size_t sizes[4] = {preout, neurons * capacity, neurons * capacity, neurons * prev_neurons};
+        for(size_t k = 0; k < 4; k++)
+            offsets[4 * i + k + 1] = offsets[4 * i + k] + format::align(sizes[k], alignment);
+    }
+    slab_size = offsets.back();
+
+    if(slab_size > 0){
+        slab = static_cast<T*>(::operator new(slab_size * sizeof(T), std::align_val_t(format::page)));
+        std::fill(slab, slab + slab_size, T(0));
+    }
+
+    for(size_t i = 0; i < count; i++){
+        const Layer<T>& layer = net.getConstLayer(i);
+
+        Stock<T>* stock = new Stock<T>(layer, 0);
+        if(i > 0) stock->bindGrad(net.getConstLayer(i - 1).getNeurons(), slab + offsets[4 * i + 3]);
+        stocks.push_back(std::make_pair(stock, true));
+    }
+    bind();
 }
 
 template<typename T>
-void ncf::Layer<T>::setCoreGen(const std::function<void(mcf::Mat<T>&)>& coregen){
-    this->coregen = coregen;
+ncf::StockPool<T>::StockPool(const ncf::Net<T>& net, const MemoryPlan<T>& plan) : capacity(plan.getExamples()), examples(plan.getExamples()), planned(true), interval(plan.getInterval()){
+    size_t count = net.getLayersCount();
+    if(plan.getLayersCount() != count)
+        throw std::runtime_error("StockPool: memory plan doesn't fit the net");
+
+    offsets.assign(4 * count + 1, 0);
+    for(size_t i = 0; i < count; i++){
+        offsets[4 * i] = plan.getOffset(i, BUFFER::PREOUT);
+        offsets[4 * i + 1] = plan.getOffset(i, BUFFER::OUT);
+        offsets[4 * i + 2] = plan.getOffset(i, BUFFER::ERROR);
+        offsets[4 * i + 3] = plan.getOffset(i, BUFFER::GRAD);
+    }
+    offsets.back() = slab_size = plan.getPeakSize();
+
+    if(slab_size > 0){
+        slab = static_cast<T*>(::operator new(slab_size * sizeof(T), std::align_val_t(format::page)));
+        std::fill(slab, slab + slab_size, T(0));
+    }
+
+    for(size_t i = 0; i < count; i++){
+        Stock<T>* stock = new Stock<T>(net.getConstLayer(i), 0);
+        if(i > 0) stock->bindGrad(net.getConstLayer(i - 1).getNeurons(), slab + offsets[4 * i + 3]);
+        stocks.push_back(std::make_pair(stock, true));
+    }
+    bind();
 }
+
 template<typename T>
-void ncf::Layer<T>::setCoreGen(const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen) {
-	this->computer_coregen = coregen;
+void ncf::StockPool<T>::bind(){
+    size_t count = offsets.size() / 4;
+    for(size_t i = 0; i < count; i++){
+        stocks.at(i).first->bind(slab + offsets[4 * i], slab + offsets[4 * i + 1], slab + offsets[4 * i + 2], examples);
+    }
 }
 
 template<typename T>
-std::size_t ncf::Layer<T>::getNeurons() const{
-    return neurons;
+void ncf::StockPool<T>::resize(std::size_t examples){
+    if(examples == 0 || examples > capacity)
+        throw std::runtime_error("StockPool [resize]: examples out of capacity");
+    if(stocks.size() != offsets.size() / 4)
+        throw std::runtime_error("StockPool [resize]: pool holds external stocks");
+
+    this->examples = examples;
+    bind();
 }
+
+
 template<typename T>
-mcf::Mat<T>& ncf::Layer<T>::getCore(std::size_t prev_neurons){
-    return core.at(prev_neurons);
+void ncf::StockPool<T>::send(ecl::Computer& video){
+    for(auto& p : stocks) p.first->send(video);
 }
 template<typename T>
-const mcf::Mat<T>& ncf::Layer<T>::getConstCore(std::size_t prev_neurons) const{
-    return core.at(prev_neurons);
+void ncf::StockPool<T>::receive(ecl::Computer& video){
+    for(auto& p : stocks) p.first->receive(video);
 }
 template<typename T>
-const std::string& ncf::Layer<T>::getComputerActivation() const{
-    return computer_activation;
+void ncf::StockPool<T>::grab(ecl::Computer& video){
+    for(auto& p : stocks) p.first->grab(video);
 }
 template<typename T>
-const std::string& ncf::Layer<T>::getComputerDerivative() const{
-    return computer_derivative;
+void ncf::StockPool<T>::release(ecl::Computer& video){
+    for(auto& p : stocks) p.first->release(video);
+}
+
+namespace ncf{
+    template<typename T>
+    Computer& operator<<(Computer& video, StockPool<T>& pool){
+        pool.send(video);
+        return video;
+    }
+    template<typename T>
+    Computer& operator>>(Computer& video, StockPool<T>& pool){
+        pool.receive(video);
+        return video;
+    }
+	template<typename T>
+	std::ostream& operator<<(std::ostream& s, StockPool<T>& pool) {
+		s << pool.getStock(pool.getStocksCount() - 1);
+		return s;
+	}
 }
+
 template<typename T>
-const std::function<void(mcf::Mat<T>&)>& ncf::Layer<T>::getCoreGen() const{
-    return coregen;
+void ncf::StockPool<T>::push_back(Stock<T>* stock) {
+	stocks.push_back(std::make_pair(stock, false));
 }
 template<typename T>
-const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& ncf::Layer<T>::getComputerCoreGen() const {
-	return computer_coregen;
+ncf::Stock<T>* ncf::StockPool<T>::pop_back() {
+	Layer<T>* result = stocks.back().first;
+	stocks.pop_back();
+	return result;
 }
+
 template<typename T>
-const std::function<T(const T&)>& ncf::Layer<T>::getActivation() const{
-    return activation;
+std::size_t ncf::StockPool<T>::getStocksCount() const{
+    return stocks.size();
 }
 template<typename T>
-const std::function<T(const T&)>& ncf::Layer<T>::getDerivative() const{
-    return derivative;
+const ncf::Stock<T>& ncf::StockPool<T>::getConstStock(std::size_t index) const{
+    return *stocks.at(index).first;
 }
 
-// Low-level methods
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out) const{
-    if(activation == nullptr)
-        throw std::runtime_error("Layer [query]: activation function unsetted");
-    in.map(activation, out);
+ncf::Stock<T>& ncf::StockPool<T>::getStock(std::size_t index){
+    return *stocks.at(index).first;
 }
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& out, ecl::Computer& video) const{
-    in.map(computer_activation, out, video);
+ncf::Stock<T>& ncf::StockPool<T>::getLastStock() {
+	return *stocks.back().first;
 }
 
+
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const Layer<T>& prev){
-    createCore(prev.neurons);
-    
-    getCore(prev.neurons).mul(in, preout);
-    preout.map(activation, out);
+std::size_t ncf::StockPool<T>::getCapacity() const{
+    return capacity;
 }
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, mcf::Mat<T>& preout, mcf::Mat<T>& out, const Layer<T>& prev, ecl::Computer& video){
-    createCore(prev.neurons, video);
-    
-    getCore(prev.neurons).mul(in, preout, video);
-    preout.map(computer_activation, out, video);
+std::size_t ncf::StockPool<T>::getExamples() const{
+    return examples;
+}
+template<typename T>
+bool ncf::StockPool<T>::checkPlanned() const{
+    return planned;
+}
+template<typename T>
+std::size_t ncf::StockPool<T>::getInterval() const{
+    return interval;
+}
+
+template<typename T>
+bool ncf::StockPool<T>::checkSparseInput() const{
+    return sparse;
+}
+template<typename T>
+void ncf::StockPool<T>::setSparseInput(bool sparse){
+    this->sparse = sparse;
+}
+template<typename T>
+ncf::SparseInput<T>& ncf::StockPool<T>::getSparseInput(){
+    return sparse_input;
+}
+template<typename T>
+const ncf::SparseInput<T>& ncf::StockPool<T>::getConstSparseInput() const{
+    return sparse_input;
+}
+
+template<typename T>
+ncf::StockPool<T>::~StockPool(){
+    for(auto& p : stocks){
+        if(p.second == true) delete p.first;
+    }
+    stocks.clear();
+
+    if(slab != nullptr) ::operator delete(slab, std::align_val_t(format::page));
+}
+
+// MemoryPlan
+template<typename T>
+ncf::MemoryPlan<T>::MemoryPlan(const ncf::Net<T>& net, std::size_t examples) : MemoryPlan(net, examples, 1) {}
+
+template<typename T>
+ncf::MemoryPlan<T>::MemoryPlan(const ncf::Net<T>& net, std::size_t examples, std::size_t interval) : examples(examples), interval(interval){
+    size_t count = net.getLayersCount();
+    if(count < 2 || examples == 0)
+        throw std::runtime_error("MemoryPlan: empty net or batch");
+    if(interval == 0)
+        throw std::runtime_error("MemoryPlan: zero checkpoint interval");
+
+    std::size_t alignment = format::line / sizeof(T);
+    size_t last = count - 1;
+
+    // query i at step i, output error at step count, then per layer from the output down
+    // the repeated queries of a segment, error k - 1, grad k and train k
+    std::size_t none = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> error_step(count, 0), grad_step(count, 0), train_step(count, 0), again(count, none);
+
+    std::size_t step = count;
+    for(size_t k = last; k >= 1; k--){
+        if(k < last && k % interval == 0){
+            for(size_t i = k - interval + 1; i < k; i++) again[i] = ++step;
+            recomputed += interval - 1;
+        }
+        error_step[k] = ++step;
+        grad_step[k] = ++step;
+        train_step[k] = ++step;
+    }
+    std::size_t end = step;
+
+    buffers.resize(4 * count);
+    for(size_t i = 0; i < count; i++){
+        std::size_t neurons = net.getConstLayer(i).getNeurons();
+        std::size_t prev_neurons = i > 0 ? net.getConstLayer(i - 1).getNeurons() : 0;
+        std::size_t size = format::align(neurons * examples, alignment);
+
+        Buffer& preout = buffers[4 * i];
+        Buffer& out = buffers[4 * i + 1];
+        Buffer& error = buffers[4 * i + 2];
+        Buffer& grad = buffers[4 * i + 3];
+
+        // the input layer has neither preout nor error, the output preout is never read back
+        preout = {i > 0 && !net.getConstLayer(i).checkFromOutput() ? size : 0, {{i, i < last ? error_step[i + 1] : i}}, 0};
+        out = {size, {{i, i < last ? grad_step[i + 1] : end}}, 0};
+        error = {i > 0 ? size : 0, {{i < last ? error_step[i + 1] : count, i < last ? grad_step[i] : end}}, 0};
+        grad = {format::align(neurons * prev_neurons, alignment), {{i > 0 ? grad_step[i] : 0, i > 0 ? train_step[i] : 0}}, 0};
+
+        // a dropped activation is free from the next query until its segment is repeated
+        if(again[i] != none){
+            preout.spans = {{i, i}, {again[i], error_step[i + 1]}};
+            out.spans = {{i, i + 1}, {again[i], grad_step[i + 1]}};
+        }
+
+        // what StockPool(net, examples) holds
+        naive += (net.getConstLayer(i).checkFromOutput() ? 2 : 3) * size + grad.size;
+    }
+
+    // greedy by size: each buffer takes the lowest offset free of every placed buffer alive at the same time
+    std::vector<size_t> order(buffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return buffers[a].size > buffers[b].size; });
+
+    std::vector<size_t> placed;
+    for(size_t b : order){
+        Buffer& buffer = buffers[b];
+        if(buffer.size == 0) continue;
+
+        auto overlaps = [&](const Buffer& other){
+            for(auto& a : buffer.spans){
+                for(auto& b : other.spans){
+                    if(b.first <= a.second && a.first <= b.second) return true;
+                }
+            }
+            return false;
+        };
+
+        std::vector<std::pair<std::size_t, std::size_t>> taken;
+        for(size_t p : placed){
+            const Buffer& other = buffers[p];
+            if(overlaps(other))
+                taken.push_back({other.offset, other.offset + other.size});
+        }
+        std::sort(taken.begin(), taken.end());
+
+        std::size_t offset = 0;
+        for(auto& range : taken){
+            if(offset + buffer.size <= range.first) break;
+            offset = std::max(offset, range.second);
+        }
+
+        buffer.offset = offset;
+        peak = std::max(peak, offset + buffer.size);
+        placed.push_back(b);
+    }
+}
+
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getExamples() const{
+    return examples;
+}
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getLayersCount() const{
+    return buffers.size() / 4;
+}
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getInterval() const{
+    return interval;
+}
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getRecomputedCount() const{
+    return recomputed;
+}
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getOffset(std::size_t layer, BUFFER kind) const{
+    return buffers.at(4 * layer + static_cast<std::size_t>(kind)).offset;
+}
+
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getNaiveSize() const{
+    return naive;
+}
+template<typename T>
+std::size_t ncf::MemoryPlan<T>::getPeakSize() const{
+    return peak;
+}
+
+// ExecutionPlan
+template<typename T>
+ncf::ExecutionPlan<T>::ExecutionPlan(ncf::Net<T>& net, std::size_t batch, std::optional<std::size_t> slots, ecl::Computer* video) : net(net), pool(net, MemoryPlan<T>(net, batch)), slots(slots), generation(net.getGeneration()){
+    size_t count = net.getLayersCount();
+
+    for(size_t i = 0; i < count; i++){
+        Layer<T>& layer = net.getLayer(i);
+        if(video == nullptr && layer.getPolicy().forward_kernel == nullptr && layer.getActivation() == nullptr)
+            throw std::runtime_error("ExecutionPlan: activation function unsetted at layer " + std::to_string(i));
+        if(video != nullptr && layer.getComputerActivation().empty())
+            throw std::runtime_error("ExecutionPlan: computer activation unsetted at layer " + std::to_string(i));
+
+        // backward takes the derivative of every hidden layer, the output error is just answer - out
+        if(slots && i > 0 && i + 1 < count){
+            const Activation<T>& policy = layer.getPolicy();
+            if(video == nullptr && policy.backward_kernel == nullptr && layer.getDerivative() == nullptr)
+                throw std::runtime_error("ExecutionPlan: derivative function unsetted at layer " + std::to_string(i));
+            if(video != nullptr && (policy.from_output ? policy.computer_output_derivative : layer.getComputerDerivative()).empty())
+                throw std::runtime_error("ExecutionPlan: computer derivative unsetted at layer " + std::to_string(i));
+        }
+
+        Step step = {&layer, &pool.getStock(i), nullptr, nullptr, nullptr};
+        if(i > 0){
+            std::size_t prev_neurons = net.getLayer(i - 1).getNeurons();
+
+            step.core = video == nullptr ? &layer.createCore(prev_neurons) : &layer.createCore(prev_neurons, *video);
+            step.grad = &step.stock->getGrad(prev_neurons);
+
+            if(slots){
+                if(video == nullptr) layer.createState(prev_neurons, *slots);
+                else layer.createState(prev_neurons, *slots, *video);
+                step.state = &layer.getState(prev_neurons);
+            }
+        }
+        steps.push_back(step);
+    }
+
+    if(video != nullptr) pool.send(*video);
+}
+
+template<typename T>
+void ncf::ExecutionPlan<T>::checkOptimizer(const Optimizer<T>& optimizer) const{
+    if(!slots)
+        throw std::runtime_error("ExecutionPlan: compiled without an optimizer");
+    if(optimizer.getSlotsCount() != *slots)
+        throw std::runtime_error("ExecutionPlan: compiled for another optimizer");
+}
+template<typename T>
+void ncf::ExecutionPlan<T>::checkGeneration(const std::string& method) const{
+    if(net.getGeneration() != generation)
+        throw std::runtime_error("ExecutionPlan [" + method + "]: the net changed since compile, compile it again");
+}
+
+template<typename T>
+ncf::StockPool<T>& ncf::ExecutionPlan<T>::getPool(){
+    return pool;
+}
+template<typename T>
+std::size_t ncf::ExecutionPlan<T>::getBatchSize() const{
+    return pool.getExamples();
+}
+
+template<typename T>
+const mcf::Mat<T>& ncf::ExecutionPlan<T>::query(const mcf::Mat<T>& in){
+    checkGeneration("query");
+    steps.front().layer->query(in, steps.front().stock->getOut());
+
+    size_t count = steps.size();
+    for(size_t i = 1; i < count; i++){
+        Step& step = steps[i];
+        step.layer->query(steps[i - 1].stock->getConstOut(), step.stock->getPreout(), step.stock->getOut(), *step.core);
+    }
+    return steps.back().stock->getConstOut();
+}
+template<typename T>
+const mcf::Mat<T>& ncf::ExecutionPlan<T>::query(const mcf::Mat<T>& in, ecl::Computer& video){
+    checkGeneration("query");
+    steps.front().layer->query(in, steps.front().stock->getOut(), video);
+
+    size_t count = steps.size();
+    for(size_t i = 1; i < count; i++){
+        Step& step = steps[i];
+        step.layer->query(steps[i - 1].stock->getConstOut(), step.stock->getPreout(), step.stock->getOut(), *step.core, video);
+    }
+    return steps.back().stock->getConstOut();
+}
+
+template<typename T>
+void ncf::ExecutionPlan<T>::error(const mcf::Mat<T>& answer){
+    Step& last = steps.back();
+    last.layer->error(answer, last.stock->getConstOut(), last.stock->getError());
+}
+template<typename T>
+void ncf::ExecutionPlan<T>::error(const mcf::Mat<T>& answer, ecl::Computer& video){
+    Step& last = steps.back();
+    last.layer->error(answer, last.stock->getConstOut(), last.stock->getError(), video);
+}
+
+template<typename T>
+T ncf::ExecutionPlan<T>::cost(const std::function<T(const T&)>& cost) const{
+    const Step& last = steps.back();
+    return last.layer->cost(last.stock->getConstError(), cost);
+}
+
+template<typename T>
+void ncf::ExecutionPlan<T>::backward(const std::function<T(const T&)>& div_cost, const Optimizer<T>& optimizer){
+    checkGeneration("backward");
+    checkOptimizer(optimizer);
+
+    // same interleaving as Net::backward on a planned pool
+    for(size_t k = steps.size() - 1; k >= 1; k--){
+        Step& step = steps[k];
+        Step& prev = steps[k - 1];
+
+        if(k >= 2) prev.layer->error(step.stock->getConstError(), prev.stock->getConstDerivativeInput(), prev.stock->getError(), *step.core);
+
+        step.layer->grad(step.stock->getConstError(), prev.stock->getConstOut(), *step.grad, div_cost);
+        optimizer.update(*step.core, *step.grad, *step.state);
+        step.layer->syncSparse(step.core->getW());
+    }
+}
+template<typename T>
+void ncf::ExecutionPlan<T>::backward(const std::string& div_cost, const Optimizer<T>& optimizer, ecl::Computer& video){
+    checkGeneration("backward");
+    checkOptimizer(optimizer);
+
+    for(size_t k = steps.size() - 1; k >= 1; k--){
+        Step& step = steps[k];
+        Step& prev = steps[k - 1];
+
+        if(k >= 2) prev.layer->error(step.stock->getConstError(), prev.stock->getConstDerivativeInput(), prev.stock->getError(), *step.core, video);
+
+        step.layer->grad(step.stock->getConstError(), prev.stock->getConstOut(), *step.grad, div_cost, video);
+        optimizer.update(*step.core, *step.grad, *step.state, video);
+    }
+}
+
+template<typename T>
+T ncf::ExecutionPlan<T>::fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error){
+    if(&frame.pool != &pool)
+        throw std::runtime_error("ExecutionPlan [fit]: frame doesn't use the plan's pool");
+    checkGeneration("fit");
+    checkOptimizer(optimizer);
+
+    const std::function<T(const T&)>& div_cost = std::get<0>(frame.div_cost);
+
+    T e = 1;
+    for(size_t i = 0; i < max_iterations; i++){
+        query(frame.data);
+        error(frame.answer);
+
+        e = cost(frame.cost);
+        if(e < min_error) break;
+
+        backward(div_cost, optimizer);
+        if(frame.checkpointer != nullptr) frame.checkpointer->step(net);
+    }
+
+    return e;
+}
+template<typename T>
+T ncf::ExecutionPlan<T>::fit(const FitFrame<T>& frame, const Optimizer<T>& optimizer, std::size_t max_iterations, const T& min_error, ecl::Computer& video){
+    if(&frame.pool != &pool)
+        throw std::runtime_error("ExecutionPlan [fit]: frame doesn't use the plan's pool");
+    checkGeneration("fit");
+    checkOptimizer(optimizer);
+
+    const std::string& div_cost = std::get<1>(frame.div_cost);
+
+    T e = 1;
+    for(size_t i = 0; i < max_iterations; i++){
+        query(frame.data, video);
+        error(frame.answer, video);
+
+        video >> steps.back().stock->getError();
+        e = cost(frame.cost);
+        if(e < min_error) break;
+
+        backward(div_cost, optimizer, video);
+        if(frame.checkpointer != nullptr) frame.checkpointer->step(net, video);
+    }
+
+    return e;
+}
+
+// InferencePool
+template<typename T>
+ncf::InferencePool<T>::InferencePool(const ncf::Net<T>& net, std::size_t batch) : batch(batch){
+    size_t count = net.getLayersCount();
+    if(count == 0 || batch == 0)
+        throw std::runtime_error("InferencePool: empty net or batch");
+
+    size_t widest = 0;
+    for(size_t i = 0; i < count; i++) widest = std::max(widest, net.getConstLayer(i).getNeurons());
+
+    input = mcf::Mat<T>(net.getConstLayer(0).getNeurons(), batch);
+    buffers[0] = mcf::Mat<T>(widest, batch);
+    buffers[1] = mcf::Mat<T>(widest, batch);
+
+    // layer i reads buffer (i - 1) % 2 and writes buffer i % 2
+    outs.resize(count);
+    for(size_t i = 0; i < count; i++)
+        kernel::view(outs[i], kernel::data(buffers[i % 2]), net.getConstLayer(i).getNeurons(), batch, "InferencePool");
 }
 
+// EasyCL has no sub-buffers, so on the device every view gets its own buffer
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& answer, const mcf::Mat<T>& out, mcf::Mat<T>& error) const{
-    answer.sub(out, error);
+void ncf::InferencePool<T>::send(ecl::Computer& video){
+    video << input;
+    for(auto& out : outs) video << out;
 }
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& answer, const mcf::Mat<T>& out, mcf::Mat<T>& error, ecl::Computer& video) const{
-    answer.sub(out, error, video);
+void ncf::InferencePool<T>::receive(ecl::Computer& video){
+    video >> outs.back();
 }
-
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, mcf::Mat<T>& preout, mcf::Mat<T>& error, const Layer<T>& next) const{
-    if(derivative == nullptr)
-        throw std::runtime_error("Layer [query]: derivative function unsetted");
-
-    next.getConstCore(neurons).mul(next_error, error, ncf::TRANSPOSE::FIRST);
-    preout.map(derivative, preout);
-    error.hadamard(preout, error);
+void ncf::InferencePool<T>::grab(ecl::Computer& video){
+    input.grab(video);
+    for(auto& out : outs) out.grab(video);
 }
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& next_error, mcf::Mat<T>& preout, mcf::Mat<T>& error, const Layer<T>& next, ecl::Computer& video) const{
-    next.getConstCore(neurons).mul(next_error, error, video, ncf::TRANSPOSE::FIRST);
-    preout.map(computer_derivative, preout, video);
-    error.hadamard(preout, error, video);
+void ncf::InferencePool<T>::release(ecl::Computer& video){
+    input.release(video);
+    for(auto& out : outs) out.release(video);
 }
 
-template<typename T>
-T ncf::Layer<T>::cost(const mcf::Mat<T>& error, const std::function<T(const T&)>& cost) const{
-    size_t count = error.getH() * error.getW();
-    return error.mreduce(cost) / static_cast<T>(count);
+namespace ncf{
+    template<typename T>
+    Computer& operator<<(Computer& video, InferencePool<T>& pool){
+        pool.send(video);
+        return video;
+    }
+    template<typename T>
+    Computer& operator>>(Computer& video, InferencePool<T>& pool){
+        pool.receive(video);
+        return video;
+    }
 }
 
 template<typename T>
-void ncf::Layer<T>::grad(mcf::Mat<T>& error, const mcf::Mat<T>& prev_out, mcf::Mat<T>& grad, const std::function<T(const T&)>& div_cost) const{
-    size_t count = error.getW() * error.getH();
-
-    error.map(div_cost, error);
-    error.mul(prev_out, grad, mcf::TRANSPOSE::SECOND);
-    grad.map([&](const T& v){
-        return -v / static_cast<T>(count);
-    }, grad);
+std::size_t ncf::InferencePool<T>::getBatchSize() const{
+    return batch;
 }
 template<typename T>
-void ncf::Layer<T>::grad(mcf::Mat<T>& error, const mcf::Mat<T>& prev_out, mcf::Mat<T>& grad, const std::string& div_cost, ecl::Computer& video) const{
-    std::string count = std::to_string(error.getW() * error.getH());
-
-    error.map(div_cost, error, video);
-    error.mul(prev_out, grad, video, mcf::TRANSPOSE::SECOND);
-    grad.map("ret = -v / " + count + ";", grad, video);
+std::size_t ncf::InferencePool<T>::getLayersCount() const{
+    return outs.size();
 }
 
 template<typename T>
-void ncf::Layer<T>::train(mcf::Mat<T>& grad, const Layer<T>& prev, const T& learning_rate){
-    createCore(prev.neurons);
-    optimizer::gd<T>(getCore(prev.neurons), grad, learning_rate);
+mcf::Mat<T>& ncf::InferencePool<T>::getInput(){
+    return input;
 }
 template<typename T>
-void ncf::Layer<T>::train(mcf::Mat<T>& grad, const Layer<T>& prev, const T& learning_rate, ecl::Computer& video){
-    createCore(prev.neurons, video);
-
-    optimizer::gd<T>(getCore(prev.neurons), grad, learning_rate, video);
+mcf::Mat<T>& ncf::InferencePool<T>::getOut(std::size_t index){
+    return outs.at(index);
 }
-
-// High-level methods
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, Stock<T>& stock) const{
-	query(in, stock.getOut());
+const mcf::Mat<T>& ncf::InferencePool<T>::getConstOut(std::size_t index) const{
+    return outs.at(index);
 }
 template<typename T>
-void ncf::Layer<T>::query(const mcf::Mat<T>& in, Stock<T>& stock, ecl::Computer& video) const{
-	query(in, stock.getOut(), video);
+mcf::Mat<T>& ncf::InferencePool<T>::getLastOut(){
+    return outs.back();
 }
 
+// InferenceNet
 template<typename T>
-void ncf::Layer<T>::query(const Stock<T>& prev_stock, Stock<T>& stock){
-	query(prev_stock.getConstOut(), stock.getPreout(), stock.getOut(), prev_stock.getLayer());
-}
-template<typename T>
-void ncf::Layer<T>::query(const Stock<T>& prev_stock, Stock<T>& stock, ecl::Computer& video){
-	query(prev_stock.getConstOut(), stock.getPreout(), stock.getOut(), prev_stock.getLayer(), video);
+ncf::InferenceNet<T>::InferenceNet(const Net<T>& net, const std::string& name) : name(name){
+    size_t count = net.getLayersCount();
+    if(count == 0)
+        throw std::runtime_error(name + ": empty net");
+
+    for(size_t i = 0; i < count; i++){
+        const Layer<T>& layer = net.getConstLayer(i);
+        if(layer.getPolicy().activation == nullptr && layer.getActivation() == nullptr)
+            throw std::runtime_error(name + ": layer " + std::to_string(i) + " has no activation");
+        if(i > 0 && !layer.checkCore(neurons.back()))
+            throw std::runtime_error(name + ": layer " + std::to_string(i) + " has no core");
+
+        neurons.push_back(layer.getNeurons());
+    }
 }
 
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& answer, Stock<T>& stock) const{
-	error(answer, stock.getConstOut(), stock.getError());
+void ncf::InferenceNet<T>::describe(const Net<T>& net, std::size_t layer, Stage& stage) const{
+    const Layer<T>& source = net.getConstLayer(layer);
+    stage.neurons = source.getNeurons();
+    stage.prev_neurons = layer > 0 ? net.getConstLayer(layer - 1).getNeurons() : 0;
+    stage.policy = source.getPolicy();
+    stage.activation = source.getActivation();
 }
 template<typename T>
-void ncf::Layer<T>::error(const mcf::Mat<T>& answer, Stock<T>& stock, ecl::Computer& video) const{
-	error(answer, stock.getConstOut(), stock.getError(), video);
+void ncf::InferenceNet<T>::checkInferencePool(const InferencePool<T>& pool, const mcf::Mat<T>& in, const std::string& method) const{
+    size_t count = neurons.size();
+    if(pool.getLayersCount() != count)
+        throw std::runtime_error(name + " [" + method + "]: inference pool doesn't fit the net");
+    for(size_t i = 0; i < count; i++){
+        if(pool.getConstOut(i).getH() != neurons[i])
+            throw std::runtime_error(name + " [" + method + "]: inference pool doesn't fit the net");
+    }
+    if(in.getH() != neurons.front() || in.getW() != pool.getBatchSize())
+        throw std::runtime_error(name + " [" + method + "]: invalid in size");
 }
 
 template<typename T>
-void ncf::Layer<T>::error(const Stock<T>& next_stock, Stock<T>& stock) const{
-	error(next_stock.getConstError(), stock.getPreout(), stock.getError(), next_stock.getLayer());
+void ncf::InferenceNet<T>::activateInput(const Stage& stage, const mcf::Mat<T>& in, mcf::Mat<T>& out) const{
+    std::size_t count = stage.neurons * in.getW();
+    if(stage.policy.activation_kernel != nullptr)
+        stage.policy.activation_kernel(kernel::data(in), kernel::data(out), count);
+    else activate(stage, kernel::data(in), kernel::data(out), count);
 }
 template<typename T>
-void ncf::Layer<T>::error(const Stock<T>& next_stock, Stock<T>& stock, ecl::Computer& video) const{
-	error(next_stock.getConstError(), stock.getPreout(), stock.getError(), next_stock.getLayer(), video);
+void ncf::InferenceNet<T>::activate(const Stage& stage, const T* in, T* out, std::size_t count) const{
+    // called per tile row from inside the gemm threads: the element function, not the OpenMP map kernel
+    if(stage.policy.activation != nullptr){
+        for(std::size_t c = 0; c < count; c++) out[c] = stage.policy.activation(in[c]);
+        return;
+    }
+    for(std::size_t c = 0; c < count; c++) out[c] = stage.activation(in[c]);
 }
-
 template<typename T>
-T ncf::Layer<T>::cost(const Stock<T>& stock, const std::function<T(const T&)>& cost) const{
-	return this->cost(stock.getConstError(), cost);
+void ncf::InferenceNet<T>::activateTile(const Stage& stage, const T* acc, T* out, std::size_t count) const{
+    // acc stays in registers only while its address doesn't reach the out-of-line activation
+    T preout[kernel::tile_cols];
+    std::copy(acc, acc + count, preout);
+    activate(stage, preout, out, count);
 }
 
 template<typename T>
-void ncf::Layer<T>::grad(const Stock<T>& prev_stock, Stock<T>& stock, const std::function<T(const T&)>& div_cost) const {
-	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
-	stock.createGrad(prev_neurons);
+T ncf::InferenceNet<T>::evaluate(const mcf::Mat<T>& data, const mcf::Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost){
+    std::size_t examples = data.getW();
+    std::size_t batch = pool.getBatchSize();
+    if(answer.getW() != examples || examples == 0)
+        throw std::runtime_error(name + " [evaluate]: invalid answer size");
 
-	grad(stock.getError(), prev_stock.getConstOut(), stock.getGrad(prev_neurons), div_cost);
-}
-template<typename T>
-void ncf::Layer<T>::grad(const Stock<T>& prev_stock, Stock<T>& stock, const std::string& div_cost, ecl::Computer& video) const {
-	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
-	stock.createGrad(prev_neurons, video);
+    mcf::Mat<T>& input = pool.getInput();
+    std::vector<std::size_t> index(batch);
 
-	grad(stock.getError(), prev_stock.getConstOut(), stock.getGrad(prev_neurons), div_cost, video);
-}
+    T result = 0;
+    for(std::size_t j = 0; j < examples; j += batch){
+        std::size_t count = std::min(batch, examples - j);
 
-template<typename T>
-void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate) {
-	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
+        for(std::size_t c = 0; c < batch; c++) index[c] = j + std::min(c, count - 1);
+        kernel::gather(kernel::data(data), kernel::data(input), data.getH(), examples, index.data(), batch);
+
+        result += kernel::cost(answer, examples, j, predict(input, pool), count, cost);
+    }
 
-	optimizer::gd<T>(getCore(prev_neurons), stock.getGrad(prev_neurons), learning_rate);
+    return result / static_cast<T>(answer.getH() * examples);
 }
 template<typename T>
-void ncf::Layer<T>::train(const Stock<T>& prev_stock, Stock<T>& stock, const T& learning_rate, ecl::Computer& video) {
-	std::size_t prev_neurons = prev_stock.getLayer().getNeurons();
-
-	optimizer::gd<T>(getCore(prev_neurons), stock.getGrad(prev_neurons), learning_rate, video);
+T ncf::InferenceNet<T>::delta(const Net<T>& net, const mcf::Mat<T>& data, const mcf::Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost){
+    return evaluate(data, answer, pool, cost) - net.evaluate(data, answer, pool, cost);
 }
 
-// Stock
 template<typename T>
-ncf::Stock<T>::Stock(const Layer<T>& layer, std::size_t examples) : layer(layer){
-    out = mcf::Mat<T>(layer.getNeurons(), examples);
-    preout = mcf::Mat<T>(layer.getNeurons(), examples);
-    error = mcf::Mat<T>(layer.getNeurons(), examples);
+std::size_t ncf::InferenceNet<T>::getLayersCount() const{
+    return neurons.size();
 }
 
+// QuantizedNet
 template<typename T>
-void ncf::Stock<T>::send(ecl::Computer& video){
-    for(auto& p : grad){
-        if(p.second != nullptr) video << p.second;
+ncf::QuantizedNet<T>::QuantizedNet(const Net<T>& net) : InferenceNet<T>(net, "QuantizedNet"){
+    size_t count = net.getLayersCount();
+    for(size_t i = 0; i < count; i++){
+        Stage stage;
+        this->describe(net, i, stage);
+
+        if(i > 0){
+            const Layer<T>& layer = net.getConstLayer(i);
+            stage.core.resize(stage.neurons * stage.prev_neurons);
+            stage.scale.resize(stage.neurons);
+            kernel::quantizeRows(kernel::data(layer.getConstCore(stage.prev_neurons)), stage.core.data(), stage.scale.data(), stage.neurons, stage.prev_neurons);
+        }
+        stages.push_back(std::move(stage));
     }
-    video << preout;
-    video << error;
-    video << out;
 }
+
 template<typename T>
-void ncf::Stock<T>::receive(ecl::Computer& video){
-    for(auto& p : grad){
-		bool dump = p.second != nullptr;
-        if(p.second != nullptr) video >> p.second;
+const mcf::Mat<T>& ncf::QuantizedNet<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool){
+    this->checkInferencePool(pool, in, "predict");
+
+    std::size_t examples = in.getW();
+    this->activateInput(stages[0], in, pool.getOut(0));
+
+    size_t count = stages.size();
+    for(size_t i = 1; i < count; i++){
+        const Stage& stage = stages[i];
+
+        staging.resize(stage.prev_neurons * examples);
+        staging_scale.resize(examples);
+        kernel::quantizeColumns(kernel::data(pool.getConstOut(i - 1)), staging.data(), staging_scale.data(), stage.prev_neurons, examples);
+
+        T* out = kernel::data(pool.getOut(i));
+        const T* scale = stage.scale.data();
+        const T* in_scale = staging_scale.data();
+
+        kernel::qgemm(stage.core.data(), staging.data(), stage.neurons, stage.prev_neurons, examples, [&](std::size_t r, std::size_t j, const std::int32_t* acc, std::size_t cols){
+            T preout[kernel::tile_cols];
+            for(std::size_t c = 0; c < cols; c++)
+                preout[c] = static_cast<T>(acc[c]) * scale[r] * in_scale[j + c];
+            this->activate(stage, preout, out + r * examples + j, cols);
+        });
     }
-    video >> preout;
-    video >> error;
-    video >> out;
+
+    return pool.getLastOut();
 }
+
 template<typename T>
-void ncf::Stock<T>::grab(ecl::Computer& video){
-    for(auto& p : grad){
-        if(p.second != nullptr) p.second.grab(video);
-    }
-    preout.grab(video);
-    error.grab(video);
-    out.grab(video);
+std::size_t ncf::QuantizedNet<T>::getSize() const{
+    std::size_t result = 0;
+    for(auto& stage : stages) result += stage.core.size() + stage.scale.size() * sizeof(T);
+    return result;
 }
+
+// HalfNet
 template<typename T>
-void ncf::Stock<T>::release(ecl::Computer& video){
-    for(auto& p : grad){
-        if(p.second != nullptr) p.second.release(video);
-    }
-    preout.release(video);
-    error.release(video);
-    out.release(video);
-}
+ncf::HalfNet<T>::HalfNet(const Net<T>& net, HALF format) : InferenceNet<T>(net, "HalfNet"), format(format){
+    size_t count = net.getLayersCount();
+    for(size_t i = 0; i < count; i++){
+        const Layer<T>& layer = net.getConstLayer(i);
 
-namespace ncf{
-    template<typename T>
-    Computer& operator<<(Computer& video, Stock<T>& other){
-        other.send(video);
-        return video;
-    }
-    template<typename T>
-    Computer& operator>>(Computer& video, Stock<T>& other){
-        other.receive(video);
-        return video;
-    }
-	template<typename T>
-	std::ostream& operator<<(std::ostream& s, Stock<T>& other) {
-		s << other.getConstOut();
-		return s;
-	}
-}
+        Stage stage;
+        this->describe(net, i, stage);
+        stage.computer_activation = layer.getComputerActivation();
 
-template<typename T>
-mcf::Mat<T>& ncf::Stock<T>::getPreout(){
-    return preout;
+        if(i > 0){
+            stage.core.resize(stage.neurons * stage.prev_neurons);
+            kernel::narrow(kernel::data(layer.getConstCore(stage.prev_neurons)), stage.core.data(), stage.core.size(), format);
+        }
+        stages.push_back(std::move(stage));
+    }
 }
 template<typename T>
-mcf::Mat<T>& ncf::Stock<T>::getOut(){
-    return out;
+ncf::HalfNet<T>::~HalfNet(){
+    for(auto& stage : stages) delete stage.computer_core;
 }
+
 template<typename T>
-mcf::Mat<T>& ncf::Stock<T>::getError(){
-    return error;
+void ncf::HalfNet<T>::send(ecl::Computer& video){
+    for(auto& stage : stages){
+        if(stage.core.empty()) continue;
+
+        if(stage.computer_core == nullptr)
+            stage.computer_core = new mcf::Mat<unsigned int>(1, (stage.core.size() + 1) / 2);
+        std::memcpy(kernel::data(*stage.computer_core), stage.core.data(), stage.core.size() * sizeof(std::uint16_t));
+        video << *stage.computer_core;
+    }
 }
 template<typename T>
-mcf::Mat<T>& ncf::Stock<T>::getGrad(std::size_t prev_neurons){
-    return grad.at(prev_neurons);
+void ncf::HalfNet<T>::release(ecl::Computer& video){
+    for(auto& stage : stages){
+        if(stage.computer_core == nullptr) continue;
+
+        stage.computer_core->release(video);
+        delete stage.computer_core;
+        stage.computer_core = nullptr;
+    }
 }
 
 template<typename T>
-const mcf::Mat<T>& ncf::Stock<T>::getConstPreout() const{
-    return preout;
+const mcf::Mat<T>& ncf::HalfNet<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool){
+    this->checkInferencePool(pool, in, "predict");
+
+    std::size_t examples = in.getW();
+    this->activateInput(stages[0], in, pool.getOut(0));
+
+    size_t count = stages.size();
+    for(size_t i = 1; i < count; i++){
+        const Stage& stage = stages[i];
+
+        T* out = kernel::data(pool.getOut(i));
+        kernel::hgemm(stage.core.data(), format, kernel::data(pool.getConstOut(i - 1)), stage.neurons, stage.prev_neurons, examples, [&](std::size_t r, std::size_t j, const T* acc, std::size_t cols){
+            this->activateTile(stage, acc, out + r * examples + j, cols);
+        });
+    }
+
+    return pool.getLastOut();
 }
 template<typename T>
-const mcf::Mat<T>& ncf::Stock<T>::getConstOut() const{
-    return out;
+const mcf::Mat<T>& ncf::HalfNet<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool, ecl::Computer& video){
+    this->checkInferencePool(pool, in, "predict");
+    for(size_t i = 0; i < stages.size(); i++){
+        if(stages[i].computer_activation.empty())
+            throw std::runtime_error("HalfNet [predict]: computer activation unsetted at layer " + std::to_string(i));
+    }
+
+    std::size_t examples = in.getW();
+    in.map(stages[0].computer_activation, pool.getOut(0), video);
+
+    size_t count = stages.size();
+    ecl::Var<unsigned int> e(static_cast<unsigned int>(examples));
+    for(size_t i = 1; i < count; i++){
+        const Stage& stage = stages[i];
+        if(stage.computer_core == nullptr)
+            throw std::runtime_error("HalfNet [predict]: cores aren't sent");
+
+        ecl::Var<unsigned int> p(static_cast<unsigned int>(stage.prev_neurons));
+        std::vector<ecl::ArgumentBase*> args = {
+            kernel::computer::arg(*stage.computer_core), kernel::computer::arg(pool.getConstOut(i - 1)),
+            kernel::computer::arg(pool.getOut(i)), &p, &e
+        };
+        kernel::computer::compute(video, kernel::computer::half<T>(stage.computer_activation, format), "forward", args, {stage.neurons, examples});
+    }
+
+    return pool.getLastOut();
 }
+
 template<typename T>
-const mcf::Mat<T>& ncf::Stock<T>::getConstError() const{
-    return error;
+T ncf::HalfNet<T>::evaluate(const mcf::Mat<T>& data, const mcf::Mat<T>& answer, InferencePool<T>& pool, const std::function<T(const T&)>& cost, ecl::Computer& video){
+    std::size_t examples = data.getW();
+    std::size_t batch = pool.getBatchSize();
+    if(answer.getW() != examples || examples == 0)
+        throw std::runtime_error("HalfNet [evaluate]: invalid answer size");
+
+    mcf::Mat<T>& input = pool.getInput();
+    mcf::Mat<T>& out = pool.getLastOut();
+    std::vector<std::size_t> index(batch);
+
+    T result = 0;
+    for(std::size_t j = 0; j < examples; j += batch){
+        std::size_t count = std::min(batch, examples - j);
+
+        for(std::size_t c = 0; c < batch; c++) index[c] = j + std::min(c, count - 1);
+        kernel::gather(kernel::data(data), kernel::data(input), data.getH(), examples, index.data(), batch);
+        video << input;
+
+        predict(input, pool, video);
+        video >> out;
+
+        result += kernel::cost(answer, examples, j, out, count, cost);
+    }
+
+    return result / static_cast<T>(answer.getH() * examples);
 }
 template<typename T>
-const ncf::Layer<T>& ncf::Stock<T>::getLayer() const{
-    return layer;
+ncf::HALF ncf::HalfNet<T>::getFormat() const{
+    return format;
 }
-
 template<typename T>
-bool ncf::Stock<T>::checkGrad(std::size_t prev_neurons) const{
-    if(grad.find(prev_neurons) == grad.end()) return false;
-    return true;
+std::size_t ncf::HalfNet<T>::getSize() const{
+    std::size_t result = 0;
+    for(auto& stage : stages) result += stage.core.size() * sizeof(std::uint16_t);
+    return result;
 }
+
+// LowRankNet
 template<typename T>
-void ncf::Stock<T>::createGrad(std::size_t prev_neurons){
-    if(!checkGrad(prev_neurons)){
-        if(layer.getCoreGen() == nullptr)
-            throw std::runtime_error("Stock [create grad]: layer's coregen method unsetted");
+ncf::LowRankNet<T>::LowRankNet(const Net<T>& net, const T& budget) : InferenceNet<T>(net, "LowRankNet"){
+    if(!(budget >= 0))
+        throw std::runtime_error("LowRankNet: invalid budget");
 
-        Mat<T> new_grad(layer.getNeurons(), prev_neurons);
-        layer.getCoreGen()(new_grad);
-        grad.emplace(prev_neurons, std::move(new_grad));
+    size_t count = net.getLayersCount();
+    for(size_t i = 0; i < count; i++){
+        Stage stage;
+        this->describe(net, i, stage);
+
+        if(i > 0){
+            const Layer<T>& layer = net.getConstLayer(i);
+            factorize(stage, kernel::data(layer.getConstCore(stage.prev_neurons)), budget);
+        }
+        stages.push_back(std::move(stage));
     }
 }
+
 template<typename T>
-void ncf::Stock<T>::createGrad(std::size_t prev_neurons, ecl::Computer& video) {
-	if (!checkGrad(prev_neurons)) {
-		Mat<T> new_grad(layer.getNeurons(), prev_neurons);
-		video << new_grad;
-		layer.getComputerCoreGen()(new_grad, video);
-		grad.emplace(prev_neurons, std::move(new_grad));
-	}
+void ncf::LowRankNet<T>::factorize(Stage& stage, const T* core, const T& budget){
+    const std::size_t n = stage.neurons;
+    const std::size_t p = stage.prev_neurons;
+    const std::size_t m = std::min(n, p);
+    auto store = [](double* to, std::size_t ld){
+        return [to, ld](std::size_t i, std::size_t j, const double* acc, std::size_t cols){
+            std::copy(acc, acc + cols, to + i * ld + j);
+        };
+    };
+
+    // the Gram matrix of the shorter side, in double: its eigenvalues are the squared singular values of W
+    std::vector<double> W(core, core + n * p);
+    std::vector<double> X(n <= p ? p * n : 0);
+    if(n <= p)
+        for(std::size_t i = 0; i < n; i++)
+            for(std::size_t j = 0; j < p; j++) X[j * n + i] = W[i * p + j];
+    const double* x = n <= p ? X.data() : W.data();
+
+    std::vector<double> Q(m * m), values(m);
+    kernel::gemm(x, x, m, n + p - m, m, true, store(Q.data(), m));
+    kernel::eigen(Q.data(), values.data(), m);
+
+    double total = 0;
+    for(auto& v : values) total += std::max(v, 0.0);
+
+    // the smallest rank whose discarded energy fits the budget
+    const double limit = static_cast<double>(budget) * static_cast<double>(budget) * total;
+    std::size_t rank = m;
+    double tail = 0;
+    while(rank > 1 && tail + std::max(values[rank - 1], 0.0) <= limit){
+        tail += std::max(values[rank - 1], 0.0);
+        rank--;
+    }
+
+    if(rank * (n + p) >= n * p){
+        stage.core.assign(core, core + n * p);
+        return;
+    }
+
+    // W ~ Qr^T * Qr * W on the row side or W * Qr^T * Qr on the column side, Qr the leading eigenvectors as rows
+    std::vector<double> U(n * rank), V(rank * p);
+    if(n <= p){
+        for(std::size_t i = 0; i < n; i++)
+            for(std::size_t k = 0; k < rank; k++) U[i * rank + k] = Q[k * m + i];
+        kernel::gemm(Q.data(), W.data(), rank, n, p, false, store(V.data(), p));
+    } else {
+        std::copy(Q.begin(), Q.begin() + rank * p, V.begin());
+        std::vector<double> Qt(p * rank);
+        for(std::size_t k = 0; k < rank; k++)
+            for(std::size_t j = 0; j < p; j++) Qt[j * rank + k] = Q[k * m + j];
+        kernel::gemm(W.data(), Qt.data(), n, p, rank, false, store(U.data(), rank));
+    }
+
+    stage.rank = rank;
+    stage.left.assign(U.begin(), U.end());
+    stage.right.assign(V.begin(), V.end());
 }
 
 template<typename T>
-void ncf::Stock<T>::releaseGrad(std::size_t prev_neurons){
-    auto it = grad.find(prev_neurons);
-    if(it != grad.end()){
-        grad.erase(it);
+void ncf::LowRankNet<T>::forward(const Stage& stage, const T* core, const T* in, T* out, std::size_t prev_neurons, std::size_t examples) const{
+    if(stage.policy.forward_kernel != nullptr){
+        stage.policy.forward_kernel(core, in, nullptr, out, stage.neurons, prev_neurons, examples);
+        return;
     }
-}
 
-// High-level API
+    kernel::gemm(core, in, stage.neurons, prev_neurons, examples, false, [&](std::size_t r, std::size_t j, const T* acc, std::size_t cols){
+        this->activateTile(stage, acc, out + r * examples + j, cols);
+    });
+}
 
-// Net
 template<typename T>
-void ncf::Net<T>::checkStockPool(const ncf::StockPool<T>& pool, const std::string& where) const{
-    if(pool.getStocksCount() != layers.size())
-        throw std::runtime_error("Net [" + where + "]: invalid pool");
+const mcf::Mat<T>& ncf::LowRankNet<T>::predict(const mcf::Mat<T>& in, InferencePool<T>& pool){
+    this->checkInferencePool(pool, in, "predict");
+
+    std::size_t examples = in.getW();
+    this->activateInput(stages[0], in, pool.getOut(0));
+
+    size_t count = stages.size();
+    for(size_t i = 1; i < count; i++){
+        const Stage& stage = stages[i];
+
+        const T* prev_out = kernel::data(pool.getConstOut(i - 1));
+        T* out = kernel::data(pool.getOut(i));
+        if(stage.rank == 0){
+            forward(stage, stage.core.data(), prev_out, out, stage.prev_neurons, examples);
+            continue;
+        }
+
+        staging.resize(stage.rank * examples);
+        T* inner = staging.data();
+        kernel::gemm(stage.right.data(), prev_out, stage.rank, stage.prev_neurons, examples, false, [&](std::size_t r, std::size_t j, const T* acc, std::size_t cols){
+            std::copy(acc, acc + cols, inner + r * examples + j);
+        });
+        forward(stage, stage.left.data(), inner, out, stage.rank, examples);
+    }
+
+    return pool.getLastOut();
 }
 
 template<typename T>
-ncf::Net<T>::Net() {}
+T ncf::LowRankNet<T>::deviation(const Net<T>& net, const mcf::Mat<T>& data, InferencePool<T>& pool){
+    std::size_t examples = data.getW();
+    std::size_t batch = pool.getBatchSize();
+    if(examples == 0)
+        throw std::runtime_error("LowRankNet [deviation]: empty data");
+
+    mcf::Mat<T>& input = pool.getInput();
+    std::size_t outputs = stages.back().neurons;
+    std::vector<std::size_t> index(batch);
+    std::vector<T> reference(outputs * batch);
+
+    double difference = 0, norm = 0;
+    for(std::size_t j = 0; j < examples; j += batch){
+        std::size_t count = std::min(batch, examples - j);
+
+        for(std::size_t c = 0; c < batch; c++) index[c] = j + std::min(c, count - 1);
+        kernel::gather(kernel::data(data), kernel::data(input), data.getH(), examples, index.data(), batch);
+
+        // both nets write the same pool, so the source output is copied out first
+        const T* expected = kernel::data(net.predict(input, pool));
+        std::copy(expected, expected + outputs * batch, reference.begin());
+        const T* out = kernel::data(predict(input, pool));
+
+        for(std::size_t r = 0; r < outputs; r++)
+            for(std::size_t c = 0; c < count; c++){
+                double d = static_cast<double>(out[r * batch + c]) - static_cast<double>(reference[r * batch + c]);
+                difference += d * d;
+                norm += static_cast<double>(reference[r * batch + c]) * static_cast<double>(reference[r * batch + c]);
+            }
+    }
+
+    return norm > 0 ? static_cast<T>(std::sqrt(difference / norm)) : static_cast<T>(std::sqrt(difference));
+}
 
 template<typename T>
-ncf::Net<T>::Net(const std::vector<std::size_t>& neurons){
-    for(auto n : neurons)
-        layers.push_back(std::make_pair(new Layer<T>(n), true));
+std::size_t ncf::LowRankNet<T>::getRank(std::size_t layer) const{
+    if(layer >= stages.size())
+        throw std::runtime_error("LowRankNet [getRank]: invalid layer");
+    return stages[layer].rank;
 }
 template<typename T>
-ncf::Net<T>::Net(const std::vector<Layer<T>*>& layers) {
-	for (auto* l : layers)
-		this->layers.push_back(std::make_pair(l, false));
+std::size_t ncf::LowRankNet<T>::getFlops() const{
+    std::size_t result = 0;
+    for(auto& stage : stages) result += stage.rank == 0 ? stage.core.size() : stage.left.size() + stage.right.size();
+    return result;
 }
-
 template<typename T>
-void ncf::Net<T>::send(ecl::Computer& video){
-    for(auto& p : layers) p.first->send(video);
+std::size_t ncf::LowRankNet<T>::getDenseFlops() const{
+    std::size_t result = 0;
+    for(auto& stage : stages) result += stage.neurons * stage.prev_neurons;
+    return result;
 }
 template<typename T>
-void ncf::Net<T>::receive(ecl::Computer& video){
-    for(auto& p : layers) p.first->receive(video);
+std::size_t ncf::LowRankNet<T>::getSize() const{
+    return getFlops() * sizeof(T);
 }
 template<typename T>
-void ncf::Net<T>::grab(ecl::Computer& video){
-    for(auto& p : layers) p.first->grab(video);
+std::size_t ncf::LowRankNet<T>::getDenseSize() const{
+    return getDenseFlops() * sizeof(T);
+}
+
+// Files
+inline std::size_t ncf::format::align(std::size_t offset, std::size_t alignment){
+    return (offset + alignment - 1) / alignment * alignment;
 }
+
 template<typename T>
-void ncf::Net<T>::release(ecl::Computer& video){
-    for(auto& p : layers) p.first->release(video);
+std::uint32_t ncf::format::dtype(){
+    if constexpr (std::is_same_v<T, float>) return 1;
+    else if constexpr (std::is_same_v<T, double>) return 2;
+    else if constexpr (std::is_same_v<T, std::int32_t>) return 3;
+    else if constexpr (std::is_same_v<T, std::int8_t>) return 4;
+    else if constexpr (std::is_same_v<T, std::uint16_t>) return 5;
+    else static_assert(!std::is_same_v<T, T>, "Format: unsupported type");
 }
 
-namespace ncf{
-    template<typename T>
-    Computer& operator<<(Computer& video, Net<T>& net){
-        net.send(video);
-        return video;
-    }
-    template<typename T>
-    Computer& operator>>(Computer& video, Net<T>& net){
-        net.receive(video);
-        return video;
+#ifdef _WIN32
+inline void ncf::format::commit(const std::string& path, const char* data, std::size_t size){
+    std::string temporary = path + ".tmp";
+    HANDLE file = CreateFileA(temporary.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Format [commit]: can't open '" + temporary + "'");
+
+    bool ok = true;
+    while(ok && size > 0){
+        DWORD count = 0;
+        ok = WriteFile(file, data, static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30)), &count, nullptr) && count > 0;
+        data += count;
+        size -= count;
     }
+    ok = ok && FlushFileBuffers(file);
+    CloseHandle(file);
+
+    if(!ok || !MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        throw std::runtime_error("Format [commit]: write to '" + path + "' failed");
 }
+#else
+inline void ncf::format::commit(const std::string& path, const char* data, std::size_t size){
+    std::string temporary = path + ".tmp";
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file < 0)
+        throw std::runtime_error("Format [commit]: can't open '" + temporary + "'");
+
+    bool ok = true;
+    while(ok && size > 0){
+        ssize_t count = write(file, data, size);
+        if(count < 0 && errno == EINTR) continue;
+        ok = count > 0;
+        if(ok){
+            data += count;
+            size -= static_cast<std::size_t>(count);
+        }
+    }
+    ok = ok && fsync(file) == 0;
+    close(file);
 
-template<typename T>
-void ncf::Net<T>::push_back(Layer<T>* layer) {
-	layers.push_back(std::make_pair(layer, false));
+    if(!ok || std::rename(temporary.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Format [commit]: write to '" + path + "' failed");
 }
-template<typename T>
-ncf::Layer<T>* ncf::Net<T>::pop_back() {
-	Layer<T>* result = layers.back().first;
-	layers.pop_back();
-	return result;
+#endif
+
+inline void ncf::format::pad(std::ofstream& file, std::size_t offset){
+    static const char zeros[page] = {};
+    std::size_t position = static_cast<std::size_t>(file.tellp());
+    if(offset < position)
+        throw std::runtime_error("Format [pad]: offset is behind the write position");
+    while(position < offset){
+        std::size_t count = std::min(offset - position, page);
+        file.write(zeros, count);
+        position += count;
+    }
 }
 
 template<typename T>
-void ncf::Net<T>::setActivations(const std::function<T(const T&)>& activation){
-    for(auto& p : layers) p.first->setActivation(activation);
-}
-template<typename T>
-void ncf::Net<T>::setDerivatives(const std::function<T(const T&)>& derivative){
-    for(auto& p : layers) p.first->setDerivative(derivative);
+T ncf::format::parse(const char*& p, const char* end){
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    while(p < end && (*p == ' ' || *p == '\t')) p++;
+
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    std::uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    const char* start = p;
+
+    for(; p < end && *p >= '0' && *p <= '9'; p++){
+        if(digits < 19){ mantissa = mantissa * 10 + static_cast<std::uint64_t>(*p - '0'); if(mantissa) digits++; }
+        else exponent++;
+    }
+    if(p < end && *p == '.'){
+        p++;
+        for(; p < end && *p >= '0' && *p <= '9'; p++){
+            if(digits < 19){ mantissa = mantissa * 10 + static_cast<std::uint64_t>(*p - '0'); if(mantissa) digits++; exponent--; }
+        }
+    }
+    if(p == start || (p == start + 1 && *start == '.'))
+        throw std::runtime_error("Format [parse]: number expected");
+
+    if(p < end && (*p == 'e' || *p == 'E')){
+        const char* q = p + 1;
+        bool negative_exponent = false;
+        if(q < end && (*q == '-' || *q == '+')) negative_exponent = *q++ == '-';
+        if(q < end && *q >= '0' && *q <= '9'){
+            int e = 0;
+            for(; q < end && *q >= '0' && *q <= '9'; q++) e = std::min(e * 10 + (*q - '0'), 100000);
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    double value = static_cast<double>(mantissa);
+    if(exponent != 0 && mantissa != 0){
+        if(exponent > 0 && exponent <= 22) value *= powers[exponent];
+        else if(exponent < 0 && exponent >= -22) value /= powers[-exponent];
+        else value *= std::pow(10.0, exponent);
+    }
+
+    return static_cast<T>(negative ? -value : value);
 }
 
-template<typename T>
-void ncf::Net<T>::setActivations(const std::string& activation){
-    for(auto& p : layers) p.first->setActivation(activation);
+// MappedFile
+#ifdef _WIN32
+inline ncf::MappedFile::MappedFile(const std::string& path, MAP mode){
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("MappedFile: can't open '" + path + "'");
+
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    size = static_cast<std::size_t>(file_size.QuadPart);
+    if(size == 0) return;
+
+    mapping = CreateFileMappingA(file, nullptr, mode == MAP::READ ? PAGE_READONLY : PAGE_WRITECOPY, 0, 0, nullptr);
+    if(mapping != nullptr)
+        data = static_cast<char*>(MapViewOfFile(mapping, mode == MAP::READ ? FILE_MAP_READ : FILE_MAP_COPY, 0, 0, 0));
+
+    if(data == nullptr){
+        if(mapping != nullptr) CloseHandle(mapping);
+        CloseHandle(file);
+        throw std::runtime_error("MappedFile: can't map '" + path + "'");
+    }
 }
-template<typename T>
-void ncf::Net<T>::setDerivatives(const std::string& derivative){
-    for(auto& p : layers) p.first->setDerivative(derivative);
+inline ncf::MappedFile::~MappedFile(){
+    if(data != nullptr) UnmapViewOfFile(data);
+    if(mapping != nullptr) CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
 }
-
-template<typename T>
-void ncf::Net<T>::setCoreGens(const std::function<void(mcf::Mat<T>&)>& coregen){
-    for(auto& p : layers) p.first->setCoreGen(coregen);
+#else
+inline ncf::MappedFile::MappedFile(const std::string& path, MAP mode){
+    file = open(path.c_str(), O_RDONLY);
+    if(file < 0)
+        throw std::runtime_error("MappedFile: can't open '" + path + "'");
+
+    struct stat info;
+    if(fstat(file, &info) != 0){
+        close(file);
+        throw std::runtime_error("MappedFile: can't stat '" + path + "'");
+    }
+    size = static_cast<std::size_t>(info.st_size);
+    if(size == 0) return;
+
+    // private mappings are copy-on-write: pages stay shared until someone writes
+    int protection = mode == MAP::READ ? PROT_READ : PROT_READ | PROT_WRITE;
+    void* result = mmap(nullptr, size, protection, MAP_PRIVATE, file, 0);
+    if(result == MAP_FAILED){
+        close(file);
+        throw std::runtime_error("MappedFile: can't map '" + path + "'");
+    }
+    data = static_cast<char*>(result);
 }
-template<typename T>
-void ncf::Net<T>::setCoreGens(const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen){
-    for(auto& p : layers) p.first->setCoreGen(coregen);
+inline ncf::MappedFile::~MappedFile(){
+    if(data != nullptr) munmap(data, size);
+    if(file >= 0) close(file);
 }
+#endif
 
-template<typename T>
-void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const std::function<T(const T&)>& activation){
-    for(auto n : indexes) layers.at(n).first->setActivation(activation);
+inline char* ncf::MappedFile::getData(){
+    return data;
 }
-template<typename T>
-void ncf::Net<T>::setDerivatives(const std::vector<std::size_t>& indexes, const std::function<T(const T&)>& derivative){
-    for(auto n : indexes) layers.at(n).first->setDerivative(derivative);
+inline const char* ncf::MappedFile::getConstData() const{
+    return data;
+}
+inline std::size_t ncf::MappedFile::getSize() const{
+    return size;
 }
 
+// Dataset
 template<typename T>
-void ncf::Net<T>::setActivations(const std::vector<std::size_t>& indexes, const std::string& activation){
-    for(auto n : indexes) layers.at(n).first->setActivation(activation);
+ncf::Dataset<T>::Dataset(const std::string& path) : file(path, MAP::PRIVATE){
+    if(file.getSize() < sizeof(Header))
+        throw std::runtime_error("Dataset: '" + path + "' is too small");
+    std::memcpy(&header, file.getConstData(), sizeof(Header));
+
+    if(std::memcmp(header.magic, "NCFD", 4) != 0)
+        throw std::runtime_error("Dataset: '" + path + "' is not a dataset");
+    if(header.version != version)
+        throw std::runtime_error("Dataset: unsupported version " + std::to_string(header.version));
+    if(header.dtype != format::dtype<T>() || header.dtype_size != sizeof(T))
+        throw std::runtime_error("Dataset: dtype mismatch");
+
+    std::size_t data_end = header.data_offset + header.data_stride * header.batches;
+    std::size_t answer_end = header.answer_offset + header.answer_stride * header.batches;
+    if(std::max(data_end, answer_end) > file.getSize())
+        throw std::runtime_error("Dataset: '" + path + "' is truncated");
 }
+
 template<typename T>
-void ncf::Net<T>::setDerivatives(const std::vector<std::size_t>& indexes, const std::string& derivative){
-    for(auto n : indexes) layers.at(n).first->setDerivative(derivative);
+void ncf::Dataset<T>::save(const std::string& path, const mcf::Mat<T>& data, const mcf::Mat<T>& answer, std::size_t batch){
+    std::size_t examples = data.getW();
+    if(answer.getW() != examples || examples == 0)
+        throw std::runtime_error("Dataset [save]: data and answer examples mismatch");
+    if(batch == 0)
+        throw std::runtime_error("Dataset [save]: invalid batch size");
+
+    Header h = {};
+    std::memcpy(h.magic, "NCFD", 4);
+    h.version = version;
+    h.dtype = format::dtype<T>();
+    h.dtype_size = sizeof(T);
+    h.inputs = data.getH();
+    h.outputs = answer.getH();
+    h.examples = examples;
+    h.batch = batch;
+    h.batches = (examples + batch - 1) / batch;
+    h.data_offset = format::align(sizeof(Header), format::page);
+    h.data_stride = format::align(h.inputs * batch * sizeof(T), format::line);
+    h.answer_offset = format::align(h.data_offset + h.data_stride * h.batches, format::page);
+    h.answer_stride = format::align(h.outputs * batch * sizeof(T), format::line);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out)
+        throw std::runtime_error("Dataset [save]: can't open '" + path + "'");
+    out.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+
+    // the tail batch wraps around to the first examples, so every batch is full
+    std::vector<T> block;
+    auto write = [&](const mcf::Mat<T>& A, std::size_t offset, std::size_t stride){
+        const T* src = kernel::data(A);
+        std::size_t rows = A.getH();
+        block.resize(rows * batch);
+
+        for(std::size_t b = 0; b < h.batches; b++){
+            for(std::size_t r = 0; r < rows; r++)
+                for(std::size_t c = 0; c < batch; c++)
+                    block[r * batch + c] = src[r * examples + (b * batch + c) % examples];
+
+            format::pad(out, offset + b * stride);
+            out.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(T));
+        }
+        format::pad(out, offset + h.batches * stride);
+    };
+    write(data, h.data_offset, h.data_stride);
+    write(answer, h.answer_offset, h.answer_stride);
+
+    if(!out)
+        throw std::runtime_error("Dataset [save]: write to '" + path + "' failed");
 }
 
 template<typename T>
-void ncf::Net<T>::setCoreGens(const std::vector<std::size_t>& indexes, const std::function<void(mcf::Mat<T>&)>& coregen){
-    for(auto n : indexes) layers.at(n).first->setCoreGen(coregen);
+std::size_t ncf::Dataset<T>::getInputs() const{
+    return header.inputs;
 }
 template<typename T>
-void ncf::Net<T>::setCoreGens(const std::vector<std::size_t>& indexes, const std::function<void(mcf::Mat<T>&, ecl::Computer&)>& coregen){
-    for(auto n : indexes) layers.at(n).first->setCoreGen(coregen);
+std::size_t ncf::Dataset<T>::getOutputs() const{
+    return header.outputs;
 }
-
 template<typename T>
-std::size_t ncf::Net<T>::getLayersCount() const{
-    return layers.size();
+std::size_t ncf::Dataset<T>::getExamples() const{
+    return header.examples;
 }
 template<typename T>
-const ncf::Layer<T>& ncf::Net<T>::getConstLayer(std::size_t index) const{
-    return *layers.at(index).first;
+std::size_t ncf::Dataset<T>::getBatchSize() const{
+    return header.batch;
 }
-
 template<typename T>
-ncf::Layer<T>& ncf::Net<T>::getLayer(std::size_t index){
-    return *layers.at(index).first;
+std::size_t ncf::Dataset<T>::getBatchesCount() const{
+    return header.batches;
 }
 
 template<typename T>
-void ncf::Net<T>::query(const mcf::Mat<T>& in, StockPool<T>& pool){
-    checkStockPool(pool, "query");
-
-    layers.at(0).first->query(in, pool.getStock(0));
-
-    size_t count = pool.getStocksCount();
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i));
+mcf::Mat<T> ncf::Dataset<T>::getData(std::size_t batch){
+    if(batch >= header.batches)
+        throw std::runtime_error("Dataset [get data]: batch out of range");
+    T* block = reinterpret_cast<T*>(file.getData() + header.data_offset + batch * header.data_stride);
+    mcf::Mat<T> result;
+    kernel::view(result, block, header.inputs, header.batch, "Dataset [get data]");
+    return result;
 }
 template<typename T>
-void ncf::Net<T>::query(const mcf::Mat<T>& in, StockPool<T>& pool, ecl::Computer& video){
-    checkStockPool(pool, "query");
-
-    layers.at(0).first->query(in, pool.getStock(0), video);
-
-    size_t count = pool.getStocksCount();
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->query(pool.getStock(i - 1), pool.getStock(i), video);
+mcf::Mat<T> ncf::Dataset<T>::getAnswer(std::size_t batch){
+    if(batch >= header.batches)
+        throw std::runtime_error("Dataset [get answer]: batch out of range");
+    T* block = reinterpret_cast<T*>(file.getData() + header.answer_offset + batch * header.answer_stride);
+    mcf::Mat<T> result;
+    kernel::view(result, block, header.outputs, header.batch, "Dataset [get answer]");
+    return result;
 }
 
+// CSV
 template<typename T>
-void ncf::Net<T>::error(const mcf::Mat<T>& answer, StockPool<T>& pool){
-    checkStockPool(pool, "error");
+ncf::CSV<T>::CSV(const std::string& path, std::size_t inputs, char delimiter, bool header, std::size_t threads){
+    auto start = std::chrono::steady_clock::now();
 
-    size_t count = pool.getStocksCount();
-    size_t last = count - 1;
+    MappedFile file(path, MAP::READ);
+    const char* begin = file.getConstData();
+    const char* end = begin + file.getSize();
+    bytes = file.getSize();
 
-    layers.at(last).first->error(answer, pool.getStock(last));
+    if(header){
+        while(begin < end && *begin != '\n') begin++;
+        if(begin < end) begin++;
+    }
 
-    for(int i = last - 1; i >= 1; i--)
-        layers.at(i).first->error(pool.getConstStock(i + 1), pool.getStock(i));
-}
-template<typename T>
-void ncf::Net<T>::error(const mcf::Mat<T>& answer, StockPool<T>& pool, ecl::Computer& video){
-    checkStockPool(pool, "error");
+    auto lineEnd = [end](const char* p){
+        const char* q = static_cast<const char*>(std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+        return q == nullptr ? end : q;
+    };
+    auto blank = [](const char* p, const char* q){
+        for(; p < q; p++){
+            if(*p != ' ' && *p != '\t' && *p != '\r') return false;
+        }
+        return true;
+    };
 
-    size_t count = pool.getStocksCount();
-    size_t last = count - 1;
+    // columns come from the first non-empty line
+    std::size_t columns = 0;
+    for(const char* p = begin; p < end;){
+        const char* q = lineEnd(p);
+        if(!blank(p, q)){
+            columns = static_cast<std::size_t>(std::count(p, q, delimiter)) + 1;
+            break;
+        }
+        p = q + 1;
+    }
+    if(columns <= inputs)
+        throw std::runtime_error("CSV: '" + path + "' has no answer columns");
+
+    // byte ranges split on line boundaries
+    if(threads == 0) threads = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::size_t total = static_cast<std::size_t>(end - begin);
+    threads = std::max<std::size_t>(std::min(threads, total / 4096), 1);
+
+    std::vector<const char*> bounds(threads + 1);
+    bounds[0] = begin;
+    bounds[threads] = end;
+    for(std::size_t t = 1; t < threads; t++){
+        const char* p = std::max(begin + total * t / threads, bounds[t - 1]);
+        // the last line may have no newline, end + 1 would point past the mapping
+        const char* q = p >= end ? end : lineEnd(p);
+        bounds[t] = q == end ? end : q + 1;
+    }
 
-    layers.at(last).first->error(answer, pool.getStock(last), video);
+    std::vector<std::size_t> lines(threads + 1, 0);
+    #pragma omp parallel for num_threads(threads) schedule(static, 1)
+    for(std::size_t t = 0; t < threads; t++){
+        std::size_t count = 0;
+        for(const char* p = bounds[t]; p < bounds[t + 1];){
+            const char* q = lineEnd(p);
+            if(!blank(p, q)) count++;
+            p = q + 1;
+        }
+        lines[t + 1] = count;
+    }
+    std::partial_sum(lines.begin(), lines.end(), lines.begin());
+
+    std::size_t examples = lines[threads];
+    std::size_t outputs = columns - inputs;
+    data = Mat<T>(inputs, examples);
+    answer = Mat<T>(outputs, examples);
+
+    T* d = kernel::data(data);
+    T* a = kernel::data(answer);
+
+    std::vector<std::string> errors(threads);
+    #pragma omp parallel for num_threads(threads) schedule(static, 1)
+    for(std::size_t t = 0; t < threads; t++){
+        std::size_t example = lines[t];
+        try{
+            for(const char* p = bounds[t]; p < bounds[t + 1];){
+                const char* q = lineEnd(p);
+                if(blank(p, q)){
+                    p = q + 1;
+                    continue;
+                }
+
+                for(std::size_t c = 0; c < columns; c++){
+                    T v = format::parse<T>(p, q);
+                    while(p < q && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+
+                    if(c < inputs) d[c * examples + example] = v;
+                    else a[(c - inputs) * examples + example] = v;
+
+                    if(c + 1 < columns){
+                        if(p >= q || *p != delimiter)
+                            throw std::runtime_error("example " + std::to_string(example + 1) + ": expected " + std::to_string(columns) + " fields");
+                        p++;
+                    }
+                }
+                if(p != q)
+                    throw std::runtime_error("example " + std::to_string(example + 1) + ": unexpected characters");
+
+                example++;
+                p = q + 1;
+            }
+        } catch(const std::exception& e){
+            errors[t] = e.what();
+        }
+    }
+    for(auto& e : errors){
+        if(!e.empty())
+            throw std::runtime_error("CSV: '" + path + "' " + e);
+    }
 
-    for(int i = last - 1; i >= 1; i--)
-        layers.at(i).first->error(pool.getConstStock(i + 1), pool.getStock(i), video);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
 template<typename T>
-T ncf::Net<T>::cost(const StockPool<T>& pool, const std::function<T(const T&)>& cost) const{
-    checkStockPool(pool, "cost");
-
-    size_t count = pool.getStocksCount();
-    size_t last = count - 1;
-
-    return layers.at(last).first->cost(pool.getConstStock(last), cost);
+mcf::Mat<T>& ncf::CSV<T>::getData(){
+    return data;
 }
-
 template<typename T>
-void ncf::Net<T>::grad(StockPool<T>& pool, const std::function<T(const T&)>& div_cost){
-    checkStockPool(pool, "grad");
-
-    size_t count = pool.getStocksCount();
-    
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->grad(pool.getConstStock(i - 1), pool.getStock(i), div_cost);
+mcf::Mat<T>& ncf::CSV<T>::getAnswer(){
+    return answer;
 }
-template<typename T>
-void ncf::Net<T>::grad(StockPool<T>& pool, const std::string& div_cost, ecl::Computer& video){
-    checkStockPool(pool, "grad");
 
-    size_t count = pool.getStocksCount();
-    
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->grad(pool.getConstStock(i - 1), pool.getStock(i), div_cost, video);
+template<typename T>
+std::size_t ncf::CSV<T>::getBytes() const{
+    return bytes;
 }
-
 template<typename T>
-void ncf::Net<T>::train(StockPool<T>& pool, const T& learning_rate){
-    checkStockPool(pool, "train");
-
-    size_t count = pool.getStocksCount();
-    
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->train(pool.getConstStock(i - 1), pool.getStock(i), learning_rate);
+double ncf::CSV<T>::getSeconds() const{
+    return seconds;
 }
 template<typename T>
-void ncf::Net<T>::train(StockPool<T>& pool, const T& learning_rate, ecl::Computer& video){
-    checkStockPool(pool, "train");
-
-    size_t count = pool.getStocksCount();
-    
-    for(size_t i = 1; i < count; i++)
-        layers.at(i).first->train(pool.getConstStock(i - 1), pool.getStock(i), learning_rate, video);
+double ncf::CSV<T>::getThroughput() const{
+    return seconds > 0 ? static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds : 0;
 }
 
+// Prefetcher
 template<typename T>
-T ncf::Net<T>::fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error) {
-	const mcf::Mat<T>& data = frame.data;
-	const mcf::Mat<T>& answer = frame.answer;
-	StockPool<T>& pool = frame.pool;
-	const std::function<T(const T&)>& cost = frame.cost;
-	const std::function<T(const T&)>& div_cost = std::get<0>(frame.div_cost);
-
-	T e = 1;
-	for (size_t i = 0; i < max_iterations; i++) {
-		query(data, pool);
-		error(answer, pool);
-
-		e = this->cost(pool, cost);
-		if (e < min_error) break;
-
-		grad(pool, div_cost);
-		train(pool, learning_rate);
-	}
-
-	return e;
+ncf::Prefetcher<T>::Prefetcher(std::size_t inputs, std::size_t outputs, std::size_t batch, const Loader& loader, std::size_t capacity) : loader(loader){
+    if(capacity < 2)
+        throw std::runtime_error("Prefetcher: at least two slots are required");
+    if(batch == 0)
+        throw std::runtime_error("Prefetcher: batch size must be positive");
+    if(loader == nullptr)
+        throw std::runtime_error("Prefetcher: loader unsetted");
+
+    for(std::size_t i = 0; i < capacity; i++)
+        slots.push_back({Mat<T>(inputs, batch), Mat<T>(outputs, batch)});
+
+    thread = std::thread(&Prefetcher<T>::run, this);
 }
 template<typename T>
-T ncf::Net<T>::fit(const FitFrame<T>& frame, const T& learning_rate, std::size_t max_iterations, const T& min_error, ecl::Computer& video) {
-	const mcf::Mat<T>& data = frame.data;
-	const mcf::Mat<T>& answer = frame.answer;
-	StockPool<T>& pool = frame.pool;
-	const std::function<T(const T&)>& cost = frame.cost;
-	const std::string& div_cost = std::get<1>(frame.div_cost);
+ncf::Prefetcher<T>::Prefetcher(const mcf::Mat<T>& data, const mcf::Mat<T>& answer, const Batching& batching, std::size_t capacity) :
+    Prefetcher(data.getH(), answer.getH(), batching.size, [&data, &answer, batching, position = std::size_t(0), permutation = std::vector<std::size_t>(), index = std::vector<std::size_t>(), generator = std::mt19937_64(batching.seed)](mcf::Mat<T>& d, mcf::Mat<T>& a) mutable {
+        std::size_t examples = data.getW();
+        if(permutation.empty()){
+            permutation.resize(examples);
+            index.resize(batching.size);
+            std::iota(permutation.begin(), permutation.end(), 0);
+            if(batching.shuffle) std::shuffle(permutation.begin(), permutation.end(), generator);
+        }
 
-	T e = 1;
-	for (size_t i = 0; i < max_iterations; i++) {
-		query(data, pool, video);
-		error(answer, pool, video);
+        for(std::size_t c = 0; c < batching.size; c++){
+            index[c] = permutation[position++];
+            if(position == examples){
+                position = 0;
+                if(batching.shuffle) std::shuffle(permutation.begin(), permutation.end(), generator);
+            }
+        }
 
-		video >> pool.getStock(pool.getStocksCount() - 1).getError();
-		e = this->cost(pool, cost);
-		if (e < min_error) break;
+        kernel::gather(kernel::data(data), kernel::data(d), data.getH(), examples, index.data(), batching.size);
+        kernel::gather(kernel::data(answer), kernel::data(a), answer.getH(), examples, index.data(), batching.size);
+    }, capacity) {}
 
-		grad(pool, div_cost, video);
-		train(pool, learning_rate, video);
-	}
+template<typename T>
+void ncf::Prefetcher<T>::run(){
+    std::size_t tail = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // the slot handed out to training stays counted until it is released
+            emptied.wait(lock, [&]{ return stopping || ready < slots.size(); });
+            if(stopping) return;
+        }
 
-	return e;
-}
+        try{
+            loader(slots[tail].data, slots[tail].answer);
+        } catch(...){
+            std::lock_guard<std::mutex> lock(mutex);
+            failure = std::current_exception();
+            filled.notify_all();
+            return;
+        }
 
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready++;
+        }
+        filled.notify_one();
+        tail = (tail + 1) % slots.size();
+    }
+}
 
 template<typename T>
-ncf::Net<T>::~Net(){
-    for(auto& p : layers){
-        if(p.second == true) delete p.first;
+void ncf::Prefetcher<T>::send(ecl::Computer& video){
+    for(auto& slot : slots) video << slot.data << slot.answer;
+}
+template<typename T>
+void ncf::Prefetcher<T>::release(ecl::Computer& video){
+    for(auto& slot : slots){
+        slot.data.release(video);
+        slot.answer.release(video);
     }
-    layers.clear();
 }
 
-
-// StockPool
 template<typename T>
-ncf::StockPool<T>::StockPool() {}
+std::pair<mcf::Mat<T>&, mcf::Mat<T>&> ncf::Prefetcher<T>::acquire(){
+    release();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    filled.wait(lock, [&]{ return ready > 0 || failure != nullptr; });
+    if(ready == 0)
+        std::rethrow_exception(failure);
 
+    acquired = true;
+    Slot& slot = slots[head];
+    return {slot.data, slot.answer};
+}
 template<typename T>
-ncf::StockPool<T>::StockPool(const ncf::Net<T>& net, std::size_t examples){
-    size_t count = net.getLayersCount();
-    for(size_t i = 0; i < count; i++)
-        stocks.push_back(std::make_pair(new Stock<T>(net.getConstLayer(i), examples), true));
+void ncf::Prefetcher<T>::release(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!acquired) return;
+
+        acquired = false;
+        ready--;
+        head = (head + 1) % slots.size();
+    }
+    emptied.notify_one();
 }
 
-
 template<typename T>
-void ncf::StockPool<T>::send(ecl::Computer& video){
-    for(auto& p : stocks) p.first->send(video);
+std::size_t ncf::Prefetcher<T>::getCapacity() const{
+    return slots.size();
 }
 template<typename T>
-void ncf::StockPool<T>::receive(ecl::Computer& video){
-    for(auto& p : stocks) p.first->receive(video);
+std::size_t ncf::Prefetcher<T>::getBatchSize() const{
+    return slots.front().data.getW();
 }
+
 template<typename T>
-void ncf::StockPool<T>::grab(ecl::Computer& video){
-    for(auto& p : stocks) p.first->grab(video);
+ncf::Prefetcher<T>::~Prefetcher(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    emptied.notify_all();
+    if(thread.joinable()) thread.join();
 }
+
+// Checkpointer
 template<typename T>
-void ncf::StockPool<T>::release(ecl::Computer& video){
-    for(auto& p : stocks) p.first->release(video);
+ncf::Checkpointer<T>::Checkpointer(const std::string& path, std::size_t interval) : path(path), interval(interval){
+    if(interval == 0)
+        throw std::runtime_error("Checkpointer: zero interval");
+
+    thread = std::thread(&Checkpointer<T>::run, this);
 }
 
-namespace ncf{
-    template<typename T>
-    Computer& operator<<(Computer& video, StockPool<T>& pool){
-        pool.send(video);
-        return video;
+template<typename T>
+void ncf::Checkpointer<T>::run(){
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+        // a pending snapshot is still written when the checkpointer stops
+        queued.wait(lock, [&]{ return stopping || pending; });
+        if(!pending) return;
+
+        lock.unlock();
+        std::exception_ptr result = nullptr;
+        try{
+            format::commit(path, staging.data(), staging.size());
+        } catch(...){
+            result = std::current_exception();
+        }
+        lock.lock();
+
+        if(result != nullptr) failure = result;
+        else written++;
+        pending = false;
+        done.notify_all();
     }
-    template<typename T>
-    Computer& operator>>(Computer& video, StockPool<T>& pool){
-        pool.receive(video);
-        return video;
+}
+
+template<typename T>
+void ncf::Checkpointer<T>::settle(std::unique_lock<std::mutex>& lock){
+    done.wait(lock, [&]{ return !pending; });
+    if(failure != nullptr){
+        std::exception_ptr result = failure;
+        failure = nullptr;
+        std::rethrow_exception(result);
     }
-	template<typename T>
-	std::ostream& operator<<(std::ostream& s, StockPool<T>& pool) {
-		s << pool.getStock(pool.getStocksCount() - 1);
-		return s;
-	}
 }
 
 template<typename T>
-void ncf::StockPool<T>::push_back(Stock<T>* stock) {
-	stocks.push_back(std::make_pair(stock, false));
+void ncf::Checkpointer<T>::step(const Net<T>& net){
+    if(++iterations % interval == 0) take(net);
 }
 template<typename T>
-ncf::Stock<T>* ncf::StockPool<T>::pop_back() {
-	Layer<T>* result = stocks.back().first;
-	stocks.pop_back();
-	return result;
+void ncf::Checkpointer<T>::step(Net<T>& net, ecl::Computer& video){
+    if(++iterations % interval == 0) take(net, video);
 }
 
 template<typename T>
-std::size_t ncf::StockPool<T>::getStocksCount() const{
-    return stocks.size();
+void ncf::Checkpointer<T>::take(const Net<T>& net){
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        settle(lock);
+        net.snapshot(staging);
+        pending = true;
+    }
+    queued.notify_one();
 }
 template<typename T>
-const ncf::Stock<T>& ncf::StockPool<T>::getConstStock(std::size_t index) const{
-    return *stocks.at(index).first;
+void ncf::Checkpointer<T>::take(Net<T>& net, ecl::Computer& video){
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        settle(lock);
+        net.snapshot(staging, video);
+        pending = true;
+    }
+    queued.notify_one();
 }
 
 template<typename T>
-ncf::Stock<T>& ncf::StockPool<T>::getStock(std::size_t index){
-    return *stocks.at(index).first;
+void ncf::Checkpointer<T>::wait(){
+    std::unique_lock<std::mutex> lock(mutex);
+    settle(lock);
 }
+
 template<typename T>
-ncf::Stock<T>& ncf::StockPool<T>::getLastStock() {
-	return *stocks.back().first;
+std::size_t ncf::Checkpointer<T>::getInterval() const{
+    return interval;
+}
+template<typename T>
+std::size_t ncf::Checkpointer<T>::getWrittenCount() const{
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
 }
-
 
 template<typename T>
-ncf::StockPool<T>::~StockPool(){
-    for(auto& p : stocks){
-        if(p.second == true) delete p.first;
+ncf::Checkpointer<T>::~Checkpointer(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
     }
-    stocks.clear();
-}
\ No newline at end of file
+    queued.notify_all();
+    if(thread.joinable()) thread.join();
+}